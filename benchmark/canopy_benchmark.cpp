@@ -0,0 +1,290 @@
+// Standard Library Headers
+#include <iostream>
+#include <vector>
+#include <array>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <string>
+#include <cmath>
+
+// OpenMP (for the wall clock timer)
+#include <omp.h>
+
+// The canopy forest headers
+#include <canopy/classifier/classifier.hpp>
+#include <canopy/circularRegressor/circularRegressor.hpp>
+
+/* This programme benchmarks the training and prediction routines of the canopy
+library on synthetic data and emits the results in CSV format on standard
+output, so that performance changes between releases can be tracked
+automatically.
+
+For each combination of forest size, tree depth, number of classes (classifier
+only) and prediction batch size, the programme trains a model and then times
+repeated calls to each of the main prediction methods. Each row of the output
+reports the throughput (data points processed per second) and the 50th, 90th
+and 99th percentiles of the per-call latency.
+
+Passing the option '--quick' runs a reduced sweep, which is useful as a smoke
+test.
+*/
+
+/* Number of feature dimensions used for all benchmarks */
+constexpr unsigned N_DIMS = 8;
+
+/* Number of times each timed operation is repeated */
+constexpr int N_TRAIN_REPEATS = 3;
+constexpr int N_PREDICT_REPEATS = 25;
+
+/* Return the p-th percentile (0 to 100) of a set of latency measurements */
+double percentile(std::vector<double> latencies, const double p)
+{
+	std::sort(latencies.begin(),latencies.end());
+	const int index = static_cast<int>(std::round((p/100.0)*(latencies.size()-1)));
+	return latencies[index];
+}
+
+/* Time a callable a fixed number of times and return the individual latencies
+in seconds */
+template <class TOperation>
+std::vector<double> timeRepeats(const int n_repeats, TOperation&& operation)
+{
+	std::vector<double> latencies(n_repeats);
+	for(int r = 0; r < n_repeats; ++r)
+	{
+		const double start = omp_get_wtime();
+		operation();
+		latencies[r] = omp_get_wtime() - start;
+	}
+	return latencies;
+}
+
+/* Emit one CSV row for a timed operation. The throughput is calculated from
+the total time over all repeats, and the latency percentiles are reported in
+milliseconds. A value of zero in the n_classes column indicates that the field
+does not apply (regression benchmarks) */
+void emitRow(const std::string& model, const std::string& operation, const int n_trees, const int n_levels, const int n_classes, const int batch_size, const std::vector<double>& latencies)
+{
+	const double total_time = std::accumulate(latencies.cbegin(),latencies.cend(),0.0);
+	const double throughput = (static_cast<double>(batch_size)*latencies.size())/total_time;
+	std::cout << model << ','
+	          << operation << ','
+	          << n_trees << ','
+	          << n_levels << ','
+	          << n_classes << ','
+	          << batch_size << ','
+	          << latencies.size() << ','
+	          << throughput << ','
+	          << 1000.0*percentile(latencies,50.0) << ','
+	          << 1000.0*percentile(latencies,90.0) << ','
+	          << 1000.0*percentile(latencies,99.0) << '\n';
+}
+
+/* Benchmark the classifier's training and prediction routines for one
+combination of forest parameters, over each requested batch size */
+void benchmarkClassifier(const int n_trees, const int n_levels, const int n_classes, const int n_train, const std::vector<int>& batch_sizes, std::default_random_engine& rand_engine)
+{
+	std::normal_distribution<double> norm_dist;
+	std::uniform_real_distribution<double> uni_real_dist;
+
+	/* Random Gaussian distribution parameters for each class */
+	std::vector<std::array<double,N_DIMS>> mu(n_classes), sigma(n_classes);
+	for(int c = 0; c < n_classes; ++c)
+	{
+		for(unsigned d = 0; d < N_DIMS; ++d)
+		{
+			mu[c][d] = uni_real_dist(rand_engine,std::uniform_real_distribution<double>::param_type{0.0,10.0});
+			sigma[c][d] = uni_real_dist(rand_engine,std::uniform_real_distribution<double>::param_type{0.5,3.0});
+		}
+	}
+
+	/* Generate training and test data from the class distributions. The test
+	set is as large as the largest batch size */
+	const int n_test = *std::max_element(batch_sizes.cbegin(),batch_sizes.cend());
+	std::vector<float> features((n_train+n_test)*N_DIMS);
+	std::vector<int> labels(n_train+n_test);
+	for(int i = 0; i < n_train+n_test; ++i)
+	{
+		const int c = i % n_classes;
+		labels[i] = c;
+		for(unsigned d = 0; d < N_DIMS; ++d)
+			features[i*N_DIMS+d] = norm_dist(rand_engine,std::normal_distribution<double>::param_type{mu[c][d],sigma[c][d]});
+	}
+
+	/* Feature functors looking up the pre-calculated values */
+	auto group_feature_lambda = [&] (auto first_id, const auto last_id, const std::array<int,1>& params, std::vector<float>::iterator out_it)
+	{
+		for( ; first_id != last_id; ++first_id)
+			*out_it++ = features[(*first_id)*N_DIMS+params[0]];
+	};
+	auto single_feature_lambda = [&] (const int id, const std::array<int,1>& params)
+	{
+		return features[id*N_DIMS+params[0]];
+	};
+	auto param_lambda = [&] (std::array<int,1>& params)
+	{
+		params[0] = std::uniform_int_distribution<int>{0,N_DIMS-1}(rand_engine);
+	};
+
+	std::vector<int> train_ids(n_train);
+	std::iota(train_ids.begin(),train_ids.end(),0);
+
+	/* Time the training routine, retraining the same model each repeat */
+	canopy::classifier<1> the_classifier(n_classes,n_trees,n_levels);
+	const std::vector<double> train_latencies = timeRepeats(N_TRAIN_REPEATS, [&] ()
+	{
+		the_classifier.train(train_ids.cbegin(),train_ids.cend(),labels.cbegin(),group_feature_lambda,param_lambda,N_DIMS/2+1);
+	});
+	emitRow("classifier","train",n_trees,n_levels,n_classes,n_train,train_latencies);
+
+	/* Time each of the prediction routines over each batch size. The test ids
+	follow on from the training ids in the feature array */
+	for(const int batch_size : batch_sizes)
+	{
+		std::vector<int> test_ids(batch_size);
+		std::iota(test_ids.begin(),test_ids.end(),n_train);
+
+		std::vector<canopy::discreteDistribution> dists(batch_size);
+		for(canopy::discreteDistribution& dist : dists)
+			dist.initialise(n_classes);
+		std::vector<double> probabilities(batch_size);
+
+		emitRow("classifier","predictDistGroupwise",n_trees,n_levels,n_classes,batch_size,
+			timeRepeats(N_PREDICT_REPEATS, [&] ()
+			{
+				the_classifier.predictDistGroupwise(test_ids.cbegin(),test_ids.cend(),dists.begin(),group_feature_lambda);
+			}));
+
+		emitRow("classifier","predictDistSingle",n_trees,n_levels,n_classes,batch_size,
+			timeRepeats(N_PREDICT_REPEATS, [&] ()
+			{
+				the_classifier.predictDistSingle(test_ids.cbegin(),test_ids.cend(),dists.begin(),single_feature_lambda);
+			}));
+
+		emitRow("classifier","probabilityGroupwise",n_trees,n_levels,n_classes,batch_size,
+			timeRepeats(N_PREDICT_REPEATS, [&] ()
+			{
+				the_classifier.probabilityGroupwise(test_ids.cbegin(),test_ids.cend(),labels.cbegin()+n_train,probabilities.begin(),false,group_feature_lambda);
+			}));
+
+		emitRow("classifier","probabilitySingle",n_trees,n_levels,n_classes,batch_size,
+			timeRepeats(N_PREDICT_REPEATS, [&] ()
+			{
+				the_classifier.probabilitySingle(test_ids.cbegin(),test_ids.cend(),labels.cbegin()+n_train,probabilities.begin(),false,single_feature_lambda);
+			}));
+	}
+}
+
+/* Benchmark the circular regressor's training and prediction routines for one
+combination of forest parameters, over each requested batch size */
+void benchmarkCircularRegressor(const int n_trees, const int n_levels, const int n_train, const std::vector<int>& batch_sizes, std::default_random_engine& rand_engine)
+{
+	std::normal_distribution<double> norm_dist;
+	std::uniform_real_distribution<double> uni_real_dist;
+
+	/* Generate angular labels uniformly on the circle, with features that are
+	noisy observations of the sine and cosine of the angle */
+	const int n_test = *std::max_element(batch_sizes.cbegin(),batch_sizes.cend());
+	std::vector<float> features((n_train+n_test)*N_DIMS);
+	std::vector<float> angles(n_train+n_test);
+	for(int i = 0; i < n_train+n_test; ++i)
+	{
+		const double theta = uni_real_dist(rand_engine,std::uniform_real_distribution<double>::param_type{-M_PI,M_PI});
+		angles[i] = theta;
+		for(unsigned d = 0; d < N_DIMS; ++d)
+		{
+			const double noise = norm_dist(rand_engine,std::normal_distribution<double>::param_type{0.0,0.1});
+			features[i*N_DIMS+d] = ((d % 2 == 0) ? std::cos(theta) : std::sin(theta)) + noise;
+		}
+	}
+
+	auto group_feature_lambda = [&] (auto first_id, const auto last_id, const std::array<int,1>& params, std::vector<float>::iterator out_it)
+	{
+		for( ; first_id != last_id; ++first_id)
+			*out_it++ = features[(*first_id)*N_DIMS+params[0]];
+	};
+	auto single_feature_lambda = [&] (const int id, const std::array<int,1>& params)
+	{
+		return features[id*N_DIMS+params[0]];
+	};
+	auto param_lambda = [&] (std::array<int,1>& params)
+	{
+		params[0] = std::uniform_int_distribution<int>{0,N_DIMS-1}(rand_engine);
+	};
+
+	std::vector<int> train_ids(n_train);
+	std::iota(train_ids.begin(),train_ids.end(),0);
+
+	canopy::circularRegressor<1> the_regressor(n_trees,n_levels);
+	const std::vector<double> train_latencies = timeRepeats(N_TRAIN_REPEATS, [&] ()
+	{
+		the_regressor.train(train_ids.cbegin(),train_ids.cend(),angles.cbegin(),group_feature_lambda,param_lambda,N_DIMS/2+1);
+	});
+	emitRow("circularRegressor","train",n_trees,n_levels,0,n_train,train_latencies);
+
+	for(const int batch_size : batch_sizes)
+	{
+		std::vector<int> test_ids(batch_size);
+		std::iota(test_ids.begin(),test_ids.end(),n_train);
+
+		std::vector<canopy::vonMisesDistribution> dists(batch_size);
+		std::vector<double> probabilities(batch_size);
+
+		emitRow("circularRegressor","predictDistGroupwise",n_trees,n_levels,0,batch_size,
+			timeRepeats(N_PREDICT_REPEATS, [&] ()
+			{
+				the_regressor.predictDistGroupwise(test_ids.cbegin(),test_ids.cend(),dists.begin(),group_feature_lambda);
+			}));
+
+		emitRow("circularRegressor","predictDistSingle",n_trees,n_levels,0,batch_size,
+			timeRepeats(N_PREDICT_REPEATS, [&] ()
+			{
+				the_regressor.predictDistSingle(test_ids.cbegin(),test_ids.cend(),dists.begin(),single_feature_lambda);
+			}));
+
+		emitRow("circularRegressor","probabilityGroupwise",n_trees,n_levels,0,batch_size,
+			timeRepeats(N_PREDICT_REPEATS, [&] ()
+			{
+				the_regressor.probabilityGroupwise(test_ids.cbegin(),test_ids.cend(),angles.cbegin()+n_train,probabilities.begin(),false,group_feature_lambda);
+			}));
+
+		emitRow("circularRegressor","probabilitySingle",n_trees,n_levels,0,batch_size,
+			timeRepeats(N_PREDICT_REPEATS, [&] ()
+			{
+				the_regressor.probabilitySingle(test_ids.cbegin(),test_ids.cend(),angles.cbegin()+n_train,probabilities.begin(),false,single_feature_lambda);
+			}));
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	/* The '--quick' option runs a heavily reduced sweep as a smoke test */
+	const bool quick = (argc > 1) && (std::string(argv[1]) == "--quick");
+
+	/* Parameter sweeps */
+	const std::vector<int> trees_sweep = quick ? std::vector<int>{16} : std::vector<int>{32,128};
+	const std::vector<int> levels_sweep = quick ? std::vector<int>{6} : std::vector<int>{8,12};
+	const std::vector<int> classes_sweep = quick ? std::vector<int>{3} : std::vector<int>{2,8};
+	const std::vector<int> batch_sizes = quick ? std::vector<int>{1,64} : std::vector<int>{1,256,4096};
+	const int n_train_classifier = quick ? 600 : 5000;
+	const int n_train_regressor = quick ? 400 : 2000;
+
+	/* A fixed seed makes the synthetic data reproducible between runs */
+	std::default_random_engine rand_engine;
+	rand_engine.seed(1234);
+
+	/* CSV header */
+	std::cout << "model,operation,n_trees,n_levels,n_classes,batch_size,repeats,throughput_per_second,latency_p50_ms,latency_p90_ms,latency_p99_ms" << std::endl;
+
+	for(const int n_trees : trees_sweep)
+	{
+		for(const int n_levels : levels_sweep)
+		{
+			for(const int n_classes : classes_sweep)
+				benchmarkClassifier(n_trees,n_levels,n_classes,n_train_classifier,batch_sizes,rand_engine);
+
+			benchmarkCircularRegressor(n_trees,n_levels,n_train_regressor,batch_sizes,rand_engine);
+		}
+	}
+}
@@ -13,19 +13,19 @@ class myForest : public randomForestBase<myForest<TNumParams>,myLabel,myNodeDist
 		typedef typename randomForestBase<myForest<TNumParams>,myLabel,myNodeDist,myOutputDist,TNumParams>::scoreInternalIndexStruct scoreInternalIndexStruct;
 
 
-		void printHeaderDescription(std::ofstream &stream) const
+		void printHeaderDescription(std::ostream &stream) const
 		{
 			/* Print a human-readable description of the contents of the header
 			data. Anything printed here is ignord by the library */
 		}
 
-		void printHeaderData(std::ofstream &stream) const
+		void printHeaderData(std::ostream &stream) const
 		{
 			/* Print a single line containing any parameters that must be stored
 			in order to reconstruct the model (such as number of classes etc) */
 		}
 
-		void readHeader(std::ifstream &stream)
+		void readHeader(std::istream &stream)
 		{
 			/* Read in the data printed using printHeaderData() in order to
 			reconstruct a stored forest model from file */
@@ -39,6 +39,35 @@ class myNodeDist
 			to a file.*/
 		}
 
+		int binaryLength() const
+		{
+			/* Return the number of bytes that the distribution occupies when
+			serialised by writeBinary(). This must be the same for every
+			distribution within one model.
+
+			This (along with writeBinary() and readBinary()) is only required
+			if the binary (.trb) model file format is used. */
+		}
+
+		void writeBinary(char* buffer) const
+		{
+			/* Serialise the distribution's parameters into 'buffer', writing
+			exactly binaryLength() bytes, such that readBinary() can fully
+			reconstruct the distribution.
+
+			This will be called by randomForestBase when storing the model
+			to a binary file. */
+		}
+
+		void readBinary(const char* buffer)
+		{
+			/* Read in parameters from 'buffer' and store them.
+			This must match the format written by writeBinary()
+
+			This will be called by randomForestBase when reading the model
+			from a binary file. */
+		}
+
 		template <class TId>
 		float pdf(const myLabelType x, const TId id) const
 		{
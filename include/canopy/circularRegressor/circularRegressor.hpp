@@ -31,6 +31,9 @@ class circularRegressor : public randomForestBase<circularRegressor<TNumParams>,
 		// -------
 		circularRegressor();
 		circularRegressor(const int num_trees, const int num_levels, const float info_gain_tresh = C_DEFAULT_MIN_INFO_GAIN);
+		void setFastKappaFit(const bool fast);
+		template <class TLabelIterator>
+		double getOOBError(const TLabelIterator first_label) const;
 
 	protected:
 		/*! \brief Forward the definition of the type declared in the randomForestBase class */
@@ -47,16 +50,18 @@ class circularRegressor : public randomForestBase<circularRegressor<TNumParams>,
 		void cleanupPrecalculations();
 		template <class TLabelIterator>
 		void bestSplit(const std::vector<scoreInternalIndexStruct> &data_structs, const TLabelIterator first_label, const int /*tree*/, const int /*node*/, const float initial_impurity,float& info_gain, float& thresh) const;
+		bool splitNeedsSortedScores(const int /*num_data*/) const;
 		float minInfoGain(const int /*tree*/, const int /*node*/) const;
-		void printHeaderDescription(std::ofstream& /*stream*/) const;
-		void printHeaderData(std::ofstream& /*stream*/) const;
-		void readHeader(std::ifstream& /*stream*/);
+		void printHeaderDescription(std::ostream& /*stream*/) const;
+		void printHeaderData(std::ostream& /*stream*/) const;
+		void readHeader(std::istream& /*stream*/);
 
 		// Data
 		// ----
 		std::vector<double> sin_precalc; //!< Used during training to store pre-calculated sines of the training labels
 		std::vector<double> cos_precalc; //!< Used during training to store pre-calculated cosines of the training labels
 		float min_info_gain; //!< If during training, the best information gain at a node goes below this threshold, a lead node is declared
+		bool fast_kappa_fit; //!< If true, leaf distributions estimate kappa with the closed-form approximation rather than the iterative solver
 
 		// Constants
 		// ---------
@@ -17,7 +17,7 @@ namespace canopy
 */
 template <unsigned TNumParams>
 circularRegressor<TNumParams>::circularRegressor()
-: randomForestBase<circularRegressor<TNumParams>,float,vonMisesDistribution,vonMisesDistribution,TNumParams>(), min_info_gain(C_DEFAULT_MIN_INFO_GAIN)
+: randomForestBase<circularRegressor<TNumParams>,float,vonMisesDistribution,vonMisesDistribution,TNumParams>(), min_info_gain(C_DEFAULT_MIN_INFO_GAIN), fast_kappa_fit(true)
 {
 
 }
@@ -35,11 +35,71 @@ circularRegressor<TNumParams>::circularRegressor()
 */
 template <unsigned TNumParams>
 circularRegressor<TNumParams>::circularRegressor(const int num_trees, const int num_levels, const float info_gain_tresh)
-: randomForestBase<circularRegressor<TNumParams>,float,vonMisesDistribution,vonMisesDistribution,TNumParams>(num_trees, num_levels), min_info_gain(info_gain_tresh)
+: randomForestBase<circularRegressor<TNumParams>,float,vonMisesDistribution,vonMisesDistribution,TNumParams>(num_trees, num_levels), min_info_gain(info_gain_tresh), fast_kappa_fit(true)
 {
 
 }
 
+/*! \brief Summarise the out-of-bag predictions accumulated during training
+* into a mean absolute angular error.
+*
+* Only valid after a call to \c train() with out-of-bag estimation enabled
+* via \c setOOBEstimation() and bagging active. For each training data point
+* that was out-of-bag for at least one tree, the angular difference between
+* the circular mean of its out-of-bag distribution and its true label is
+* found, and the absolute values of these differences are averaged.
+*
+* \tparam TLabelIterator Type of the iterator used to access the training
+* labels. Must be a random access iterator that dereferences to a floating
+* point data type.
+* \param first_label Iterator to the first label of the training set that was
+* passed to \c train() , in the same order
+* \return The mean absolute angular error (in radians) over the out-of-bag
+* points
+*/
+template <unsigned TNumParams>
+template <class TLabelIterator>
+double circularRegressor<TNumParams>::getOOBError(const TLabelIterator first_label) const
+{
+	const std::vector<vonMisesDistribution>& dists = this->getOOBDistributions();
+	const std::vector<int>& counts = this->getOOBCounts();
+
+	double sum_abs_error = 0.0;
+	int n_oob = 0;
+
+	for(unsigned d = 0; d < dists.size(); ++d)
+	{
+		// Skip points that appeared in every tree's bag
+		if(counts[d] == 0)
+			continue;
+
+		const double diff = std::atan2(std::sin(dists[d].getMu() - first_label[d]),std::cos(dists[d].getMu() - first_label[d]));
+		sum_abs_error += std::abs(diff);
+		++n_oob;
+	}
+
+	return (n_oob > 0) ? sum_abs_error/n_oob : 0.0;
+}
+
+/*! \brief Choose how the kappa parameter of the leaf distributions is
+* estimated during training
+*
+* In the fast mode (the default), leaf distributions are fitted using Fisher's
+* closed-form approximation of kappa, polished with a single Newton step. When
+* disabled, each leaf fit instead runs an iterative nonlinear solver, which is
+* considerably slower over the hundreds of thousands of leaves of a deep
+* forest but marginally more accurate.
+*
+* Must be called before \c train() to take effect.
+*
+* \param fast If true, use the closed-form approximation
+*/
+template <unsigned TNumParams>
+void circularRegressor<TNumParams>::setFastKappaFit(const bool fast)
+{
+	fast_kappa_fit = fast;
+}
+
 /*! \brief Initialise a vonMisesDistribution as a node distribution for training
 *
 * This method is called automatically by the base class.
@@ -50,7 +110,8 @@ circularRegressor<TNumParams>::circularRegressor(const int num_trees, const int
 template <unsigned TNumParams>
 void circularRegressor<TNumParams>::initialiseNodeDist(const int t, const int n)
 {
-	this->forest[t].nodes[n].post[0].initialise();
+	this->nodeDist(t,n).initialise();
+	this->nodeDist(t,n).setFastKappaFit(fast_kappa_fit);
 }
 
 /*! \brief Preliminary calculations to perform berfore training begins.
@@ -147,16 +208,19 @@ void circularRegressor<TNumParams>::bestSplit(const std::vector<scoreInternalInd
 	const double maxval = data_structs.back().score;
 	const double hspace = (maxval-minval)/C_NUM_SPLIT_TRIALS;
 
-	// Precalculate the cumulative sin and cosine of the labels for speed
+	// When sample weights are set, every data point's contribution is
+	// multiplied by its weight
+	const bool weighted = !this->sample_weights.empty();
+
+	// Precalculate the cumulative (weighted) sin and cosine of the labels for speed
 	std::vector<double> cumcos(data_structs.size());
 	std::vector<double> cumsin(data_structs.size());
 
-	cumsin[0] = sin_precalc[data_structs[0].id];
-	cumcos[0] = cos_precalc[data_structs[0].id];
-	for(int d = 1; d < int(data_structs.size()); ++d)
+	for(int d = 0; d < int(data_structs.size()); ++d)
 	{
-		cumsin[d] = cumsin[d-1] + sin_precalc[data_structs[d].id];
-		cumcos[d] = cumcos[d-1] + cos_precalc[data_structs[d].id];
+		const double w = weighted ? this->sample_weights[data_structs[d].id] : 1.0;
+		cumsin[d] = ((d > 0) ? cumsin[d-1] : 0.0) + w*sin_precalc[data_structs[d].id];
+		cumcos[d] = ((d > 0) ? cumcos[d-1] : 0.0) + w*cos_precalc[data_structs[d].id];
 	}
 
 	// Prepare for loop
@@ -194,17 +258,23 @@ void circularRegressor<TNumParams>::bestSplit(const std::vector<scoreInternalInd
 		// Find numbers in the left and right sides
 		const int Nl = std::distance(data_structs.cbegin(),split_it);
 
-		// Find the mean of the left side and then ssd from it
+		// Find the mean of the left side and then (weighted) ssd from it
 		const double left_mean = std::atan2(cumsin[Nl-1],cumcos[Nl-1]);
 		double ssd_left = 0.0;
 		for(auto left_it = data_structs.cbegin() ; left_it != split_it; ++left_it)
-			ssd_left += std::pow(0.5*(1.0 - std::cos(first_label[left_it->id]-left_mean)),2);
+		{
+			const double w = weighted ? this->sample_weights[left_it->id] : 1.0;
+			ssd_left += w*std::pow(0.5*(1.0 - std::cos(first_label[left_it->id]-left_mean)),2);
+		}
 
-		// Find the mean of the right side and then ssd from it
+		// Find the mean of the right side and then (weighted) ssd from it
 		const double right_mean = std::atan2(cumsin[data_structs.size()-1] - cumsin[Nl-1], cumcos[data_structs.size()-1] - cumcos[Nl-1]);
 		double ssd_right = 0.0;
 		for(auto right_it = split_it ; right_it != data_structs.cend(); ++right_it)
-			ssd_right += std::pow(0.5*(1.0 - std::cos(first_label[right_it->id]-right_mean)),2);
+		{
+			const double w = weighted ? this->sample_weights[right_it->id] : 1.0;
+			ssd_right += w*std::pow(0.5*(1.0 - std::cos(first_label[right_it->id]-right_mean)),2);
+		}
 
 		// See whether this is the best split so far
 		if(ssd_left + ssd_right < best_impurity)
@@ -222,6 +292,22 @@ void circularRegressor<TNumParams>::bestSplit(const std::vector<scoreInternalInd
 	info_gain = initial_impurity - best_impurity;
 }
 
+/*! \brief Report whether \c bestSplit() requires the scores sorted.
+*
+* The circularRegressor's split search always walks the scores in sorted
+* order, so this always returns true. This method is called automatically by
+* the base class.
+*
+* \param - The parameter is unused but required for compatibility with
+* \c randomForestBase
+* \return Always true
+*/
+template <unsigned TNumParams>
+bool circularRegressor<TNumParams>::splitNeedsSortedScores(const int /*num_data*/) const
+{
+	return true;
+}
+
 /*! \brief Calculate the impurity of the label set in a single node.
 *
 * This method takes the labels (angular labels) of a set of training
@@ -250,18 +336,27 @@ template <unsigned TNumParams>
 template <class TLabelIterator>
 float circularRegressor<TNumParams>::singleNodeImpurity(const TLabelIterator first_label, const std::vector<int>& nodebag, const int /*tree*/, const int /*node*/) const
 {
+	// When sample weights are set, every data point's contribution is
+	// multiplied by its weight
+	const bool weighted = !this->sample_weights.empty();
+
 	// First find the mean
 	double S = 0.0, C = 0.0;
 	for(int id : nodebag)
 	{
-		S += sin_precalc[id];
-		C += cos_precalc[id];
+		const double w = weighted ? this->sample_weights[id] : 1.0;
+		S += w*sin_precalc[id];
+		C += w*cos_precalc[id];
 	}
 	const double mean = std::atan2(S,C);
 
-	// Use this to find sum of distances from the mean
+	// Use this to find the (weighted) sum of distances from the mean
 	float ssd = 0.0;
-	std::for_each(nodebag.cbegin(),nodebag.cend(),[&] (int d) {ssd += std::pow(0.5*(1.0 - std::cos(first_label[d]-mean)),2);} );
+	for(int d : nodebag)
+	{
+		const double w = weighted ? this->sample_weights[d] : 1.0;
+		ssd += w*std::pow(0.5*(1.0 - std::cos(first_label[d]-mean)),2);
+	}
 
 	return ssd;
 }
@@ -275,7 +370,7 @@ float circularRegressor<TNumParams>::singleNodeImpurity(const TLabelIterator fir
 * \param stream The stream to which the header description is printed.
 */
 template <unsigned TNumParams>
-void circularRegressor<TNumParams>::printHeaderDescription(std::ofstream& /*stream*/) const
+void circularRegressor<TNumParams>::printHeaderDescription(std::ostream& /*stream*/) const
 {
 
 }
@@ -290,7 +385,7 @@ void circularRegressor<TNumParams>::printHeaderDescription(std::ofstream& /*stre
 * \param stream The stream to which the header is printed.
 */
 template <unsigned TNumParams>
-void circularRegressor<TNumParams>::printHeaderData(std::ofstream& /*stream*/) const
+void circularRegressor<TNumParams>::printHeaderData(std::ostream& /*stream*/) const
 {
 
 }
@@ -305,7 +400,7 @@ void circularRegressor<TNumParams>::printHeaderData(std::ofstream& /*stream*/) c
 * \param stream The stream from which the header information is read.
 */
 template <unsigned TNumParams>
-void circularRegressor<TNumParams>::readHeader(std::ifstream& /*stream*/)
+void circularRegressor<TNumParams>::readHeader(std::istream& /*stream*/)
 {
 
 }
@@ -9,6 +9,8 @@
 */
 
 #include <cmath>
+#include <cstring>
+#include <vector>
 #include <unsupported/Eigen/NonLinearOptimization>
 #include <boost/math/special_functions/bessel.hpp>
 #include <stdexcept>
@@ -34,11 +36,29 @@ class vonMisesDistribution
 		/*! \brief Basic constructor
 		*/
 		vonMisesDistribution()
-		: mu(0.0), kappa(0.0), S(0.0), C(0.0), pdf_normaliser(1.0)
+		: mu(0.0), kappa(0.0), S(0.0), C(0.0), pdf_normaliser(1.0), use_fast_kappa(true)
 		{
 			// Nothing to do here
 		}
 
+		/*! \brief Choose how the kappa parameter is estimated during fitting
+		*
+		* In the fast mode (the default), \c fit() uses Fisher's closed-form
+		* approximation of kappa from the resultant length, polished with a
+		* single Newton step. This is accurate to well within the spread of
+		* the estimate itself and costs three Bessel evaluations per fit. When
+		* disabled, \c fit() instead solves the maximum likelihood equation
+		* with an iterative nonlinear solver, which is considerably slower
+		* (it is called once per leaf during training) but marginally more
+		* accurate.
+		*
+		* \param fast If true, use the closed-form approximation
+		*/
+		void setFastKappaFit(const bool fast)
+		{
+			use_fast_kappa = fast;
+		}
+
 		/*! \brief Initialise the distribution before fitting
 		*/
 		void initialise()
@@ -88,24 +108,60 @@ class vonMisesDistribution
 			// Unbiased R statistic
 			const double Re = std::sqrt(R2) / n_data;
 
-			// Find the kappa parameter
-			if(Re > 0.98)
-			{
-				// There appears to be no solution for kappa in this case (look into this further!)
-				// Saturate at roughly the value for when Re = 0.98
-				kappa = 25.0;
-			}
-			else
+			// Find the kappa parameter and the pdf normaliser
+			setKappaFromResultant(Re);
+		}
+
+		/*! \brief Fit the distribution to a set of weighted labels.
+		*
+		* Behaves as the unweighted \c fit() , except that each label's sine
+		* and cosine contribute to the circular moments multiplied by the
+		* label's weight, and the resultant length is normalised by the total
+		* weight rather than the number of data points. The weights are
+		* expected to be strictly positive; there are no checks to ensure
+		* this.
+		*
+		* \tparam TLabelIterator The type of the iterator used to access the labels of
+		* the training data. Must be a forward iterator that dereferences to numerical
+		* floating point type.
+		* \tparam TIdIterator The type of the iterator used to access the IDs of the
+		* data points. The ID is unused but required for compatibility with randomForestBase.
+		* \tparam TWeightIterator The type of the iterator used to access the
+		* weights of the data points. Must be a forward iterator that
+		* dereferences to an arithmetic type.
+		* \param first_label Iterator to the first label
+		* \param last_label Iterator to the last label
+		* \param - The third parameter is unused but required for compatibility with
+		* randomForestBase
+		* \param first_weight Iterator to the weight of the first data point,
+		* in the same order as the labels
+		*/
+		template <class TLabelIterator, class TIdIterator, class TWeightIterator>
+		void fit(TLabelIterator first_label, const TLabelIterator last_label, TIdIterator /*unused*/, TWeightIterator first_weight)
+		{
+			S = 0.0, C = 0.0;
+			double total_weight = 0.0;
+
+			// Loop through the data points, accumulating weighted statistics
+			for( ; first_label != last_label; ++first_label, ++first_weight)
 			{
-				// Set up and solve the non-linear equation for kappa
-				vonMisesKappaFunctor vmftrinstance(Re);
-				Eigen::VectorXd kappa_vec(1);
-				kappa_vec << 25.0;
-				Eigen::HybridNonLinearSolver<vonMisesKappaFunctor> solver(vmftrinstance);
-				solver.hybrj1(kappa_vec);
-				kappa = kappa_vec(0,0);
-				pdf_normaliser = 1.0/(2.0*M_PI*boost::math::cyl_bessel_i(0,kappa));
+				const double w = *first_weight;
+				S += w*std::sin(*first_label);
+				C += w*std::cos(*first_label);
+				total_weight += w;
 			}
+
+			// Length of resultant vector
+			const double R2 = S*S + C*C;
+
+			// Mean direction
+			mu = std::atan2(S,C);
+
+			// Unbiased R statistic, normalised by the total weight
+			const double Re = (total_weight > 0.0) ? std::sqrt(R2)/total_weight : 0.0;
+
+			// Find the kappa parameter and the pdf normaliser
+			setKappaFromResultant(Re);
 		}
 
 
@@ -137,6 +193,37 @@ class vonMisesDistribution
 			return pdf(x,0);
 		}
 
+		/*! \brief Evaluate the probability of an array of labels in one call
+		*
+		* This produces the same values as calling \c pdf() once per label, but
+		* evaluates the whole array with a single vectorisable loop, allowing
+		* the compiler to use vector implementations of sin/cos/exp. Prefer
+		* this when evaluating the distribution densely (e.g. over every
+		* orientation bin, or every pixel of a frame).
+		*
+		* \tparam TAngleIterator Type of the iterator to the angular labels.
+		* Must be a random access iterator that dereferences to float.
+		* \tparam TOutputIterator Type of the iterator to the output
+		* probabilities. Must be a random access iterator that dereferences to
+		* float.
+		* \param first_x Iterator to the first angular label (in radians)
+		* \param last_x Iterator to the last angular label
+		* \param out_it Iterator to the output probability for the first label.
+		* The output container must already exist and contain enough elements
+		* for all the labels
+		*/
+		template <class TAngleIterator, class TOutputIterator>
+		void pdfBatched(const TAngleIterator first_x, const TAngleIterator last_x, TOutputIterator out_it) const
+		{
+			const int n = std::distance(first_x,last_x);
+			const float vm_mu = mu;
+			const float vm_kappa = kappa;
+			const float vm_norm = pdf_normaliser;
+			#pragma omp simd
+			for(int i = 0; i < n; ++i)
+				out_it[i] = vm_norm*std::exp(vm_kappa*std::cos(first_x[i] - vm_mu));
+		}
+
 		/*! \brief Prints the defining parameters of the distribution to an
 		* output filestream
 		*
@@ -152,7 +239,7 @@ class vonMisesDistribution
 		*
 		* \param stream The stream from which the parameters (mu, kappa) are to be read
 		*/
-		void readIn(std::ifstream& stream)
+		void readIn(std::istream& stream)
 		{
 			stream >> mu;
 			stream >> kappa;
@@ -162,6 +249,47 @@ class vonMisesDistribution
 			pdf_normaliser = 1.0/(2.0*M_PI*boost::math::cyl_bessel_i(0,kappa));
 		}
 
+		/*! \brief The number of bytes occupied by the distribution when
+		* serialised in binary form
+		*
+		* This is used by the binary (.trb) model file format.
+		* \return The length of the binary representation in bytes
+		*/
+		int binaryLength() const
+		{
+			return 2*sizeof(float);
+		}
+
+		/*! \brief Serialise the defining parameters of the distribution into a
+		* binary buffer
+		*
+		* This is used by the binary (.trb) model file format.
+		* \param buffer The buffer into which the parameters (mu and kappa) are
+		* written. Must have space for at least \c binaryLength() bytes
+		*/
+		void writeBinary(char* buffer) const
+		{
+			std::memcpy(buffer,&mu,sizeof(float));
+			std::memcpy(buffer+sizeof(float),&kappa,sizeof(float));
+		}
+
+		/*! \brief Read the defining parameters of the distribution from a
+		* binary buffer
+		*
+		* This is used by the binary (.trb) model file format.
+		* \param buffer The buffer from which the parameters (mu and kappa) are
+		* read
+		*/
+		void readBinary(const char* buffer)
+		{
+			std::memcpy(&mu,buffer,sizeof(float));
+			std::memcpy(&kappa,buffer+sizeof(float),sizeof(float));
+
+			S = std::sin(mu);
+			C = std::cos(mu);
+			pdf_normaliser = 1.0/(2.0*M_PI*boost::math::cyl_bessel_i(0,kappa));
+		}
+
 		/*! \brief Return the (differential) entropy of the distribution */
 		float entropy() const
 		{
@@ -196,24 +324,28 @@ class vonMisesDistribution
 		*
 		* This may be used after several \c combineWith() operations to ensure
 		* that the resulting distribution represents a valid probability distribution
+		*
+		* The normalisation constant is found by linear interpolation of a
+		* precomputed table of \f$ \log(2 \pi I_0(\kappa)) \f$ rather than by
+		* evaluating the Bessel function, since this method is called once per
+		* predicted data point and the Bessel evaluation otherwise dominates
+		* prediction time. The interpolation error is well below the accuracy
+		* envelope already accepted by the clamping of large kappa values.
 		*/
 		void normalise()
 		{
 			mu = std::atan2(S,C);
 			kappa = std::hypot(S,C);
 
-			// Don't want this to raise an exception if kappa is very large (can happen
-			// if there are many trees)
-			try
-			{
-				const double kappa_bessel = boost::math::cyl_bessel_i(0,kappa);
-				pdf_normaliser = 1.0/(2.0*M_PI*kappa_bessel);
-			}
-			catch (std::overflow_error)
+			// Don't want anything to overflow if kappa is very large (can
+			// happen if there are many trees)
+			if(kappa > C_NORMALISER_TABLE_MAX_KAPPA)
 			{
 				kappa = 500.0;
 				pdf_normaliser = 6.35397e-217;
 			}
+			else
+				pdf_normaliser = fastPdfNormaliser(kappa);
 		}
 
 		/*! \brief Reset method
@@ -250,15 +382,112 @@ class vonMisesDistribution
 		/*! \brief Allows the distribution to be written to read from a file
 		* via the streaming operator '>>'
 		*/
-		friend std::ifstream& operator>> (std::ifstream& stream, vonMisesDistribution& dist) { dist.readIn(stream); return stream;}
+		friend std::istream& operator>> (std::istream& stream, vonMisesDistribution& dist) { dist.readIn(stream); return stream;}
 
 	protected:
+		// Methods
+		// -------
+
+		/*! \brief Estimate the kappa parameter from the resultant length and
+		* update the pdf normalisation constant
+		*
+		* This is the common tail of the \c fit() overloads, run after the
+		* circular moments have been accumulated.
+		*
+		* \param Re The (unbiased) length of the resultant vector, normalised
+		* to lie in the range [0,1]
+		*/
+		void setKappaFromResultant(const double Re)
+		{
+			// Find the kappa parameter
+			if(Re > 0.98)
+			{
+				// There appears to be no solution for kappa in this case (look into this further!)
+				// Saturate at roughly the value for when Re = 0.98
+				kappa = 25.0;
+			}
+			else if(use_fast_kappa)
+			{
+				// Fisher's closed-form approximation of kappa from the
+				// resultant length
+				if(Re < 0.53)
+					kappa = 2.0*Re + Re*Re*Re + (5.0/6.0)*Re*Re*Re*Re*Re;
+				else if(Re < 0.85)
+					kappa = -0.4 + 1.39*Re + 0.43/(1.0 - Re);
+				else
+					kappa = 1.0/(Re*Re*Re - 4.0*Re*Re + 3.0*Re);
+
+				// A single Newton step on the maximum likelihood equation
+				// A(kappa) = I1(kappa)/I0(kappa) = Re polishes the estimate
+				if(kappa > 1e-6)
+				{
+					const double a = boost::math::cyl_bessel_i(1,kappa)/boost::math::cyl_bessel_i(0,kappa);
+					const double a_deriv = 1.0 - a/kappa - a*a;
+					if(a_deriv > 0.0)
+						kappa -= (a - Re)/a_deriv;
+				}
+			}
+			else
+			{
+				// Set up and solve the non-linear equation for kappa
+				vonMisesKappaFunctor vmftrinstance(Re);
+				Eigen::VectorXd kappa_vec(1);
+				kappa_vec << 25.0;
+				Eigen::HybridNonLinearSolver<vonMisesKappaFunctor> solver(vmftrinstance);
+				solver.hybrj1(kappa_vec);
+				kappa = kappa_vec(0,0);
+			}
+			pdf_normaliser = 1.0/(2.0*M_PI*boost::math::cyl_bessel_i(0,kappa));
+		}
+
+		/*! \brief Look up the pdf normalisation constant
+		* \f$ 1/(2 \pi I_0(\kappa)) \f$ by linear interpolation of a
+		* precomputed table
+		*
+		* The table holds \f$ \log(2 \pi I_0(\kappa)) \f$ , which is smooth and
+		* close to linear in kappa, so that the interpolation remains accurate
+		* over the enormous dynamic range of the constant itself. The table is
+		* built on first use (the only point at which the Bessel function is
+		* evaluated) and shared by all instances.
+		*
+		* \param kappa_in The concentration parameter. Must lie in the range
+		* [0, C_NORMALISER_TABLE_MAX_KAPPA]
+		* \return The normalisation constant
+		*/
+		static float fastPdfNormaliser(const float kappa_in)
+		{
+			static const std::vector<float> log_norm_table = [] ()
+			{
+				std::vector<float> table(C_NORMALISER_TABLE_SIZE);
+				for(int i = 0; i < C_NORMALISER_TABLE_SIZE; ++i)
+				{
+					const double k = double(i)*C_NORMALISER_TABLE_MAX_KAPPA/(C_NORMALISER_TABLE_SIZE - 1);
+					table[i] = std::log(2.0*M_PI*boost::math::cyl_bessel_i(0,k));
+				}
+				return table;
+			}();
+
+			const float pos = kappa_in*float(C_NORMALISER_TABLE_SIZE - 1)/C_NORMALISER_TABLE_MAX_KAPPA;
+			const int index = static_cast<int>(pos);
+			if(index >= C_NORMALISER_TABLE_SIZE - 1)
+				return std::exp(-double(log_norm_table.back()));
+			const float frac = pos - index;
+			const float log_norm = log_norm_table[index] + frac*(log_norm_table[index+1] - log_norm_table[index]);
+			return std::exp(-double(log_norm));
+		}
+
 		// Data
 		float mu; //!< The distribution's circular mean parameter
 		float kappa; //!< The distribution's concentration parameter
 		double S; //!< Sum of sines, used during fitting and combining distributions
 		double C; //!< Sum of cosines, used during fitting and combining distributions
 		float pdf_normaliser; //!< Pre-calculated normalisation constant of the pdf equation
+		bool use_fast_kappa; //!< If true, fit kappa with the closed-form approximation rather than the iterative solver
+
+		// Constants
+		// ---------
+		static constexpr int C_NORMALISER_TABLE_SIZE = 8192; //!< Number of entries in the precomputed normaliser table
+		static constexpr float C_NORMALISER_TABLE_MAX_KAPPA = 700.0; //!< Largest kappa covered by the normaliser table (I0 overflows a double shortly beyond this)
 
 };
 
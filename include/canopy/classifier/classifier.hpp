@@ -17,13 +17,18 @@ namespace canopy
 * \brief Implements a random forest classifier model to predict a discrete
 * output label.
 *
-* This class uses the discreteDistribution as both the output distribution and
-* the node distribution, and int as the type of label to predict.
+* This class uses the discreteDistribution as the output distribution and, by
+* default, also as the node distribution, and int as the type of label to
+* predict. A different node distribution over the same discrete label space
+* may be substituted via the TNodeDist parameter, for example the
+* quantisedDiscreteDistribution for a smaller in-memory model.
 *
 * \tparam TNumParams The number of parameters used by the features callback functor.
+* \tparam TNodeDist The node distribution type. Must offer the same interface
+* as the discreteDistribution. Default: discreteDistribution.
 */
-template <unsigned TNumParams>
-class classifier : public randomForestBase<classifier<TNumParams>,int,discreteDistribution,discreteDistribution,TNumParams>
+template <unsigned TNumParams, class TNodeDist = discreteDistribution>
+class classifier : public randomForestBase<classifier<TNumParams,TNodeDist>,int,TNodeDist,discreteDistribution,TNumParams>
 {
 	public:
 		// Methods
@@ -33,18 +38,30 @@ class classifier : public randomForestBase<classifier<TNumParams>,int,discreteDi
 		void setClassNames(const std::vector<std::string>& new_class_names);
 		void getClassNames(std::vector<std::string>& end_class_names) const;
 		void raiseNodeTemperature(const double T);
+		int pruneByPosterior(const float epsilon);
+		void setHistogramSplits(const bool enable, const int num_bins = C_DEFAULT_HISTOGRAM_BINS, const unsigned min_node_size = C_DEFAULT_HISTOGRAM_MIN_NODE_SIZE);
+		template <class TIdIterator, class TOutputLabelIterator, class TFeatureFunctor>
+		void predictMaxGroupwise(TIdIterator first_id, const TIdIterator last_id, TOutputLabelIterator label_it, TFeatureFunctor&& feature_functor) const;
+		template <class TIdIterator, class TOutputLabelIterator, class TOutputScoreIterator, class TFeatureFunctor>
+		void predictTopKGroupwise(TIdIterator first_id, const TIdIterator last_id, const int k, TOutputLabelIterator labels_it, TOutputScoreIterator scores_it, TFeatureFunctor&& feature_functor) const;
+		template <class TLabelIterator>
+		double getOOBError(const TLabelIterator first_label, std::vector<double>& per_class_error) const;
 
 	protected:
 		/*! \brief Forward the definition of the type declared in the randomForestBase class */
-		typedef typename randomForestBase<classifier<TNumParams>,int,discreteDistribution,discreteDistribution,TNumParams>::scoreInternalIndexStruct scoreInternalIndexStruct;
+		typedef typename randomForestBase<classifier<TNumParams,TNodeDist>,int,TNodeDist,discreteDistribution,TNumParams>::scoreInternalIndexStruct scoreInternalIndexStruct;
 
 		// Methods
 		void initialiseNodeDist(const int t, const int n);
+		void initialiseOutputDist(discreteDistribution& dist) const;
 		template <class TLabelIterator>
 		void bestSplit(const std::vector<scoreInternalIndexStruct> &data_structs, const TLabelIterator first_label, const int /*tree*/, const int /*node*/, const float initial_impurity,float& info_gain, float& thresh) const;
-		void printHeaderDescription(std::ofstream &stream) const;
-		void printHeaderData(std::ofstream &stream) const;
-		void readHeader(std::ifstream &stream);
+		bool splitNeedsSortedScores(const int num_data) const;
+		template <class TLabelIterator>
+		void histogramEntropySplit(const std::vector<scoreInternalIndexStruct>& data_structs, const TLabelIterator first_label, const float initial_impurity, float& info_gain, float& thresh) const;
+		void printHeaderDescription(std::ostream &stream) const;
+		void printHeaderData(std::ostream &stream) const;
+		void readHeader(std::istream &stream);
 		float minInfoGain(const int /*tree*/, const int /*node*/) const;
 		template <class TLabelIterator>
 		float singleNodeImpurity(const TLabelIterator first_label, const std::vector<int>& nodebag, const int /*tree*/, const int /*node*/) const;
@@ -57,9 +74,14 @@ class classifier : public randomForestBase<classifier<TNumParams>,int,discreteDi
 		std::vector<std::string> class_names; //!< The names of the classes
 		std::vector<double> xlogx_precalc; //!< Used for storing temporary precalculations of x*log(x) values during training
 		double min_info_gain; //!< If during training, the best information gain at a node goes below this threshold, a lead node is declared
+		bool use_histogram_splits; //!< Whether large nodes find their split threshold with the binned histogram method rather than the exact sorted scan
+		int histogram_bins; //!< Number of bins used by the histogram split method
+		unsigned histogram_min_node_size; //!< Nodes with fewer data points than this use the exact sorted scan even when histogram splits are enabled
 
 		// Constants
 		static constexpr double C_DEFAULT_MIN_INFO_GAIN = 0.05; //!< Default value for the information gain threshold.
+		static constexpr int C_DEFAULT_HISTOGRAM_BINS = 64; //!< Default number of bins for the histogram split method.
+		static constexpr unsigned C_DEFAULT_HISTOGRAM_MIN_NODE_SIZE = 4096; //!< Default minimum node size for the histogram split method to be used.
 };
 
 } // end of namespace
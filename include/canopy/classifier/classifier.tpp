@@ -6,6 +6,7 @@
 
 #include <limits>
 #include <sstream>
+#include <algorithm>
 
 namespace canopy
 {
@@ -23,9 +24,9 @@ namespace canopy
 * gain value less than this threshold are made into leaf nodes. Default:
 * C_DEFAULT_MIN_INFO_GAIN
 */
-template <unsigned TNumParams>
-classifier<TNumParams>::classifier(const int num_classes, const int num_trees, const int num_levels, const double info_gain_tresh)
-: randomForestBase<classifier<TNumParams>,int,discreteDistribution,discreteDistribution,TNumParams>(num_trees, num_levels), n_classes(num_classes), min_info_gain(info_gain_tresh)
+template <unsigned TNumParams, class TNodeDist>
+classifier<TNumParams,TNodeDist>::classifier(const int num_classes, const int num_trees, const int num_levels, const double info_gain_tresh)
+: randomForestBase<classifier<TNumParams,TNodeDist>,int,TNodeDist,discreteDistribution,TNumParams>(num_trees, num_levels), n_classes(num_classes), min_info_gain(info_gain_tresh), use_histogram_splits(false), histogram_bins(C_DEFAULT_HISTOGRAM_BINS), histogram_min_node_size(C_DEFAULT_HISTOGRAM_MIN_NODE_SIZE)
 {
 }
 
@@ -34,9 +35,9 @@ classifier<TNumParams>::classifier(const int num_classes, const int num_trees, c
 * Note that an object initialised in this way should not be trained, but may
 * be used to read in a pre-trained model using \c readFromFile()
 */
-template <unsigned TNumParams>
-classifier<TNumParams>::classifier()
-: randomForestBase<classifier<TNumParams>,int,discreteDistribution,discreteDistribution,TNumParams>(), n_classes(0), min_info_gain(C_DEFAULT_MIN_INFO_GAIN)
+template <unsigned TNumParams, class TNodeDist>
+classifier<TNumParams,TNodeDist>::classifier()
+: randomForestBase<classifier<TNumParams,TNodeDist>,int,TNodeDist,discreteDistribution,TNumParams>(), n_classes(0), min_info_gain(C_DEFAULT_MIN_INFO_GAIN), use_histogram_splits(false), histogram_bins(C_DEFAULT_HISTOGRAM_BINS), histogram_min_node_size(C_DEFAULT_HISTOGRAM_MIN_NODE_SIZE)
 {
 }
 
@@ -48,8 +49,8 @@ classifier<TNumParams>::classifier()
 *
 * \param new_class_names Vector with each element containing the name of one class
 */
-template <unsigned TNumParams>
-void classifier<TNumParams>::setClassNames(const std::vector<std::string>& new_class_names)
+template <unsigned TNumParams, class TNodeDist>
+void classifier<TNumParams,TNodeDist>::setClassNames(const std::vector<std::string>& new_class_names)
 {
 	class_names = new_class_names;
 }
@@ -61,8 +62,8 @@ void classifier<TNumParams>::setClassNames(const std::vector<std::string>& new_c
 * \param class_names The class names are returned by reference in this vector.
 * If none have been set, an empty vector is returned.
 */
-template <unsigned TNumParams>
-void classifier<TNumParams>::getClassNames(std::vector<std::string>& class_names) const
+template <unsigned TNumParams, class TNodeDist>
+void classifier<TNumParams,TNodeDist>::getClassNames(std::vector<std::string>& class_names) const
 {
 	class_names = this->class_names;
 }
@@ -74,10 +75,23 @@ void classifier<TNumParams>::getClassNames(std::vector<std::string>& class_names
 * \param t Index of the tree in which the distribution is to be initialised
 * \param n Index of the node to be initialised within its tree
 */
-template <unsigned TNumParams>
-void classifier<TNumParams>::initialiseNodeDist(const int t, const int n)
+template <unsigned TNumParams, class TNodeDist>
+void classifier<TNumParams,TNodeDist>::initialiseNodeDist(const int t, const int n)
 {
-	this->forest[t].nodes[n].post[0].initialise(n_classes);
+	this->nodeDist(t,n).initialise(n_classes);
+}
+
+/*! \brief Initialise a discreteDistribution for use as an out-of-bag
+* accumulator during training
+*
+* This method is called automatically by the base class.
+*
+* \param dist The distribution to be initialised
+*/
+template <unsigned TNumParams, class TNodeDist>
+void classifier<TNumParams,TNodeDist>::initialiseOutputDist(discreteDistribution& dist) const
+{
+	dist.initialise(n_classes);
 }
 
 /*! \brief Preliminary calculations to perform berfore training begins.
@@ -97,9 +111,9 @@ void classifier<TNumParams>::initialiseNodeDist(const int t, const int n)
 * \param - The third parameter is unused but required for compatibility with
 * randomForestBase
 */
-template <unsigned TNumParams>
+template <unsigned TNumParams, class TNodeDist>
 template <class TLabelIterator, class TIdIterator>
-void classifier<TNumParams>::trainingPrecalculations(const TLabelIterator first_label, const TLabelIterator last_label, const TIdIterator /*unused*/)
+void classifier<TNumParams,TNodeDist>::trainingPrecalculations(const TLabelIterator first_label, const TLabelIterator last_label, const TIdIterator /*unused*/)
 {
 	const int num_id = std::distance(first_label,last_label);
 	xlogx_precalc = this->preCalculateXlogX(num_id);
@@ -112,8 +126,8 @@ void classifier<TNumParams>::trainingPrecalculations(const TLabelIterator first_
 *
 * This method is called automatically by the base class.
 */
-template <unsigned TNumParams>
-void classifier<TNumParams>::cleanupPrecalculations()
+template <unsigned TNumParams, class TNodeDist>
+void classifier<TNumParams,TNodeDist>::cleanupPrecalculations()
 {
 	xlogx_precalc.clear();
 }
@@ -155,13 +169,32 @@ void classifier<TNumParams>::cleanupPrecalculations()
 * \param thresh The threshold value of the feature score corresponding to tbe
 * best split is returned by reference in this parameter
 */
-template <unsigned TNumParams>
+template <unsigned TNumParams, class TNodeDist>
 template <class TLabelIterator>
-void classifier<TNumParams>::bestSplit(const std::vector<scoreInternalIndexStruct> &data_structs, const TLabelIterator first_label, const int /*unused*/, const int /*unused*/, const float initial_impurity, float& info_gain, float& thresh) const
+void classifier<TNumParams,TNodeDist>::bestSplit(const std::vector<scoreInternalIndexStruct> &data_structs, const TLabelIterator first_label, const int /*unused*/, const int /*unused*/, const float initial_impurity, float& info_gain, float& thresh) const
 {
 	// Number of data points (makes code more readbable)
 	const int N = data_structs.size();
 
+	// Weighted training counts each point with its weight, so the integer
+	// counting routines below do not apply; the weighted exact search is
+	// always used in that case
+	if(!this->sample_weights.empty())
+	{
+		double best_children_impurity, total_weight;
+		this->fastWeightedDiscreteEntropySplit(data_structs, n_classes, first_label, this->sample_weights, best_children_impurity, thresh, total_weight);
+		info_gain = initial_impurity - best_children_impurity/total_weight;
+		return;
+	}
+
+	// Large nodes may use the approximate binned method, for which the
+	// scores need not be sorted
+	if(use_histogram_splits && (unsigned(N) >= histogram_min_node_size))
+	{
+		histogramEntropySplit(data_structs,first_label,initial_impurity,info_gain,thresh);
+		return;
+	}
+
 	// Call the base class routine for fast calculation of the best split
 	double best_children_impurity;
 	this->fastDiscreteEntropySplit(data_structs, n_classes, first_label, xlogx_precalc, best_children_impurity, thresh);
@@ -170,6 +203,194 @@ void classifier<TNumParams>::bestSplit(const std::vector<scoreInternalIndexStruc
 	info_gain = initial_impurity - best_children_impurity/N;
 }
 
+/*! \brief Enable or disable the histogram method of finding split thresholds
+* in large nodes.
+*
+* The exact split search scans every candidate boundary of the node's data
+* sorted by feature score, so each candidate feature at a node with N data
+* points costs an O(N log N) sort. When histogram splits are enabled, nodes
+* with at least min_node_size data points instead bucket the scores into a
+* fixed number of equal-width bins in a single linear pass, counting the
+* class occupancies per bin, and evaluate the entropy only at the bin
+* boundaries. This makes split finding near the root of a large forest
+* dramatically cheaper, at the cost of quantising the candidate thresholds
+* to the bin grid. Nodes smaller than min_node_size continue to use the
+* exact search, preserving split quality deep in the tree where the sort is
+* cheap anyway.
+*
+* Must be called before \c train() to take effect. Has no effect on
+* prediction or on a model read from a file.
+*
+* \param enable If true, large nodes use the histogram method during
+* subsequent training
+* \param num_bins The number of histogram bins to use. More bins approximate
+* the exact search more closely at a higher cost. Values below 2 are raised
+* to 2. Default: C_DEFAULT_HISTOGRAM_BINS
+* \param min_node_size Nodes with fewer data points than this use the exact
+* search. Default: C_DEFAULT_HISTOGRAM_MIN_NODE_SIZE
+*/
+template <unsigned TNumParams, class TNodeDist>
+void classifier<TNumParams,TNodeDist>::setHistogramSplits(const bool enable, const int num_bins, const unsigned min_node_size)
+{
+	use_histogram_splits = enable;
+	histogram_bins = std::max(2,num_bins);
+	histogram_min_node_size = min_node_size;
+}
+
+/*! \brief Report whether \c bestSplit() requires the scores sorted, given the
+* number of data points in the node.
+*
+* The histogram method does not need sorted scores, so when it is enabled and
+* the node is large enough to use it, the base class skips the per-candidate
+* sort entirely. This method is called automatically by the base class.
+*
+* \param num_data The number of data points in the node being split
+* \return True if \c bestSplit() expects the data_structs vector sorted by
+* score for a node of this size
+*/
+template <unsigned TNumParams, class TNodeDist>
+bool classifier<TNumParams,TNodeDist>::splitNeedsSortedScores(const int num_data) const
+{
+	// Weighted training always uses the (sorted) exact search
+	if(!this->sample_weights.empty())
+		return true;
+
+	return !(use_histogram_splits && (unsigned(num_data) >= histogram_min_node_size));
+}
+
+/*! \brief Find an approximate best split threshold by binning the feature
+* scores.
+*
+* The scores are bucketed into equal-width bins over their range in one
+* linear pass, counting the occupancy of each class in each bin, and the
+* children's entropy is evaluated only at the bin boundaries by moving one
+* bin at a time from the right side to the left and maintaining the partial
+* totals in the same x*log(x) form as \c fastDiscreteEntropySplit() . The
+* returned threshold is the best bin boundary.
+*
+* \tparam TLabelIterator Type of the iterator used to access the discrete labels.
+* Must be a random access iterator that dereferences to an integral data type.
+* \param data_structs A vector in which each element is a structure containing
+* the internal id (.id) and score (.score) for the current feature of the
+* training data points. Unlike the exact search, the vector need not be sorted.
+* \param first_label Iterator to the labels, located at the offsets from this
+* iterator given by the IDs of elements of the data_structs vector
+* \param initial_impurity The initial impurity of the node before the split
+* \param info_gain The information gain associated with the best bin boundary
+* is returned by reference in this parameter
+* \param thresh The threshold value corresponding to the best bin boundary is
+* returned by reference in this parameter
+*/
+template <unsigned TNumParams, class TNodeDist>
+template <class TLabelIterator>
+void classifier<TNumParams,TNodeDist>::histogramEntropySplit(const std::vector<scoreInternalIndexStruct>& data_structs, const TLabelIterator first_label, const float initial_impurity, float& info_gain, float& thresh) const
+{
+	const int N = data_structs.size();
+
+	// Find the score range in a single linear pass (the scores are not
+	// sorted in this mode). The base class has already rejected features
+	// with (almost) no variation, so the range is non-zero
+	float score_min = data_structs[0].score;
+	float score_max = data_structs[0].score;
+	for(int d = 1; d < N; ++d)
+	{
+		score_min = std::min(score_min,data_structs[d].score);
+		score_max = std::max(score_max,data_structs[d].score);
+	}
+
+	// The boundaries between the bins. A point belongs to bin b when
+	// boundaries[b] <= score < boundaries[b+1], decided with exactly the
+	// comparison later used to partition the data between the children, so
+	// that the bin counts always agree with the partition that the chosen
+	// threshold produces
+	std::vector<float> boundaries(histogram_bins + 1);
+	for(int b = 0; b <= histogram_bins; ++b)
+		boundaries[b] = score_min + (score_max - score_min)*(float(b)/histogram_bins);
+
+	// Count the occupancy of each class in each bin in one linear pass
+	std::vector<int> bin_counts(histogram_bins*n_classes,0);
+	std::vector<int> bin_totals(histogram_bins,0);
+	const float inv_bin_width = histogram_bins/(score_max - score_min);
+	for(int d = 0; d < N; ++d)
+	{
+		int b = std::min(int((data_structs[d].score - score_min)*inv_bin_width),histogram_bins - 1);
+
+		// Correct for floating point rounding at the bin boundaries
+		if( (b > 0) && (data_structs[d].score < boundaries[b]) )
+			--b;
+		else if( (b < histogram_bins - 1) && (data_structs[d].score >= boundaries[b+1]) )
+			++b;
+
+		++bin_counts[b*n_classes + first_label[data_structs[d].id]];
+		++bin_totals[b];
+	}
+
+	// Initially every bin is on the right side. Maintain the class counts of
+	// the two sides and their partial totals in the NlogN form used by
+	// fastDiscreteEntropySplit()
+	std::vector<int> left_counts(n_classes,0);
+	std::vector<int> right_counts(n_classes,0);
+	for(int b = 0; b < histogram_bins; ++b)
+		for(int c = 0; c < n_classes; ++c)
+			right_counts[c] += bin_counts[b*n_classes + c];
+
+	double left_running_total_partial = 0.0;
+	double right_running_total_partial = 0.0;
+	for(int c = 0; c < n_classes; ++c)
+		right_running_total_partial += xlogx_precalc[right_counts[c]];
+
+	// Evaluate the children's entropy at each bin boundary, moving one bin
+	// at a time from the right side to the left
+	int Nl = 0;
+	int best_b = -1;
+	double best_children_impurity = std::numeric_limits<double>::max();
+	for(int b = 1; b < histogram_bins; ++b)
+	{
+		// An empty bin gives the same partition as the previous boundary
+		if(bin_totals[b-1] == 0)
+			continue;
+
+		// Move bin b-1 into the left side
+		for(int c = 0; c < n_classes; ++c)
+		{
+			const int k = bin_counts[(b-1)*n_classes + c];
+			if(k == 0)
+				continue;
+			left_running_total_partial += xlogx_precalc[left_counts[c]+k] - xlogx_precalc[left_counts[c]];
+			right_running_total_partial += xlogx_precalc[right_counts[c]-k] - xlogx_precalc[right_counts[c]];
+			left_counts[c] += k;
+			right_counts[c] -= k;
+		}
+		Nl += bin_totals[b-1];
+
+		// If every remaining point is on the left, no later boundary can
+		// split the data either
+		if(Nl == N)
+			break;
+
+		// Calculate the resulting impurity
+		const double this_children_impurity = (xlogx_precalc[Nl] - left_running_total_partial) + (xlogx_precalc[N-Nl] - right_running_total_partial);
+		if(this_children_impurity < best_children_impurity)
+		{
+			best_children_impurity = this_children_impurity;
+			best_b = b;
+		}
+	}
+
+	// If no boundary produced two non-empty sides, report no gain so that
+	// the candidate is rejected
+	if(best_b < 0)
+	{
+		info_gain = 0.0;
+		thresh = 0.0;
+		return;
+	}
+
+	// Values to return
+	thresh = boundaries[best_b];
+	info_gain = initial_impurity - best_children_impurity/N;
+}
+
 // Calculates the impurity (entropy) of a single node
 /*! \brief Calculate the impurity of the label set in a single node.
 *
@@ -195,10 +416,13 @@ void classifier<TNumParams>::bestSplit(const std::vector<scoreInternalIndexStruc
 * \param - The fourth parameter is unused but required for compatibility with
 * randomForestBase
 */
-template <unsigned TNumParams>
+template <unsigned TNumParams, class TNodeDist>
 template <class TLabelIterator>
-float classifier<TNumParams>::singleNodeImpurity(const TLabelIterator first_label, const std::vector<int>& nodebag, const int /*tree*/, const int /*node*/) const
+float classifier<TNumParams,TNodeDist>::singleNodeImpurity(const TLabelIterator first_label, const std::vector<int>& nodebag, const int /*tree*/, const int /*node*/) const
 {
+	if(!this->sample_weights.empty())
+		return this->fastWeightedDiscreteEntropy(nodebag,n_classes,first_label,this->sample_weights);
+
 	return this->fastDiscreteEntropy(nodebag,n_classes,first_label,xlogx_precalc);
 }
 
@@ -209,8 +433,8 @@ float classifier<TNumParams>::singleNodeImpurity(const TLabelIterator first_labe
 *
 * \param stream The stream to which the header description is printed.
 */
-template <unsigned TNumParams>
-void classifier<TNumParams>::printHeaderDescription(std::ofstream &stream) const
+template <unsigned TNumParams, class TNodeDist>
+void classifier<TNumParams,TNodeDist>::printHeaderDescription(std::ostream &stream) const
 {
 	stream << "n_classes [Class names]";
 }
@@ -224,8 +448,8 @@ void classifier<TNumParams>::printHeaderDescription(std::ofstream &stream) const
 *
 * \param stream The stream to which the header is printed.
 */
-template <unsigned TNumParams>
-void classifier<TNumParams>::printHeaderData(std::ofstream &stream) const
+template <unsigned TNumParams, class TNodeDist>
+void classifier<TNumParams,TNodeDist>::printHeaderData(std::ostream &stream) const
 {
 	stream << n_classes;
 	for(auto str : class_names)
@@ -241,8 +465,8 @@ void classifier<TNumParams>::printHeaderData(std::ofstream &stream) const
 *
 * \param stream The stream from which the header information is read.
 */
-template <unsigned TNumParams>
-void classifier<TNumParams>::readHeader(std::ifstream &stream)
+template <unsigned TNumParams, class TNodeDist>
+void classifier<TNumParams,TNodeDist>::readHeader(std::istream &stream)
 {
 	using namespace std;
 	string line;
@@ -261,8 +485,8 @@ void classifier<TNumParams>::readHeader(std::ifstream &stream)
 *
 * \return The number of classes
 */
-template <unsigned TNumParams>
-int classifier<TNumParams>::getNumberClasses() const
+template <unsigned TNumParams, class TNodeDist>
+int classifier<TNumParams,TNodeDist>::getNumberClasses() const
 {
 	return n_classes;
 }
@@ -278,12 +502,236 @@ int classifier<TNumParams>::getNumberClasses() const
 * \return The threshold value for information gain. If a split results in a
 * information gain less than this value, the node should be made a leaf instead.
 */
-template <unsigned TNumParams>
-float classifier<TNumParams>::minInfoGain(const int, const int) const
+template <unsigned TNumParams, class TNodeDist>
+float classifier<TNumParams,TNodeDist>::minInfoGain(const int, const int) const
 {
 	return min_info_gain;
 }
 
+/*! \brief Predict just the most probable class label for a number of IDs
+*
+* This function classifies each of a number of data points by accumulating the
+* class votes of every tree's leaf distribution directly into a flat array and
+* writing out the arg-max label. Unlike running \c predictDistGroupwise() and
+* scanning the results, no output distribution objects are materialised, reset
+* or normalised, roughly halving the memory traffic of the combine stage. The
+* IDs are processed in cache-sized chunks internally.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TOutputLabelIterator Type of the iterator to the output labels. Must
+* be a random access iterator that dereferences to an integral type.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref groupwise "groupwise feature functor" object, meaning
+* it must define operator() with a certain form.
+* \param first_id Iterator to the first ID whose label is to be predicted.
+* \param last_id Iterator to the last ID whose label is to be predicted.
+* \param label_it Iterator to the output label corresponding to the first ID.
+* The output container must already exist, and contain enough elements for all
+* of the IDs between first_id and last_id.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+*/
+template <unsigned TNumParams, class TNodeDist>
+template <class TIdIterator, class TOutputLabelIterator, class TFeatureFunctor>
+void classifier<TNumParams,TNodeDist>::predictMaxGroupwise(TIdIterator first_id, const TIdIterator last_id, TOutputLabelIterator label_it, TFeatureFunctor&& feature_functor) const
+{
+	const int num_id = std::distance(first_id,last_id);
+	const int chunk_size = this->C_DEFAULT_PREDICTION_CHUNK_SIZE;
+
+	std::vector<std::vector<const TNodeDist*>> leaves(this->n_trees);
+	std::vector<float> votes;
+
+	for(int chunk_begin = 0; chunk_begin < num_id; chunk_begin += chunk_size)
+	{
+		const int chunk_end = std::min(chunk_begin + chunk_size, num_id);
+		const int chunk_n = chunk_end - chunk_begin;
+
+		// Find the leaf distributions that each id reaches in each tree
+		#pragma omp parallel for
+		for(int t = 0; t < this->n_trees; ++t)
+		{
+			leaves[t].resize(chunk_n);
+			this->findLeavesGroupwise(first_id + chunk_begin,first_id + chunk_end,t,leaves[t],std::forward<TFeatureFunctor>(feature_functor));
+		}
+
+		// Accumulate the class votes into a flat array and write out the
+		// arg-max label for each data point
+		votes.resize(chunk_n*n_classes);
+		#pragma omp parallel for
+		for(int d = chunk_begin; d < chunk_end; ++d)
+		{
+			float* const v = votes.data() + (d - chunk_begin)*n_classes;
+			std::fill(v,v + n_classes,0.0f);
+			for(int t = 0; t < this->n_trees; ++t)
+			{
+				const TNodeDist* const leaf = leaves[t][d - chunk_begin];
+				for(int c = 0; c < n_classes; ++c)
+					v[c] += leaf->pdf(c);
+			}
+
+			int best = 0;
+			for(int c = 1; c < n_classes; ++c)
+				if(v[c] > v[best])
+					best = c;
+			label_it[d] = best;
+		}
+	}
+}
+
+/*! \brief Predict the k most probable class labels and their probabilities
+* for a number of IDs
+*
+* This function behaves as \c predictMaxGroupwise() , but writes out the k
+* most probable labels for each data point in descending order of probability,
+* together with their probability values. Only the k reported scores are
+* normalised, so no output distribution objects are materialised.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TOutputLabelIterator Type of the iterator to the output labels. Must
+* be a random access iterator that dereferences to an integral type.
+* \tparam TOutputScoreIterator Type of the iterator to the output scores. Must
+* be a random access iterator that dereferences to float.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref groupwise "groupwise feature functor" object, meaning
+* it must define operator() with a certain form.
+* \param first_id Iterator to the first ID whose labels are to be predicted.
+* \param last_id Iterator to the last ID whose labels are to be predicted.
+* \param k The number of labels to report per data point. Must be between 1
+* and the number of classes.
+* \param labels_it Iterator to the output labels. The output container must
+* already exist and contain k elements per ID; the labels for the d'th ID are
+* written to positions d*k to d*k + k - 1, most probable first.
+* \param scores_it Iterator to the output probabilities, laid out as the
+* labels. The output container must already exist and contain k elements per
+* ID.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+*/
+template <unsigned TNumParams, class TNodeDist>
+template <class TIdIterator, class TOutputLabelIterator, class TOutputScoreIterator, class TFeatureFunctor>
+void classifier<TNumParams,TNodeDist>::predictTopKGroupwise(TIdIterator first_id, const TIdIterator last_id, const int k, TOutputLabelIterator labels_it, TOutputScoreIterator scores_it, TFeatureFunctor&& feature_functor) const
+{
+	const int num_id = std::distance(first_id,last_id);
+	const int chunk_size = this->C_DEFAULT_PREDICTION_CHUNK_SIZE;
+
+	std::vector<std::vector<const TNodeDist*>> leaves(this->n_trees);
+	std::vector<float> votes;
+
+	for(int chunk_begin = 0; chunk_begin < num_id; chunk_begin += chunk_size)
+	{
+		const int chunk_end = std::min(chunk_begin + chunk_size, num_id);
+		const int chunk_n = chunk_end - chunk_begin;
+
+		// Find the leaf distributions that each id reaches in each tree
+		#pragma omp parallel for
+		for(int t = 0; t < this->n_trees; ++t)
+		{
+			leaves[t].resize(chunk_n);
+			this->findLeavesGroupwise(first_id + chunk_begin,first_id + chunk_end,t,leaves[t],std::forward<TFeatureFunctor>(feature_functor));
+		}
+
+		// Accumulate the class votes into a flat array and select the k
+		// largest for each data point
+		votes.resize(chunk_n*n_classes);
+		#pragma omp parallel for
+		for(int d = chunk_begin; d < chunk_end; ++d)
+		{
+			float* const v = votes.data() + (d - chunk_begin)*n_classes;
+			std::fill(v,v + n_classes,0.0f);
+			float total = 0.0;
+			for(int t = 0; t < this->n_trees; ++t)
+			{
+				const TNodeDist* const leaf = leaves[t][d - chunk_begin];
+				for(int c = 0; c < n_classes; ++c)
+					v[c] += leaf->pdf(c);
+			}
+			for(int c = 0; c < n_classes; ++c)
+				total += v[c];
+
+			// Selection of the k largest votes (k is small, so a simple
+			// selection pass beats a sort of the whole class list)
+			for(int j = 0; j < k; ++j)
+			{
+				int best = -1;
+				for(int c = 0; c < n_classes; ++c)
+				{
+					if(v[c] < 0.0f)
+						continue;
+					if(best < 0 || v[c] > v[best])
+						best = c;
+				}
+				labels_it[d*k + j] = best;
+				scores_it[d*k + j] = (total > 0.0f) ? v[best]/total : 0.0f;
+				v[best] = -1.0f; // exclude from the remaining passes
+			}
+		}
+	}
+}
+
+/*! \brief Summarise the out-of-bag predictions accumulated during training
+* into misclassification rates.
+*
+* Only valid after a call to \c train() with out-of-bag estimation enabled
+* via \c setOOBEstimation() and bagging active. Each training data point that
+* was out-of-bag for at least one tree is classified by taking the class with
+* the highest out-of-bag probability, and this is compared to its true label.
+*
+* \tparam TLabelIterator Type of the iterator used to access the training
+* labels. Must be a random access iterator that dereferences to an integral
+* data type.
+* \param first_label Iterator to the first label of the training set that was
+* passed to \c train() , in the same order
+* \param per_class_error The misclassification rate among the out-of-bag
+* points of each class is returned by reference in this vector, which is
+* resized to the number of classes. Classes with no out-of-bag points have an
+* error of zero.
+* \return The overall fraction of out-of-bag points that were misclassified
+*/
+template <unsigned TNumParams, class TNodeDist>
+template <class TLabelIterator>
+double classifier<TNumParams,TNodeDist>::getOOBError(const TLabelIterator first_label, std::vector<double>& per_class_error) const
+{
+	const std::vector<discreteDistribution>& dists = this->getOOBDistributions();
+	const std::vector<int>& counts = this->getOOBCounts();
+
+	per_class_error.assign(n_classes,0.0);
+	std::vector<int> class_counts(n_classes,0);
+	int n_oob = 0;
+	int n_errors = 0;
+
+	for(unsigned d = 0; d < dists.size(); ++d)
+	{
+		// Skip points that appeared in every tree's bag
+		if(counts[d] == 0)
+			continue;
+
+		// Classify the point using its out-of-bag distribution
+		int predicted = 0;
+		for(int c = 1; c < n_classes; ++c)
+			if(dists[d].pdf(c) > dists[d].pdf(predicted))
+				predicted = c;
+
+		const int label = first_label[d];
+		++n_oob;
+		++class_counts[label];
+		if(predicted != label)
+		{
+			++n_errors;
+			per_class_error[label] += 1.0;
+		}
+	}
+
+	for(int c = 0; c < n_classes; ++c)
+		if(class_counts[c] > 0)
+			per_class_error[c] /= class_counts[c];
+
+	return (n_oob > 0) ? double(n_errors)/n_oob : 0.0;
+}
+
 /*! \brief Smooth the distributions in all of the leaf nodes using the softmax
 * function
 *
@@ -299,19 +747,61 @@ float classifier<TNumParams>::minInfoGain(const int, const int) const
 * more the certainty is reduced. T must be a strictly positive number,
 * otherwise this function will have no effect.
 */
-template <unsigned TNumParams>
-void classifier<TNumParams>::raiseNodeTemperature(const double T)
+template <unsigned TNumParams, class TNodeDist>
+void classifier<TNumParams,TNodeDist>::raiseNodeTemperature(const double T)
 {
 	for(int t = 0; t < this->n_trees; ++t)
 	{
-		for(int n = 0; n < this->n_nodes; ++n)
+		// A lazily-loaded tree has no nodes until materialised, and would
+		// otherwise miss the adjustment
+		this->ensureTreeLoaded(t);
+		for(int n = 0; n < this->forest[t].numNodes(); ++n)
 		{
-			if(this->forest[t].nodes[n].is_leaf)
+			if(this->forest[t].is_leaf[n] && this->hasNodeDist(t,n))
 			{
-				this->forest[t].nodes[n].post[0].raiseDistributionTemperature(T);
+				this->nodeDist(t,n).raiseDistributionTemperature(T);
 			}
 		}
 	}
 }
 
+/*! \brief Collapse subtrees whose class posteriors barely differ from their
+* parent's into leaf nodes
+*
+* A split node whose two children both assign every class a probability within
+* \c epsilon of the probability the node itself assigns is replaced by a leaf
+* using the node's own fitted distribution, working from the bottom of each
+* tree upwards. This reduces the model's size and traversal depth while
+* changing the predicted posteriors by at most a small amount.
+*
+* This requires the split-node distributions fitted when the forest was
+* trained with the fit_split_nodes option, which are discarded when a model
+* is read from a file. Therefore call this after training and before
+* \c writeToFile() ; on a model without split-node distributions it returns
+* zero without changes.
+*
+* \param epsilon Maximum absolute difference, over all classes, between a
+* child's and its parent's class probabilities for the child to be considered
+* redundant.
+* \return The total number of nodes removed from the forest.
+*/
+template <unsigned TNumParams, class TNodeDist>
+int classifier<TNumParams,TNodeDist>::pruneByPosterior(const float epsilon)
+{
+	const int num_classes = n_classes;
+	return this->prune(
+		[num_classes] (const TNodeDist& parent, const TNodeDist& child)
+		{
+			float max_diff = 0.0;
+			for(int c = 0; c < num_classes; ++c)
+			{
+				const float diff = std::abs(parent.pdf(c) - child.pdf(c));
+				if(diff > max_diff)
+					max_diff = diff;
+			}
+			return max_diff;
+		},
+		epsilon);
+}
+
 } // end of namespace
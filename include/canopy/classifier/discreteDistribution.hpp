@@ -12,6 +12,7 @@
 #include <vector>
 #include <fstream>
 #include <algorithm>
+#include <cstring>
 
 namespace canopy
 {
@@ -84,12 +85,17 @@ class discreteDistribution
 		*/
 		void normalise()
 		{
+			float* const p = prob.data();
+
 			float sum = 0.0;
+			#pragma omp simd reduction(+:sum)
 			for(int c = 0; c < n_classes; ++c)
-				sum += prob[c];
+				sum += p[c];
 
+			const float inv_sum = 1.0f/sum;
+			#pragma omp simd
 			for(int c = 0; c < n_classes; ++c)
-				prob[c] /= sum;
+				p[c] *= inv_sum;
 		}
 
 		/*! \brief Prints the defining parameters of the distribution to an
@@ -111,12 +117,50 @@ class discreteDistribution
 		* \param stream The stream from which the parameters (probability values
 		* for each class) are to be read
 		*/
-		void readIn(std::ifstream& stream)
+		void readIn(std::istream& stream)
 		{
 			for(int c = 0; c < n_classes; c++)
 				stream >> prob[c];
 		}
 
+		/*! \brief The number of bytes occupied by the distribution when
+		* serialised in binary form
+		*
+		* This is used by the binary (.trb) model file format.
+		* \return The length of the binary representation in bytes
+		*/
+		int binaryLength() const
+		{
+			return n_classes*sizeof(float);
+		}
+
+		/*! \brief Serialise the defining parameters of the distribution into a
+		* binary buffer
+		*
+		* This is used by the binary (.trb) model file format.
+		* \param buffer The buffer into which the parameters (the probability
+		* values for each class) are written. Must have space for at least
+		* \c binaryLength() bytes
+		*/
+		void writeBinary(char* buffer) const
+		{
+			std::memcpy(buffer,prob.data(),n_classes*sizeof(float));
+		}
+
+		/*! \brief Read the defining parameters of the distribution from a
+		* binary buffer
+		*
+		* This is used by the binary (.trb) model file format. The distribution
+		* must have been initialised to the correct number of classes before
+		* calling this method.
+		* \param buffer The buffer from which the parameters (the probability
+		* values for each class) are read
+		*/
+		void readBinary(const char* buffer)
+		{
+			std::memcpy(prob.data(),buffer,n_classes*sizeof(float));
+		}
+
 		/*! \brief Smooth the distribution using the softmax function
 		*
 		* This alters the probability distribution by replacing the probability
@@ -149,6 +193,10 @@ class discreteDistribution
 		template <class TLabelIterator, class TIdIterator>
 		void fit(TLabelIterator first_label, TLabelIterator last_label, TIdIterator /*unused*/);
 
+		// As above, but counting each label with a per-data-point weight
+		template <class TLabelIterator, class TIdIterator, class TWeightIterator>
+		void fit(TLabelIterator first_label, TLabelIterator last_label, TIdIterator /*unused*/, TWeightIterator first_weight);
+
 		// Get the pdf of a given id and label
 		template <class TId>
 		float pdf(const int x, const TId /*id*/) const;
@@ -157,6 +205,10 @@ class discreteDistribution
 		template <class TId>
 		void combineWith(const discreteDistribution& dist, const TId /*id*/);
 
+		// As above, for any other distribution type defining a pdf over the same label space
+		template <class TOtherDist, class TId>
+		void combineWith(const TOtherDist& dist, const TId /*id*/);
+
 		/*! \brief Allows the distribution to be written to a file via the
 		* streaming operator '<<'
 		*/
@@ -165,7 +217,7 @@ class discreteDistribution
 		/*! \brief Allows the distribution to be written to read from a file
 		* via the streaming operator '>>'
 		*/
-		friend std::ifstream& operator>> (std::ifstream& stream, discreteDistribution& dist) { dist.readIn(stream); return stream;}
+		friend std::istream& operator>> (std::istream& stream, discreteDistribution& dist) { dist.readIn(stream); return stream;}
 
 	protected:
 		// Data
@@ -213,6 +265,47 @@ void discreteDistribution::fit(TLabelIterator first_label, const TLabelIterator
 	}
 }
 
+/*! \brief Fit the distribution to a set of weighted labels.
+*
+* Behaves as the unweighted \c fit() , except that each label contributes its
+* weight to its class rather than a count of one. Expects the labels to take
+* value between 0 and N-1 inclusive, where N is the number of classes that the
+* distribution has been initialised with, and the weights to be strictly
+* positive. There are no checks to ensure this.
+*
+* \tparam TLabelIterator The type of the iterator used to access the labels of
+* the training data. Must be a forward iterator that dereferences to an integral
+* type.
+* \tparam TIdIterator The type of the iterator used to access the IDs of the
+* data points. The ID is unused but required for compatibility with randomForestBase.
+* \tparam TWeightIterator The type of the iterator used to access the weights
+* of the data points. Must be a forward iterator that dereferences to an
+* arithmetic type.
+* \param first_label Iterator to the first label
+* \param last_label Iterator to the last label
+* \param - The third parameter is unused but required for compatibility with
+* randomForestBase
+* \param first_weight Iterator to the weight of the first data point, in the
+* same order as the labels
+*/
+template <class TLabelIterator, class TIdIterator, class TWeightIterator>
+void discreteDistribution::fit(TLabelIterator first_label, const TLabelIterator last_label, TIdIterator /*unused*/, TWeightIterator first_weight)
+{
+	std::fill(prob.begin(),prob.end(),0.0);
+
+	double total_weight = 0.0;
+	for( ; first_label != last_label; ++first_label, ++first_weight)
+	{
+		prob[*first_label] += *first_weight;
+		total_weight += *first_weight;
+	}
+
+	if(total_weight > 0.0)
+		std::for_each(prob.begin(),prob.end(), [=] (float& p) { p /= float(total_weight); });
+	else
+		std::fill(prob.begin(),prob.end(),1.0/float(n_classes));
+}
+
 /*! \brief Returns the probability of a particular label
 *
 * This is the version used by the randomForestBase methods.
@@ -234,6 +327,9 @@ float discreteDistribution::pdf(const int x, const TId /*id*/) const
 * This method is used by the randomForestBase methods to aggregate the
 * distributions in several leaf nodes into one output distribution.
 *
+* The accumulation is performed over the raw probability arrays so that the
+* compiler can vectorise the loop.
+*
 * \tparam TId The type of the IDs of the data points. The ID is unused but
 * required for compatibility with randomForestBase.
 * \param dist The distribution that this distribution should be combined with.
@@ -242,9 +338,36 @@ float discreteDistribution::pdf(const int x, const TId /*id*/) const
 */
 template <class TId>
 void discreteDistribution::combineWith(const discreteDistribution& dist, const TId /*id*/)
+{
+	float* const p = prob.data();
+	const float* const q = dist.prob.data();
+
+	#pragma omp simd
+	for(int c = 0; c < n_classes; c++)
+		p[c] += q[c];
+}
+
+/*! \brief Combine this distribution with a distribution of a different type
+* over the same label space, without normalisation.
+*
+* This overload allows the discreteDistribution to act as the output
+* distribution of a forest whose node distributions are of some other type,
+* such as the quantisedDiscreteDistribution. The other distribution's pdf()
+* method is queried for each class.
+*
+* \tparam TOtherDist The type of the other distribution. Must define a
+* float pdf(int) method over the same number of classes.
+* \tparam TId The type of the IDs of the data points. The ID is unused but
+* required for compatibility with randomForestBase.
+* \param dist The distribution that this distribution should be combined with.
+* \param - The second parameter is unused and but required for compatibility with
+* randomForestBase
+*/
+template <class TOtherDist, class TId>
+void discreteDistribution::combineWith(const TOtherDist& dist, const TId /*id*/)
 {
 	for(int c = 0; c < n_classes; c++)
-		prob[c] += dist.prob[c];
+		prob[c] += dist.pdf(c);
 }
 
 }// end of namespace
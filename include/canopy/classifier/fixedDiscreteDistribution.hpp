@@ -0,0 +1,344 @@
+#ifndef FIXEDDISCRETEDISTRIBUTION_HPP
+#define FIXEDDISCRETEDISTRIBUTION_HPP
+
+/*!
+* \file fixedDiscreteDistribution.hpp
+* \brief Contains the canopy::fixedDiscreteDistribution class, a
+* discreteDistribution-compatible distribution with a compile-time class count.
+*/
+
+#include <cmath>
+#include <array>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+
+namespace canopy
+{
+
+/*! \brief A distribution that defines the probabilities over a fixed number of
+* discrete (integer-valued) class labels, where the number of classes is known
+* at compile time.
+*
+* This class offers the same interface as discreteDistribution, but takes the
+* number of classes as a non-type template parameter (mirroring how TNumParams
+* works elsewhere in the library) and stores the probabilities in an aligned
+* std::array rather than a heap-allocated vector. This means that the
+* distribution can live on the stack, and that the loops in \c combineWith() ,
+* \c pdf() and \c normalise() have compile-time trip counts, allowing the
+* compiler to unroll and vectorise them.
+*
+* \tparam TNumClasses The number of discrete classes
+*/
+template <unsigned TNumClasses>
+class fixedDiscreteDistribution
+{
+	public:
+		// Methods
+		//--------
+
+		/*! \brief Default constructor
+		*
+		* Initialises all probabilities to zero
+		*/
+		fixedDiscreteDistribution()
+		{
+			reset();
+		}
+
+		/*! \brief Initialise and reset probabilities to zero
+		*
+		* The number of classes is fixed at compile time, so the parameter
+		* must match TNumClasses. It exists for interface compatibility with
+		* discreteDistribution.
+		* \param - The number of discrete classes, which must equal TNumClasses
+		*/
+		void initialise(const int /*num_classes*/ = TNumClasses)
+		{
+			reset();
+		}
+
+		/*! \brief Reset function - return probabilities to zero
+		*
+		* Use this when using the class as an output distribution to create a
+		* new blank distribution before combining with new node distributions
+		*/
+		void reset()
+		{
+			std::fill(prob.begin(),prob.end(),0.0f);
+		}
+
+		/*! \brief Returns the probability of a particular label
+		*
+		* This overloaded version does not require the ID and is intended
+		* for use by user code.
+		* \param x The label of for which the probability is sought
+		*/
+		float pdf(const int x) const
+		{
+			return prob[x];
+		}
+
+		/*! \brief Normalise the distribution to ensure it is valid
+		*
+		* This may be used after several \c combineWith() operations to ensure
+		* that the resulting distribution represents a valid probability distribution
+		*/
+		void normalise()
+		{
+			float sum = 0.0;
+			#pragma omp simd reduction(+:sum)
+			for(unsigned c = 0; c < TNumClasses; ++c)
+				sum += prob[c];
+
+			const float inv_sum = 1.0f/sum;
+			#pragma omp simd
+			for(unsigned c = 0; c < TNumClasses; ++c)
+				prob[c] *= inv_sum;
+		}
+
+		/*! \brief Prints the defining parameters of the distribution to an
+		* output filestream
+		*
+		* \param stream The stream to which the parameters (the probability
+		* values for each class) are printed
+		*/
+		void printOut(std::ofstream& stream) const
+		{
+			for(unsigned c = 0; c < TNumClasses - 1; c++)
+				stream << prob[c] << " ";
+			stream << prob[TNumClasses - 1];
+		}
+
+		/*! \brief Reads the defining parameters of the distribution from a
+		* filestream
+		*
+		* \param stream The stream from which the parameters (probability values
+		* for each class) are to be read
+		*/
+		void readIn(std::istream& stream)
+		{
+			for(unsigned c = 0; c < TNumClasses; c++)
+				stream >> prob[c];
+		}
+
+		/*! \brief The number of bytes occupied by the distribution when
+		* serialised in binary form
+		*
+		* This is used by the binary (.trb) model file format.
+		* \return The length of the binary representation in bytes
+		*/
+		int binaryLength() const
+		{
+			return TNumClasses*sizeof(float);
+		}
+
+		/*! \brief Serialise the defining parameters of the distribution into a
+		* binary buffer
+		*
+		* This is used by the binary (.trb) model file format.
+		* \param buffer The buffer into which the parameters (the probability
+		* values for each class) are written. Must have space for at least
+		* \c binaryLength() bytes
+		*/
+		void writeBinary(char* buffer) const
+		{
+			std::memcpy(buffer,prob.data(),TNumClasses*sizeof(float));
+		}
+
+		/*! \brief Read the defining parameters of the distribution from a
+		* binary buffer
+		*
+		* This is used by the binary (.trb) model file format.
+		* \param buffer The buffer from which the parameters (the probability
+		* values for each class) are read
+		*/
+		void readBinary(const char* buffer)
+		{
+			std::memcpy(prob.data(),buffer,TNumClasses*sizeof(float));
+		}
+
+		/*! \brief Smooth the distribution using the softmax function
+		*
+		* This alters the probability distribution by replacing the probability
+		* of class \f$ i \f$ according to
+		* \f[ p_i \leftarrow \frac{ e^{\frac{p_i}{T}}}{\sum_{j=1}^N {e^\frac{p_j}{T}} } \f]
+		*
+		* where \f$ N \f$ is the number of classes and \f$ T \f$ is a temperature
+		* parameter.
+		* This has the effect of regularising the distribution, reducing the certainty.
+		*
+		* \param T The temperature parameter. The higher the temperature, the
+		* more the certainty is reduced. T must be a strictly positive number,
+		* otherwise this function will have no effect.
+		*
+		*/
+		void raiseDistributionTemperature(const double T)
+		{
+			if(T > 0.0)
+			{
+				for(unsigned c = 0; c < TNumClasses; ++c)
+					prob[c] = std::exp(prob[c]/T);
+				normalise();
+			}
+		}
+
+		// Template methods, defined below
+		// --------------------------------
+
+		// Function to fit the parameters of the distribution, given a set of labels
+		template <class TLabelIterator, class TIdIterator>
+		void fit(TLabelIterator first_label, TLabelIterator last_label, TIdIterator /*unused*/);
+
+		// As above, but counting each label with a per-data-point weight
+		template <class TLabelIterator, class TIdIterator, class TWeightIterator>
+		void fit(TLabelIterator first_label, TLabelIterator last_label, TIdIterator /*unused*/, TWeightIterator first_weight);
+
+		// Get the pdf of a given id and label
+		template <class TId>
+		float pdf(const int x, const TId /*id*/) const;
+
+		// Aggregates the influence of the dist into the model, but does not necessarily normalise
+		template <class TId>
+		void combineWith(const fixedDiscreteDistribution& dist, const TId /*id*/);
+
+		/*! \brief Allows the distribution to be written to a file via the
+		* streaming operator '<<'
+		*/
+		friend std::ofstream& operator<< (std::ofstream& stream, const fixedDiscreteDistribution& dist) { dist.printOut(stream); return stream;}
+
+		/*! \brief Allows the distribution to be written to read from a file
+		* via the streaming operator '>>'
+		*/
+		friend std::istream& operator>> (std::istream& stream, fixedDiscreteDistribution& dist) { dist.readIn(stream); return stream;}
+
+	protected:
+		// Data
+		alignas(32) std::array<float,TNumClasses> prob; //!< Array containing the probabilities of each class
+
+};
+
+
+
+/*! \brief Fit the distribution to a set of labels.
+*
+* Fits the distribution to the set of labels between first_label and
+* last label. Expects the labels to take value between 0 and TNumClasses-1
+* inclusive. There are no checks to ensure this.
+*
+* \tparam TLabelIterator The type of the iterator used to access the labels of
+* the training data. Must be a forward iterator that dereferences to an integral
+* type.
+* \tparam TIdIterator The type of the iterator used to access the IDs of the
+* data points. The ID is unused but required for compatibility with randomForestBase.
+* \param first_label Iterator to the first label
+* \param last_label Iterator to the last label
+* \param - The third parameter is unused but required for compatibility with
+* randomForestBase
+*/
+template <unsigned TNumClasses>
+template <class TLabelIterator, class TIdIterator>
+void fixedDiscreteDistribution<TNumClasses>::fit(TLabelIterator first_label, const TLabelIterator last_label, TIdIterator /*unused*/)
+{
+	const int n_data = std::distance(first_label, last_label);
+
+	if(n_data == 0)
+	{
+		std::fill(prob.begin(),prob.end(),1.0/float(TNumClasses));
+	}
+	else
+	{
+		std::fill(prob.begin(),prob.end(),0.0f);
+
+		for( ; first_label != last_label; ++first_label)
+			prob[*first_label] += 1.0;
+
+		std::for_each(prob.begin(),prob.end(), [=] (float& p) { p /= float(n_data); });
+	}
+}
+
+/*! \brief Fit the distribution to a set of weighted labels.
+*
+* Behaves as the unweighted \c fit() , except that each label contributes its
+* weight to its class rather than a count of one. Expects the labels to take
+* value between 0 and TNumClasses-1 inclusive and the weights to be strictly
+* positive. There are no checks to ensure this.
+*
+* \tparam TLabelIterator The type of the iterator used to access the labels of
+* the training data. Must be a forward iterator that dereferences to an integral
+* type.
+* \tparam TIdIterator The type of the iterator used to access the IDs of the
+* data points. The ID is unused but required for compatibility with randomForestBase.
+* \tparam TWeightIterator The type of the iterator used to access the weights
+* of the data points. Must be a forward iterator that dereferences to an
+* arithmetic type.
+* \param first_label Iterator to the first label
+* \param last_label Iterator to the last label
+* \param - The third parameter is unused but required for compatibility with
+* randomForestBase
+* \param first_weight Iterator to the weight of the first data point, in the
+* same order as the labels
+*/
+template <unsigned TNumClasses>
+template <class TLabelIterator, class TIdIterator, class TWeightIterator>
+void fixedDiscreteDistribution<TNumClasses>::fit(TLabelIterator first_label, const TLabelIterator last_label, TIdIterator /*unused*/, TWeightIterator first_weight)
+{
+	std::fill(prob.begin(),prob.end(),0.0f);
+
+	double total_weight = 0.0;
+	for( ; first_label != last_label; ++first_label, ++first_weight)
+	{
+		prob[*first_label] += *first_weight;
+		total_weight += *first_weight;
+	}
+
+	if(total_weight > 0.0)
+		std::for_each(prob.begin(),prob.end(), [=] (float& p) { p /= float(total_weight); });
+	else
+		std::fill(prob.begin(),prob.end(),1.0/float(TNumClasses));
+}
+
+/*! \brief Returns the probability of a particular label
+*
+* This is the version used by the randomForestBase methods.
+* \tparam TId The type of the IDs of the data points. The ID is unused but
+* required for compatibility with randomForestBase.
+* \param x The label of for which the probability is sought
+* \param - The second parameter is unused and but required for compatibility with
+* randomForestBase
+*/
+template <unsigned TNumClasses>
+template<class TId>
+float fixedDiscreteDistribution<TNumClasses>::pdf(const int x, const TId /*id*/) const
+{
+	return prob[x];
+}
+
+/*! \brief Combine this distribution with a second by summing the probability
+* values, without normalisation.
+*
+* This method is used by the randomForestBase methods to aggregate the
+* distributions in several leaf nodes into one output distribution.
+*
+* Because the trip count is a compile-time constant and the arrays are
+* aligned, this loop can be fully unrolled and vectorised by the compiler.
+*
+* \tparam TId The type of the IDs of the data points. The ID is unused but
+* required for compatibility with randomForestBase.
+* \param dist The distribution that this distribution should be combined with.
+* \param - The second parameter is unused and but required for compatibility with
+* randomForestBase
+*/
+template <unsigned TNumClasses>
+template <class TId>
+void fixedDiscreteDistribution<TNumClasses>::combineWith(const fixedDiscreteDistribution& dist, const TId /*id*/)
+{
+	#pragma omp simd
+	for(unsigned c = 0; c < TNumClasses; c++)
+		prob[c] += dist.prob[c];
+}
+
+}// end of namespace
+
+#endif
+// FIXEDDISCRETEDISTRIBUTION_HPP
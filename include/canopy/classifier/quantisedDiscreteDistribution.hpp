@@ -0,0 +1,347 @@
+#ifndef QUANTISEDDISCRETEDISTRIBUTION_HPP
+#define QUANTISEDDISCRETEDISTRIBUTION_HPP
+
+/*!
+* \file quantisedDiscreteDistribution.hpp
+* \brief Contains the canopy::quantisedDiscreteDistribution class, a compact
+* node distribution for memory-bound classification forests.
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+
+namespace canopy
+{
+
+/*! \brief A distribution over a number of discrete class labels, stored as
+* 8-bit fixed-point probabilities with a per-distribution scale factor.
+*
+* This class offers the same node distribution interface as the
+* discreteDistribution, but stores each probability value in a single byte.
+* The probability of class \f$ c \f$ is recovered as
+* \f$ p_c = s \cdot q_c \f$ , where \f$ q_c \f$ is the stored byte and
+* \f$ s \f$ is a scale factor chosen so that the largest probability in the
+* distribution maps to 255. For a forest with many leaves, this shrinks the
+* leaf storage that must be streamed through the cache during prediction to
+* roughly a quarter of the size, at the cost of a quantisation error of at
+* most half a step (\f$ s/2 \f$ ) in any single probability value.
+*
+* It is intended for use as the node distribution of a classifier (via the
+* classifier's TNodeDist template parameter), with the full-precision
+* discreteDistribution retained as the output distribution. The text (.tr)
+* representation is identical to that of the discreteDistribution, so a model
+* trained and written with a full-precision classifier may be read back by a
+* quantised classifier (quantising each leaf as it is read) and then written
+* to the compact binary (.trb) format.
+*/
+class quantisedDiscreteDistribution
+{
+	public:
+		// Methods
+		//--------
+
+		/*! \brief Default constructor
+		*
+		* Initialises with 0 classes
+		*/
+		quantisedDiscreteDistribution() : n_classes(0), scale(0.0) {}
+
+		/*! \brief Constructor
+		*
+		* Initialises with a given number of classes
+		* \param num_classes The number of discrete classes
+		*/
+		quantisedDiscreteDistribution(const int num_classes)
+		{
+			initialise(num_classes);
+		}
+
+		/*! \brief Initialise with a certain number of classes and reset
+		* probabilities to zero
+		* \param num_classes The number of discrete classes
+		*/
+		void initialise(const int num_classes)
+		{
+			n_classes = num_classes;
+			scale = 0.0;
+			qprob.resize(n_classes);
+			std::fill(qprob.begin(),qprob.end(),0);
+		}
+
+		/*! \brief Returns the probability of a particular label
+		*
+		* This overloaded version does not require the ID and is intended
+		* for use by user code.
+		* \param x The label of for which the probability is sought
+		*/
+		float pdf(const int x) const
+		{
+			return scale*qprob[x];
+		}
+
+		/*! \brief Prints the defining parameters of the distribution to an
+		* output filestream
+		*
+		* The dequantised probability values are printed, making the text
+		* representation interchangeable with that of the discreteDistribution.
+		*
+		* \param stream The stream to which the parameters (the probability
+		* values for each class) are printed
+		*/
+		void printOut(std::ofstream& stream) const
+		{
+			for(int c = 0; c < n_classes - 1; c++)
+				stream << scale*qprob[c] << " ";
+			stream << scale*qprob[n_classes - 1];
+		}
+
+		/*! \brief Reads the defining parameters of the distribution from a
+		* filestream
+		*
+		* The probability values are read in full precision and quantised,
+		* making the text representation interchangeable with that of the
+		* discreteDistribution.
+		*
+		* \param stream The stream from which the parameters (probability values
+		* for each class) are to be read
+		*/
+		void readIn(std::istream& stream)
+		{
+			std::vector<float> prob(n_classes);
+			for(int c = 0; c < n_classes; c++)
+				stream >> prob[c];
+			quantise(prob);
+		}
+
+		/*! \brief The number of bytes occupied by the distribution when
+		* serialised in binary form
+		*
+		* This is used by the binary (.trb) model file format.
+		* \return The length of the binary representation in bytes
+		*/
+		int binaryLength() const
+		{
+			return sizeof(float) + n_classes*sizeof(std::uint8_t);
+		}
+
+		/*! \brief Serialise the defining parameters of the distribution into a
+		* binary buffer
+		*
+		* This is used by the binary (.trb) model file format.
+		* \param buffer The buffer into which the parameters (the scale factor
+		* followed by the quantised probability values) are written. Must have
+		* space for at least \c binaryLength() bytes
+		*/
+		void writeBinary(char* buffer) const
+		{
+			std::memcpy(buffer,&scale,sizeof(float));
+			std::memcpy(buffer+sizeof(float),qprob.data(),n_classes*sizeof(std::uint8_t));
+		}
+
+		/*! \brief Read the defining parameters of the distribution from a
+		* binary buffer
+		*
+		* This is used by the binary (.trb) model file format. The distribution
+		* must have been initialised to the correct number of classes before
+		* calling this method.
+		* \param buffer The buffer from which the parameters (the scale factor
+		* followed by the quantised probability values) are read
+		*/
+		void readBinary(const char* buffer)
+		{
+			std::memcpy(&scale,buffer,sizeof(float));
+			std::memcpy(qprob.data(),buffer+sizeof(float),n_classes*sizeof(std::uint8_t));
+		}
+
+		/*! \brief Smooth the distribution using the softmax function
+		*
+		* This behaves as discreteDistribution::raiseDistributionTemperature(),
+		* dequantising the distribution, applying the softmax, and
+		* requantising the result.
+		*
+		* \param T The temperature parameter. The higher the temperature, the
+		* more the certainty is reduced. T must be a strictly positive number,
+		* otherwise this function will have no effect.
+		*/
+		void raiseDistributionTemperature(const double T)
+		{
+			if(T > 0.0)
+			{
+				std::vector<float> prob(n_classes);
+				float sum = 0.0;
+				for(int c = 0; c < n_classes; ++c)
+				{
+					prob[c] = std::exp(scale*qprob[c]/T);
+					sum += prob[c];
+				}
+				for(int c = 0; c < n_classes; ++c)
+					prob[c] /= sum;
+				quantise(prob);
+			}
+		}
+
+		// Template methods, defined below
+		// --------------------------------
+
+		// Function to fit the parameters of the distribution, given a set of labels
+		template <class TLabelIterator, class TIdIterator>
+		void fit(TLabelIterator first_label, TLabelIterator last_label, TIdIterator /*unused*/);
+
+		// As above, but counting each label with a per-data-point weight
+		template <class TLabelIterator, class TIdIterator, class TWeightIterator>
+		void fit(TLabelIterator first_label, TLabelIterator last_label, TIdIterator /*unused*/, TWeightIterator first_weight);
+
+		// Get the pdf of a given id and label
+		template <class TId>
+		float pdf(const int x, const TId /*id*/) const;
+
+		/*! \brief Allows the distribution to be written to a file via the
+		* streaming operator '<<'
+		*/
+		friend std::ofstream& operator<< (std::ofstream& stream, const quantisedDiscreteDistribution& dist) { dist.printOut(stream); return stream;}
+
+		/*! \brief Allows the distribution to be written to read from a file
+		* via the streaming operator '>>'
+		*/
+		friend std::istream& operator>> (std::istream& stream, quantisedDiscreteDistribution& dist) { dist.readIn(stream); return stream;}
+
+	protected:
+		// Methods
+		//--------
+
+		/*! \brief Set the stored representation from a full-precision
+		* probability array
+		*
+		* The scale factor is chosen so that the largest probability in the
+		* input maps to the full byte range.
+		*
+		* \param prob The full-precision probability values, one per class
+		*/
+		void quantise(const std::vector<float>& prob)
+		{
+			const float max_prob = *std::max_element(prob.cbegin(),prob.cend());
+			if(max_prob <= 0.0)
+			{
+				scale = 0.0;
+				std::fill(qprob.begin(),qprob.end(),0);
+				return;
+			}
+			scale = max_prob/255.0f;
+			for(int c = 0; c < n_classes; ++c)
+				qprob[c] = static_cast<std::uint8_t>(std::lround(prob[c]/scale));
+		}
+
+		// Data
+		int n_classes; //!< The number of discrete classes
+		float scale; //!< Scale factor relating the stored bytes to probability values
+		std::vector<std::uint8_t> qprob; //!< Vector containing the quantised probability of each class
+
+};
+
+
+
+/*! \brief Fit the distribution to a set of labels.
+*
+* Fits the distribution to the set of labels between first_label and
+* last label, exactly as discreteDistribution::fit(), and then quantises the
+* result. Expects the labels to take value between 0 and N-1 inclusive,
+* where N is the number of classes that the distribution has been initialised with.
+* There are no checks to ensure this.
+*
+* \tparam TLabelIterator The type of the iterator used to access the labels of
+* the training data. Must be a forward iterator that dereferences to an integral
+* type.
+* \tparam TIdIterator The type of the iterator used to access the IDs of the
+* data points. The ID is unused but required for compatibility with randomForestBase.
+* \param first_label Iterator to the first label
+* \param last_label Iterator to the last label
+* \param - The third parameter is unused but required for compatibility with
+* randomForestBase
+*/
+template <class TLabelIterator, class TIdIterator>
+void quantisedDiscreteDistribution::fit(TLabelIterator first_label, const TLabelIterator last_label, TIdIterator /*unused*/)
+{
+	const int n_data = std::distance(first_label, last_label);
+
+	std::vector<float> prob(n_classes);
+	if(n_data == 0)
+	{
+		std::fill(prob.begin(),prob.end(),1.0/float(n_classes));
+	}
+	else
+	{
+		std::fill(prob.begin(),prob.end(),0.0);
+
+		for( ; first_label != last_label; ++first_label)
+			prob[*first_label] += 1.0;
+
+		std::for_each(prob.begin(),prob.end(), [=] (float& p) { p /= float(n_data); });
+	}
+	quantise(prob);
+}
+
+/*! \brief Fit the distribution to a set of weighted labels.
+*
+* Behaves as the unweighted \c fit() , except that each label contributes its
+* weight to its class rather than a count of one, exactly as
+* discreteDistribution::fit(), before the result is quantised. The weights
+* are expected to be strictly positive; there are no checks to ensure this.
+*
+* \tparam TLabelIterator The type of the iterator used to access the labels of
+* the training data. Must be a forward iterator that dereferences to an integral
+* type.
+* \tparam TIdIterator The type of the iterator used to access the IDs of the
+* data points. The ID is unused but required for compatibility with randomForestBase.
+* \tparam TWeightIterator The type of the iterator used to access the weights
+* of the data points. Must be a forward iterator that dereferences to an
+* arithmetic type.
+* \param first_label Iterator to the first label
+* \param last_label Iterator to the last label
+* \param - The third parameter is unused but required for compatibility with
+* randomForestBase
+* \param first_weight Iterator to the weight of the first data point, in the
+* same order as the labels
+*/
+template <class TLabelIterator, class TIdIterator, class TWeightIterator>
+void quantisedDiscreteDistribution::fit(TLabelIterator first_label, const TLabelIterator last_label, TIdIterator /*unused*/, TWeightIterator first_weight)
+{
+	std::vector<float> prob(n_classes,0.0f);
+
+	double total_weight = 0.0;
+	for( ; first_label != last_label; ++first_label, ++first_weight)
+	{
+		prob[*first_label] += *first_weight;
+		total_weight += *first_weight;
+	}
+
+	if(total_weight > 0.0)
+		std::for_each(prob.begin(),prob.end(), [=] (float& p) { p /= float(total_weight); });
+	else
+		std::fill(prob.begin(),prob.end(),1.0/float(n_classes));
+
+	quantise(prob);
+}
+
+/*! \brief Returns the probability of a particular label
+*
+* This is the version used by the randomForestBase methods.
+* \tparam TId The type of the IDs of the data points. The ID is unused but
+* required for compatibility with randomForestBase.
+* \param x The label of for which the probability is sought
+* \param - The second parameter is unused and but required for compatibility with
+* randomForestBase
+*/
+template<class TId>
+float quantisedDiscreteDistribution::pdf(const int x, const TId /*id*/) const
+{
+	return scale*qprob[x];
+}
+
+}// end of namespace
+
+#endif
+// QUANTISEDDISCRETEDISTRIBUTION_HPP
@@ -0,0 +1,111 @@
+#ifndef HOTSWAPMODEL_HPP
+#define HOTSWAPMODEL_HPP
+
+/*!
+* \file hotSwapModel.hpp
+* \author Christopher P Bridge
+* \brief Contains declaration of the canopy::hotSwapModel class
+*/
+
+#include <memory>
+#include <atomic>
+#include <utility>
+
+namespace canopy
+{
+
+/*! \brief Versioned holder of a forest model allowing zero-downtime updates
+*
+* Holds the current model behind a reference-counted snapshot so that a
+* long-running process can replace the model while predictions are being
+* served from other threads. Prediction threads call \c snapshot() once per
+* request and predict through the returned pointer; \c update() installs a
+* replacement model without copying it and without blocking readers.
+* Predictions already in flight complete on the old model, which is destroyed
+* automatically once the last snapshot referring to it is released, while new
+* calls to \c snapshot() see the new model immediately.
+*
+* The holder works with any of the forest model classes (or indeed any
+* movable type). A typical update in a serving process looks like:
+*
+* \code
+* canopy::hotSwapModel<canopy::classifier<1>> served_model;
+* // ...
+* canopy::classifier<1> replacement;
+* if(replacement.readFromFile(model_file))
+* 	served_model.update(std::move(replacement));
+* \endcode
+*
+* \tparam TModel The type of the model being held, e.g. a fully specialised
+* canopy::classifier
+*/
+template <class TModel>
+class hotSwapModel
+{
+	public:
+		/*! \brief Default constructor, holds no model until \c update() is called */
+		hotSwapModel()
+			: model_version(0)
+		{
+		}
+
+		/*! \brief Constructor taking an initial model
+		* \param initial_model The model to hold initially, moved from
+		*/
+		explicit hotSwapModel(TModel&& initial_model)
+			: current_model(std::make_shared<const TModel>(std::move(initial_model))), model_version(1)
+		{
+		}
+
+		/*! \brief Get a snapshot of the current model
+		*
+		* The returned pointer remains valid (and the model it refers to
+		* unchanged) for as long as the caller holds it, regardless of any
+		* concurrent \c update() calls. May be called freely from multiple
+		* threads. Returns an empty pointer if no model has been installed
+		* yet.
+		*
+		* \return Shared pointer to the current model, or an empty pointer
+		*/
+		std::shared_ptr<const TModel> snapshot() const
+		{
+			return std::atomic_load(&current_model);
+		}
+
+		/*! \brief Install a replacement model
+		*
+		* The new model is moved into place (no tree data are copied) and
+		* becomes visible to subsequent \c snapshot() calls atomically.
+		* Readers are never blocked. May be called concurrently with
+		* \c snapshot() , but concurrent calls to \c update() itself must be
+		* serialised by the caller.
+		*
+		* \param new_model The model to install, moved from
+		*/
+		void update(TModel&& new_model)
+		{
+			std::atomic_store(&current_model,std::shared_ptr<const TModel>(std::make_shared<const TModel>(std::move(new_model))));
+			++model_version;
+		}
+
+		/*! \brief Get the number of models installed so far
+		*
+		* Increments each time \c update() installs a replacement, starting
+		* from zero for an empty holder. Allows callers to cheaply detect
+		* whether the model has changed since a previous snapshot.
+		*
+		* \return The current model version number
+		*/
+		unsigned version() const
+		{
+			return model_version.load();
+		}
+
+	private:
+		std::shared_ptr<const TModel> current_model; //!< The currently installed model, accessed only via atomic operations
+		std::atomic<unsigned> model_version; //!< Counts the number of models installed so far
+};
+
+} // end of namespace
+
+#endif // HOTSWAPMODEL_HPP
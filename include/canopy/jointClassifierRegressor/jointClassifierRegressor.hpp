@@ -0,0 +1,92 @@
+#ifndef JOINTCLASSIFIERREGRESSOR_HPP
+#define JOINTCLASSIFIERREGRESSOR_HPP
+
+/*!
+* \file jointClassifierRegressor.hpp
+* \author Christopher P Bridge
+* \brief Contains declaration of the canopy::jointClassifierRegressor class
+*/
+
+#include <utility>
+#include <canopy/randomForestBase/randomForestBase.hpp>
+#include <canopy/classifier/discreteDistribution.hpp>
+#include <canopy/circularRegressor/vonMisesDistribution.hpp>
+#include <canopy/jointClassifierRegressor/jointDistribution.hpp>
+
+namespace canopy
+{
+
+/*!
+* \brief Implements a random forest model that jointly predicts a discrete
+* class label and a circular-valued label from a single traversal.
+*
+* When both a class label and an orientation are required per data point,
+* running a classifier and a circularRegressor separately pays for two
+* complete forest traversals and two feature passes. This class instead trains
+* one forest on compound labels of type std::pair<int,float> (class label
+* first, angle in radians second), using the jointDistribution of a
+* discreteDistribution and a vonMisesDistribution as both the node and output
+* distribution. A single prediction call then yields both outputs, halving the
+* traversal and feature extraction cost.
+*
+* During training, splits are chosen to maximise a combined information gain:
+* the discrete entropy gain of the class labels plus a weighted gain in the
+* squared circular deviation of the angular labels. The weight can be set in
+* the constructor to trade the quality of the two outputs against each other.
+*
+* \tparam TNumParams The number of parameters used by the features callback functor.
+*/
+template <unsigned TNumParams>
+class jointClassifierRegressor : public randomForestBase<jointClassifierRegressor<TNumParams>,std::pair<int,float>,jointDistribution<discreteDistribution,vonMisesDistribution>,jointDistribution<discreteDistribution,vonMisesDistribution>,TNumParams>
+{
+	public:
+		// Methods
+		// -------
+		jointClassifierRegressor();
+		jointClassifierRegressor(const int num_classes, const int num_trees, const int num_levels, const float angle_impurity_weight = C_DEFAULT_ANGLE_IMPURITY_WEIGHT, const float info_gain_tresh = C_DEFAULT_MIN_INFO_GAIN);
+		int getNumberClasses() const;
+		void setFastKappaFit(const bool fast);
+
+	protected:
+		/*! \brief Forward the definition of the type declared in the randomForestBase class */
+		typedef typename randomForestBase<jointClassifierRegressor<TNumParams>,std::pair<int,float>,jointDistribution<discreteDistribution,vonMisesDistribution>,jointDistribution<discreteDistribution,vonMisesDistribution>,TNumParams>::scoreInternalIndexStruct scoreInternalIndexStruct;
+
+		// Methods
+		// -------
+		void initialiseNodeDist(const int t, const int n);
+		void initialiseOutputDist(jointDistribution<discreteDistribution,vonMisesDistribution>& dist) const;
+		template <class TLabelIterator, class TIdIterator>
+		void trainingPrecalculations(const TLabelIterator first_label, const TLabelIterator last_label, const TIdIterator /*unused*/);
+		void cleanupPrecalculations();
+		template <class TLabelIterator>
+		void bestSplit(const std::vector<scoreInternalIndexStruct> &data_structs, const TLabelIterator first_label, const int /*tree*/, const int /*node*/, const float initial_impurity, float& info_gain, float& thresh) const;
+		template <class TLabelIterator>
+		float singleNodeImpurity(const TLabelIterator first_label, const std::vector<int>& nodebag, const int /*tree*/, const int /*node*/) const;
+		bool splitNeedsSortedScores(const int /*num_data*/) const;
+		float minInfoGain(const int /*tree*/, const int /*node*/) const;
+		void printHeaderDescription(std::ostream& stream) const;
+		void printHeaderData(std::ostream& stream) const;
+		void readHeader(std::istream& stream);
+
+		// Data
+		// ----
+		int n_classes; //!< The number of classes in the discrete label space
+		float angle_impurity_weight; //!< Weight of the angular impurity relative to the class entropy in the combined split criterion
+		float min_info_gain; //!< If during training, the best information gain at a node goes below this threshold, a lead node is declared
+		bool fast_kappa_fit; //!< If true, leaf distributions estimate kappa with the closed-form approximation rather than the iterative solver
+		std::vector<double> xlogx_precalc; //!< Used for storing temporary precalculations of x*log(x) values during training
+		std::vector<double> sin_precalc; //!< Used during training to store pre-calculated sines of the angular labels
+		std::vector<double> cos_precalc; //!< Used during training to store pre-calculated cosines of the angular labels
+
+		// Constants
+		// ---------
+		static constexpr int C_NUM_SPLIT_TRIALS = 100; //!< This is the number of possible splits tested for each feature during training.
+		static constexpr float C_DEFAULT_ANGLE_IMPURITY_WEIGHT = 1.0; //!< Default weight of the angular impurity in the combined split criterion.
+		static constexpr float C_DEFAULT_MIN_INFO_GAIN = 0.05; //!< Default value for the information gain threshold.
+};
+
+} // end of namespace
+
+#include <canopy/jointClassifierRegressor/jointClassifierRegressor.tpp>
+#endif
+// JOINTCLASSIFIERREGRESSOR_HPP
@@ -0,0 +1,470 @@
+/*!
+* \file jointClassifierRegressor.tpp
+* \author Christopher P Bridge
+* \brief Contains implementations of the methods of the canopy::jointClassifierRegressor class
+*/
+
+#include <limits>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+
+namespace canopy
+{
+
+/*! \brief Default constructor
+*
+* Note that an object initialised in this way should not be trained, but may
+* be used to read in a pre-trained model using \c readFromFile()
+*/
+template <unsigned TNumParams>
+jointClassifierRegressor<TNumParams>::jointClassifierRegressor()
+: randomForestBase<jointClassifierRegressor<TNumParams>,std::pair<int,float>,jointDistribution<discreteDistribution,vonMisesDistribution>,jointDistribution<discreteDistribution,vonMisesDistribution>,TNumParams>(), n_classes(0), angle_impurity_weight(C_DEFAULT_ANGLE_IMPURITY_WEIGHT), min_info_gain(C_DEFAULT_MIN_INFO_GAIN), fast_kappa_fit(true)
+{
+}
+
+/*! \brief Full constructor
+*
+* Creates a full forest with a specified number of trees and levels, ready to be
+* trained.
+* \param num_classes Number of discrete classes in the first label space. The
+* class labels are assumed to run from 0 to num_classes-1 inclusive.
+* \param num_trees The number of decision trees in the forest
+* \param num_levels The maximum depth of any node in the trees
+* \param angle_impurity_weight Weight of the angular impurity relative to the
+* class entropy in the combined split criterion. Higher values favour splits
+* that concentrate the angular labels over splits that separate the classes.
+* Default: C_DEFAULT_ANGLE_IMPURITY_WEIGHT
+* \param info_gain_tresh The information gain threshold to use when training
+* the model. Nodes where the best split is found to result in a combined
+* information gain value less than this threshold are made into leaf nodes.
+* Default: C_DEFAULT_MIN_INFO_GAIN
+*/
+template <unsigned TNumParams>
+jointClassifierRegressor<TNumParams>::jointClassifierRegressor(const int num_classes, const int num_trees, const int num_levels, const float angle_impurity_weight, const float info_gain_tresh)
+: randomForestBase<jointClassifierRegressor<TNumParams>,std::pair<int,float>,jointDistribution<discreteDistribution,vonMisesDistribution>,jointDistribution<discreteDistribution,vonMisesDistribution>,TNumParams>(num_trees, num_levels), n_classes(num_classes), angle_impurity_weight(angle_impurity_weight), min_info_gain(info_gain_tresh), fast_kappa_fit(true)
+{
+}
+
+/*! \brief Get the number of classes in the discrete label space of the model
+*
+* \return The number of classes
+*/
+template <unsigned TNumParams>
+int jointClassifierRegressor<TNumParams>::getNumberClasses() const
+{
+	return n_classes;
+}
+
+/*! \brief Choose how the kappa parameter of the angular leaf components is
+* estimated during training
+*
+* See \c circularRegressor::setFastKappaFit() . Must be called before
+* \c train() to take effect.
+*
+* \param fast If true, use the closed-form approximation
+*/
+template <unsigned TNumParams>
+void jointClassifierRegressor<TNumParams>::setFastKappaFit(const bool fast)
+{
+	fast_kappa_fit = fast;
+}
+
+/*! \brief Initialise a jointDistribution as a node distribution for training
+*
+* This method is called automatically by the base class.
+*
+* \param t Index of the tree in which the distribution is to be initialised
+* \param n Index of the node to be initialised within its tree
+*/
+template <unsigned TNumParams>
+void jointClassifierRegressor<TNumParams>::initialiseNodeDist(const int t, const int n)
+{
+	this->nodeDist(t,n).firstDist().initialise(n_classes);
+	this->nodeDist(t,n).secondDist().initialise();
+	this->nodeDist(t,n).secondDist().setFastKappaFit(fast_kappa_fit);
+}
+
+/*! \brief Initialise a jointDistribution for use as an out-of-bag
+* accumulator during training
+*
+* This method is called automatically by the base class.
+*
+* \param dist The distribution to be initialised
+*/
+template <unsigned TNumParams>
+void jointClassifierRegressor<TNumParams>::initialiseOutputDist(jointDistribution<discreteDistribution,vonMisesDistribution>& dist) const
+{
+	dist.firstDist().initialise(n_classes);
+	dist.secondDist().initialise();
+}
+
+/*! \brief Preliminary calculations to perform before training begins.
+*
+* This pre-calculates an array of values of x*log(x) to speed up entropy
+* calculations on the class labels, and arrays of the sines and cosines of the
+* angular labels.
+*
+* This method is called automatically by the base class.
+*
+* \tparam TLabelIterator Type of the iterator used to access the training labels.
+* Must be a random access iterator that dereferences to a std::pair of an
+* integral class label and a floating point angle.
+* \tparam TIdIterator Type of the iterator used to access the IDs of the training
+* data. The IDs are unused by required for compatibility with randomForestBase .
+*
+* \param first_label Iterator to the first label in the training set
+* \param last_label Iterator to the last label in the training set
+* \param - The third parameter is unused but required for compatibility with
+* randomForestBase
+*/
+template <unsigned TNumParams>
+template <class TLabelIterator, class TIdIterator>
+void jointClassifierRegressor<TNumParams>::trainingPrecalculations(const TLabelIterator first_label, const TLabelIterator last_label, const TIdIterator /*unused*/)
+{
+	const int num_ids = std::distance(first_label,last_label);
+	xlogx_precalc = this->preCalculateXlogX(num_ids);
+	sin_precalc.resize(num_ids);
+	cos_precalc.resize(num_ids);
+
+	for(int d = 0; d < num_ids; ++d)
+	{
+		sin_precalc[d] = std::sin(first_label[d].second);
+		cos_precalc[d] = std::cos(first_label[d].second);
+	}
+}
+
+/*! \brief Clean-up of data to perform after training ends.
+*
+* In this case this clears the pre-calculated arrays created by
+* \c trainingPrecalculations()
+*
+* This method is called automatically by the base class.
+*/
+template <unsigned TNumParams>
+void jointClassifierRegressor<TNumParams>::cleanupPrecalculations()
+{
+	xlogx_precalc.clear();
+	sin_precalc.clear();
+	cos_precalc.clear();
+}
+
+/*! \brief Calculate the combined impurity of the label set in a single node.
+*
+* The impurity is the per-point discrete entropy of the class labels plus the
+* weighted per-point squared circular deviation of the angular labels from
+* their circular mean.
+*
+* This method is called automatically by the base class.
+* \tparam TLabelIterator Type of the iterator used to access the compound labels.
+* Must be a random access iterator that dereferences to a std::pair of an
+* integral class label and a floating point angle.
+* \param first_label Iterator to the labels for which the impurity is to be
+* calculated. The labels should be located at the offsets from this iterator given
+* by the elements of the nodebag vector.
+* \param nodebag Vector containing the internal training indices of the
+* data points. These are the indices through which the labels may be accessed in
+* first_label
+* \param - The third parameter is unused but required for compatibility with
+* randomForestBase
+* \param - The fourth parameter is unused but required for compatibility with
+* randomForestBase
+*/
+template <unsigned TNumParams>
+template <class TLabelIterator>
+float jointClassifierRegressor<TNumParams>::singleNodeImpurity(const TLabelIterator first_label, const std::vector<int>& nodebag, const int /*tree*/, const int /*node*/) const
+{
+	// When sample weights are set, every data point's contribution is
+	// multiplied by its weight; otherwise all the masses are counts
+	const bool weighted = !this->sample_weights.empty();
+	const auto wlogw = [] (const double x) { return (x > 0.0) ? x*std::log(x) : 0.0; };
+
+	// Class masses, total weight and circular moments of the angular labels
+	// in one pass over the node
+	std::vector<double> masses(n_classes,0.0);
+	double W = 0.0, S = 0.0, C = 0.0;
+	for(int i : nodebag)
+	{
+		const double w = weighted ? this->sample_weights[i] : 1.0;
+		masses[first_label[i].first] += w;
+		W += w;
+		S += w*sin_precalc[i];
+		C += w*cos_precalc[i];
+	}
+
+	// Discrete entropy of the class labels, in the WlogW form used by
+	// fastWeightedDiscreteEntropy()
+	double class_impurity = wlogw(W);
+	for(int b = 0; b < n_classes; ++b)
+		class_impurity -= wlogw(masses[b]);
+	class_impurity /= W;
+
+	// Circular mean of the angular labels, then the (weighted) squared
+	// circular deviations from it
+	const double mean = std::atan2(S,C);
+
+	double ssd = 0.0;
+	for(int d : nodebag)
+	{
+		const double w = weighted ? this->sample_weights[d] : 1.0;
+		ssd += w*std::pow(0.5*(1.0 - std::cos(first_label[d].second-mean)),2);
+	}
+
+	return class_impurity + angle_impurity_weight*ssd/W;
+}
+
+/*! \brief Find the best way to split training data using the scores of a certain
+* feature.
+*
+* This method takes a set of training data points and their scores resulting from
+* some feature, and calculates the best score threshold that may be
+* used to split the data into two partitions. The best split is the one that
+* results in the greatest combined information gain in the child nodes: the
+* reduction in the per-point discrete entropy of the class labels plus the
+* weighted reduction in the per-point squared circular deviation of the
+* angular labels. Candidate thresholds are placed uniformly over the score
+* range, as in the circularRegressor, and the class label histograms of the
+* two sides are maintained incrementally as the candidate threshold advances.
+*
+* This method is called automatically by the base class.
+*
+* \tparam TLabelIterator Type of the iterator used to access the compound labels.
+* Must be a random access iterator that dereferences to a std::pair of an
+* integral class label and a floating point angle.
+* \param data_structs A vector in which each element is a structure containing
+* the internal id (.id) and score (.score) for the current feature of the
+* training data points. The vector is assumed to be sorted according to the score
+* field in ascending order.
+* \param first_label Iterator to the labels for which the impurity is to be
+* calculated. The labels should be located at the offsets from this iterator given
+* by the IDs of elements of the data_structs vector.
+* \param - The third parameter is unused but required for compatibility with
+* randomForestBase
+* \param - The fourth parameter is unused but required for compatibility with
+* randomForestBase
+* \param initial_impurity The initial impurity of the node before the split.
+* This must be calculated with \c singleNodeImpurity() and passed in
+* \param info_gain The information gain associated with the best split (i.e.
+* the maximum achievable information gain with this feature) is returned by
+* reference in this parameter
+* \param thresh The threshold value of the feature score corresponding to tbe
+* best split is returned by reference in this parameter
+*/
+template <unsigned TNumParams>
+template <class TLabelIterator>
+void jointClassifierRegressor<TNumParams>::bestSplit(const std::vector<scoreInternalIndexStruct> &data_structs, const TLabelIterator first_label, const int /*tree*/, const int /*node*/, const float initial_impurity, float& info_gain, float& thresh) const
+{
+	const int N = data_structs.size();
+	const double minval = data_structs.front().score;
+	const double maxval = data_structs.back().score;
+	const double hspace = (maxval-minval)/C_NUM_SPLIT_TRIALS;
+
+	// When sample weights are set, every data point's contribution is
+	// multiplied by its weight; otherwise all the masses are counts
+	const bool weighted = !this->sample_weights.empty();
+
+	// x*log(x) of a class mass: looked up in the precalculated table when the
+	// masses are integer counts, evaluated directly when they are weighted
+	const auto wlogw = [this,weighted] (const double x)
+	{
+		if(weighted)
+			return (x > 0.0) ? x*std::log(x) : 0.0;
+		return xlogx_precalc[int(x + 0.5)];
+	};
+
+	// Precalculate the cumulative (weighted) sin and cosine of the angular labels for speed
+	std::vector<double> cumcos(N);
+	std::vector<double> cumsin(N);
+
+	for(int d = 0; d < N; ++d)
+	{
+		const double w = weighted ? this->sample_weights[data_structs[d].id] : 1.0;
+		cumsin[d] = ((d > 0) ? cumsin[d-1] : 0.0) + w*sin_precalc[data_structs[d].id];
+		cumcos[d] = ((d > 0) ? cumcos[d-1] : 0.0) + w*cos_precalc[data_structs[d].id];
+	}
+
+	// Class mass histograms of the two sides, maintained incrementally in
+	// the WlogW form used by fastWeightedDiscreteEntropySplit(). Initially
+	// every point is on the right side
+	std::vector<double> left_binned(n_classes,0.0);
+	std::vector<double> right_binned(n_classes,0.0);
+	double Wl = 0.0, Wr = 0.0;
+	for(int d = 0; d < N; ++d)
+	{
+		const double w = weighted ? this->sample_weights[data_structs[d].id] : 1.0;
+		right_binned[first_label[data_structs[d].id].first] += w;
+		Wr += w;
+	}
+	const double W = Wr;
+
+	double left_running_total_partial = 0.0;
+	double right_running_total_partial = 0.0;
+	for(int b = 0; b < n_classes; ++b)
+		right_running_total_partial += wlogw(right_binned[b]);
+
+	// Prepare for loop
+	auto split_it = data_structs.cbegin();
+	int Nl = 0;
+	double best_impurity = std::numeric_limits<double>::max();
+	double plateau_start_thresh;
+	bool plateau_flag = false;
+
+	// Loop through threshold values
+	for(int h = 1; h < C_NUM_SPLIT_TRIALS; ++h)
+	{
+		// Find the score threshold value
+		const double split_thresh = minval + h*hspace;
+
+		// Check that this new threshold actually splits the data in
+		// a different way to the previous threshold
+		if( split_it->score >= split_thresh )
+		{
+			// Move the threshold to half way between this point and
+			// the start of the plateau
+			if(plateau_flag)
+				thresh = (split_thresh + plateau_start_thresh)/2.0;
+
+			// No need to calculate the purity again - it's the same!
+			continue;
+		}
+
+		plateau_flag = false;
+
+		// Move the points below the new threshold from the right side to the
+		// left side, updating the histograms and their partial totals.
+		// After this loop, split_it points to the first data point that lies
+		// above the threshold
+		while( split_it->score < split_thresh )
+		{
+			const int b = first_label[split_it->id].first;
+			const double w = weighted ? this->sample_weights[split_it->id] : 1.0;
+			right_running_total_partial += wlogw(right_binned[b]-w) - wlogw(right_binned[b]);
+			right_binned[b] -= w;
+			left_binned[b] += w;
+			left_running_total_partial += wlogw(left_binned[b]) - wlogw(left_binned[b]-w);
+			Wl += w;
+			Wr -= w;
+			++split_it;
+			++Nl;
+		}
+
+		// Per-weight class entropy of the two sides
+		const double class_impurity = ( (wlogw(Wl) - left_running_total_partial) + (wlogw(Wr) - right_running_total_partial) )/W;
+
+		// Find the circular mean of the left side and then (weighted) ssd from it
+		const double left_mean = std::atan2(cumsin[Nl-1],cumcos[Nl-1]);
+		double ssd_left = 0.0;
+		for(auto left_it = data_structs.cbegin() ; left_it != split_it; ++left_it)
+		{
+			const double w = weighted ? this->sample_weights[left_it->id] : 1.0;
+			ssd_left += w*std::pow(0.5*(1.0 - std::cos(first_label[left_it->id].second-left_mean)),2);
+		}
+
+		// Find the circular mean of the right side and then (weighted) ssd from it
+		const double right_mean = std::atan2(cumsin[N-1] - cumsin[Nl-1], cumcos[N-1] - cumcos[Nl-1]);
+		double ssd_right = 0.0;
+		for(auto right_it = split_it ; right_it != data_structs.cend(); ++right_it)
+		{
+			const double w = weighted ? this->sample_weights[right_it->id] : 1.0;
+			ssd_right += w*std::pow(0.5*(1.0 - std::cos(first_label[right_it->id].second-right_mean)),2);
+		}
+
+		// See whether this is the best split so far
+		const double this_impurity = class_impurity + angle_impurity_weight*(ssd_left + ssd_right)/W;
+		if(this_impurity < best_impurity)
+		{
+			best_impurity = this_impurity;
+			thresh = split_thresh;
+
+			plateau_flag = true;
+			plateau_start_thresh = split_thresh;
+		}
+
+	}
+
+	// return values
+	info_gain = initial_impurity - best_impurity;
+}
+
+/*! \brief Report whether \c bestSplit() requires the scores sorted.
+*
+* The combined split search always walks the scores in sorted order, so this
+* always returns true. This method is called automatically by the base class.
+*
+* \param - The parameter is unused but required for compatibility with
+* \c randomForestBase
+* \return Always true
+*/
+template <unsigned TNumParams>
+bool jointClassifierRegressor<TNumParams>::splitNeedsSortedScores(const int /*num_data*/) const
+{
+	return true;
+}
+
+/*! \brief Get the information gain threshold for a given node
+*
+* In this case, this is a fixed value for all nodes. This method is called
+* automatically by the base class.
+* \param - The first parameter is unused but required for compatibility with
+* \c randomForestBase
+* \param - The second parameter is unused but required for compatibility with
+* \c randomForestBase
+* \return The threshold value for information gain. If a split results in a
+* information gain less than this value, the node should be made a leaf instead.
+*/
+template <unsigned TNumParams>
+float jointClassifierRegressor<TNumParams>::minInfoGain(const int /*tree*/, const int /*node*/) const
+{
+	return min_info_gain;
+}
+
+/*! \brief Prints a string that allows a human to interpret the header information
+* to a stream.
+*
+* This method is called automatically by the base class.
+*
+* \param stream The stream to which the header description is printed.
+*/
+template <unsigned TNumParams>
+void jointClassifierRegressor<TNumParams>::printHeaderDescription(std::ostream& stream) const
+{
+	stream << "n_classes angle_impurity_weight";
+}
+
+/*! \brief Print the header information specific to the jointClassifierRegressor
+* model to a stream.
+*
+* This prints out the number of classes and the angular impurity weight.
+*
+* This method is called automatically by the base class.
+*
+* \param stream The stream to which the header is printed.
+*/
+template <unsigned TNumParams>
+void jointClassifierRegressor<TNumParams>::printHeaderData(std::ostream& stream) const
+{
+	stream << n_classes << " " << angle_impurity_weight;
+}
+
+/*! \brief Read the header information specific to the jointClassifierRegressor
+* model from a stream.
+*
+* This reads in the number of classes and the angular impurity weight.
+*
+* This method is called automatically by the base class.
+*
+* \param stream The stream from which the header information is read.
+*/
+template <unsigned TNumParams>
+void jointClassifierRegressor<TNumParams>::readHeader(std::istream& stream)
+{
+	using namespace std;
+	string line;
+	getline(stream,line);
+	stringstream ss(line);
+
+	ss >> n_classes;
+	ss >> angle_impurity_weight;
+}
+
+} // end of namespace
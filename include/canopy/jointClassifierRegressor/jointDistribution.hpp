@@ -0,0 +1,260 @@
+#ifndef JOINTDISTRIBUTION_HPP
+#define JOINTDISTRIBUTION_HPP
+
+/*!
+* \file jointDistribution.hpp
+* \author Christopher P Bridge
+* \brief Contains the canopy::jointDistribution class, which combines two
+* distributions over different label spaces into one node or output
+* distribution.
+*/
+
+#include <fstream>
+#include <utility>
+#include <boost/iterator/transform_iterator.hpp>
+
+namespace canopy
+{
+
+/*! \brief A distribution over a compound label consisting of two components,
+* modelled as independent.
+*
+* Combines two component distributions into a single distribution over labels
+* of type std::pair, where the first component distribution models the first
+* element of the pair and the second models the second element. This allows a
+* single forest to predict several output variables from one traversal, see
+* \c jointClassifierRegressor .
+*
+* The two components are treated as independent given the node, so the joint
+* pdf is the product of the component pdfs. All other operations (fitting,
+* combining, normalising and serialisation) act componentwise.
+*
+* \tparam TDist1 The type of the distribution over the first label component,
+* e.g. discreteDistribution
+* \tparam TDist2 The type of the distribution over the second label component,
+* e.g. vonMisesDistribution
+*/
+template <class TDist1, class TDist2>
+class jointDistribution
+{
+	public:
+		// Methods
+		//--------
+
+		/*! \brief Access the distribution over the first label component */
+		TDist1& firstDist() { return dist1; }
+
+		/*! \brief Access the distribution over the first label component (const) */
+		const TDist1& firstDist() const { return dist1; }
+
+		/*! \brief Access the distribution over the second label component */
+		TDist2& secondDist() { return dist2; }
+
+		/*! \brief Access the distribution over the second label component (const) */
+		const TDist2& secondDist() const { return dist2; }
+
+		/*! \brief Reset function - return both components to their blank state
+		*
+		* Use this when using the class as an output distribution to create a
+		* new blank distribution before combining with new node distributions
+		*/
+		void reset()
+		{
+			dist1.reset();
+			dist2.reset();
+		}
+
+		/*! \brief Normalise both component distributions
+		*
+		* This may be used after several \c combineWith() operations to ensure
+		* that the components represent valid probability distributions
+		*/
+		void normalise()
+		{
+			dist1.normalise();
+			dist2.normalise();
+		}
+
+		/*! \brief Fit both component distributions to a set of compound labels
+		*
+		* Each component distribution is fitted to its element of the label
+		* pairs using its own fitting routine.
+		*
+		* \tparam TLabelIterator The type of the iterator used to access the
+		* labels. Must be a forward iterator that dereferences to a std::pair
+		* whose elements are the label types expected by the two components.
+		* \tparam TIdIterator The type of the iterator used to access the IDs
+		* of the data points.
+		* \param first_label Iterator to the first label
+		* \param last_label Iterator to the last label
+		* \param first_id Iterator to the ID of the first data point
+		*/
+		template <class TLabelIterator, class TIdIterator>
+		void fit(TLabelIterator first_label, const TLabelIterator last_label, TIdIterator first_id)
+		{
+			dist1.fit(boost::make_transform_iterator(first_label,firstOfPair()),boost::make_transform_iterator(last_label,firstOfPair()),first_id);
+			dist2.fit(boost::make_transform_iterator(first_label,secondOfPair()),boost::make_transform_iterator(last_label,secondOfPair()),first_id);
+		}
+
+		/*! \brief Fit both component distributions to a set of weighted
+		* compound labels
+		*
+		* As the unweighted \c fit() , except that each component distribution
+		* is fitted with its own weighted fitting routine, both receiving the
+		* same weight sequence.
+		*
+		* \tparam TLabelIterator The type of the iterator used to access the
+		* labels. Must be a forward iterator that dereferences to a std::pair
+		* whose elements are the label types expected by the two components.
+		* \tparam TIdIterator The type of the iterator used to access the IDs
+		* of the data points.
+		* \tparam TWeightIterator The type of the iterator used to access the
+		* weights of the data points. Must be a forward iterator that
+		* dereferences to an arithmetic type.
+		* \param first_label Iterator to the first label
+		* \param last_label Iterator to the last label
+		* \param first_id Iterator to the ID of the first data point
+		* \param first_weight Iterator to the weight of the first data point,
+		* in the same order as the labels
+		*/
+		template <class TLabelIterator, class TIdIterator, class TWeightIterator>
+		void fit(TLabelIterator first_label, const TLabelIterator last_label, TIdIterator first_id, TWeightIterator first_weight)
+		{
+			dist1.fit(boost::make_transform_iterator(first_label,firstOfPair()),boost::make_transform_iterator(last_label,firstOfPair()),first_id,first_weight);
+			dist2.fit(boost::make_transform_iterator(first_label,secondOfPair()),boost::make_transform_iterator(last_label,secondOfPair()),first_id,first_weight);
+		}
+
+		/*! \brief Returns the probability (density) of a compound label
+		*
+		* The components are treated as independent, so this is the product of
+		* the component pdfs.
+		*
+		* \tparam TLabel1 The type of the first label component
+		* \tparam TLabel2 The type of the second label component
+		* \tparam TId The type of the IDs of the data points
+		* \param x The compound label for which the probability is sought
+		* \param id The ID of the data point, forwarded to the components
+		*/
+		template <class TLabel1, class TLabel2, class TId>
+		float pdf(const std::pair<TLabel1,TLabel2>& x, const TId id) const
+		{
+			return dist1.pdf(x.first,id)*dist2.pdf(x.second,id);
+		}
+
+		/*! \brief Combine this distribution with a second, componentwise and
+		* without normalisation.
+		*
+		* This method is used by the randomForestBase methods to aggregate the
+		* distributions in several leaf nodes into one output distribution.
+		*
+		* \tparam TId The type of the IDs of the data points
+		* \param dist The distribution that this distribution should be combined with.
+		* \param id The ID of the data point, forwarded to the components
+		*/
+		template <class TId>
+		void combineWith(const jointDistribution& dist, const TId id)
+		{
+			dist1.combineWith(dist.dist1,id);
+			dist2.combineWith(dist.dist2,id);
+		}
+
+		/*! \brief Prints the defining parameters of both components to an
+		* output filestream
+		*
+		* \param stream The stream to which the parameters are printed
+		*/
+		void printOut(std::ofstream& stream) const
+		{
+			dist1.printOut(stream);
+			stream << " ";
+			dist2.printOut(stream);
+		}
+
+		/*! \brief Reads the defining parameters of both components from a
+		* filestream
+		*
+		* \param stream The stream from which the parameters are to be read
+		*/
+		void readIn(std::istream& stream)
+		{
+			dist1.readIn(stream);
+			dist2.readIn(stream);
+		}
+
+		/*! \brief The number of bytes occupied by the distribution when
+		* serialised in binary form
+		*
+		* This is used by the binary (.trb) model file format.
+		* \return The length of the binary representation in bytes
+		*/
+		int binaryLength() const
+		{
+			return dist1.binaryLength() + dist2.binaryLength();
+		}
+
+		/*! \brief Serialise the defining parameters of both components into a
+		* binary buffer
+		*
+		* This is used by the binary (.trb) model file format.
+		* \param buffer The buffer into which the parameters are written. Must
+		* have space for at least \c binaryLength() bytes
+		*/
+		void writeBinary(char* buffer) const
+		{
+			dist1.writeBinary(buffer);
+			dist2.writeBinary(buffer + dist1.binaryLength());
+		}
+
+		/*! \brief Read the defining parameters of both components from a
+		* binary buffer
+		*
+		* This is used by the binary (.trb) model file format. The components
+		* must have been initialised before calling this method.
+		* \param buffer The buffer from which the parameters are read
+		*/
+		void readBinary(const char* buffer)
+		{
+			dist1.readBinary(buffer);
+			dist2.readBinary(buffer + dist1.binaryLength());
+		}
+
+		/*! \brief Allows the distribution to be written to a file via the
+		* streaming operator '<<'
+		*/
+		friend std::ofstream& operator<< (std::ofstream& stream, const jointDistribution& dist) { dist.printOut(stream); return stream;}
+
+		/*! \brief Allows the distribution to be read from a file via the
+		* streaming operator '>>'
+		*/
+		friend std::istream& operator>> (std::istream& stream, jointDistribution& dist) { dist.readIn(stream); return stream;}
+
+	protected:
+		// Types
+		//------
+
+		/*! \brief Projection functor selecting the first element of a label pair */
+		struct firstOfPair
+		{
+			/*! Return the first element of the pair */
+			template <class TPair>
+			auto operator() (const TPair& p) const -> decltype(p.first) { return p.first; }
+		};
+
+		/*! \brief Projection functor selecting the second element of a label pair */
+		struct secondOfPair
+		{
+			/*! Return the second element of the pair */
+			template <class TPair>
+			auto operator() (const TPair& p) const -> decltype(p.second) { return p.second; }
+		};
+
+		// Data
+		TDist1 dist1; //!< The distribution over the first label component
+		TDist2 dist2; //!< The distribution over the second label component
+
+};
+
+}// end of namespace
+
+#endif
+// JOINTDISTRIBUTION_HPP
@@ -0,0 +1,164 @@
+#ifndef PREDICTIONEXECUTOR_HPP
+#define PREDICTIONEXECUTOR_HPP
+
+/*!
+* \file predictionExecutor.hpp
+* \author Christopher P Bridge
+* \brief Contains declaration of the canopy::predictionExecutor class
+*/
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace canopy
+{
+
+/*! \brief Work-stealing thread pool for running prediction jobs independently
+* of OpenMP
+*
+* The OpenMP-based prediction methods block the calling thread and use the
+* process-wide OpenMP team, which composes badly with an application that
+* manages its own threads: nested parallel regions oversubscribe the machine,
+* and one large prediction call occupies the whole team while small
+* latency-sensitive calls queue behind it. The executor provides an
+* alternative: jobs are submitted without blocking and run on a pool of
+* worker threads that the application sizes and shares between all of its
+* forest models.
+*
+* Each worker has its own queue of jobs and takes its own work in submission
+* order; a worker whose queue runs dry steals the oldest job from another
+* worker's queue. Because a large prediction call submitted through
+* \c randomForestBase::predictDistGroupwiseAsync() is broken into many
+* independent chunk jobs, its work spreads across idle workers while jobs
+* from other calls interleave between the chunks rather than waiting behind
+* the whole batch.
+*
+* The executor is unrelated to OpenMP and may be used alongside it; the
+* synchronous OpenMP prediction methods remain available and are unaffected
+* by the presence of an executor.
+*/
+class predictionExecutor
+{
+	public:
+		/*! \brief Construct the executor and start its worker threads
+		* \param num_threads The number of worker threads in the pool. If
+		* zero (the default), the hardware concurrency is used
+		*/
+		explicit predictionExecutor(unsigned num_threads = 0)
+			: next_queue(0), stop(false)
+		{
+			if(num_threads == 0)
+				num_threads = std::thread::hardware_concurrency();
+			if(num_threads == 0)
+				num_threads = 1;
+
+			queues.resize(num_threads);
+			workers.reserve(num_threads);
+			for(unsigned w = 0; w < num_threads; ++w)
+				workers.emplace_back(&predictionExecutor::workerLoop,this,w);
+		}
+
+		/*! \brief Destructor, runs all submitted jobs to completion and
+		* stops the worker threads */
+		~predictionExecutor()
+		{
+			{
+				std::unique_lock<std::mutex> lock(pool_mutex);
+				stop = true;
+			}
+			pool_cv.notify_all();
+			for(std::thread& w : workers)
+				w.join();
+		}
+
+		// The worker threads hold pointers back to the executor, so it can
+		// be neither copied nor moved
+		predictionExecutor(const predictionExecutor&) = delete;
+		predictionExecutor& operator=(const predictionExecutor&) = delete;
+
+		/*! \brief Submit a job for asynchronous execution
+		*
+		* The job is placed on a worker's queue and the call returns
+		* immediately. Jobs must not throw; anything they refer to must
+		* remain valid until they have run.
+		*
+		* \param job A callable taking no arguments, copied or moved into
+		* the pool
+		*/
+		void submit(std::function<void()> job)
+		{
+			{
+				std::unique_lock<std::mutex> lock(pool_mutex);
+				// Distribute jobs over the workers' queues round-robin
+				queues[next_queue].emplace_back(std::move(job));
+				next_queue = (next_queue + 1) % queues.size();
+			}
+			pool_cv.notify_one();
+		}
+
+		/*! \brief The number of worker threads in the pool */
+		unsigned numThreads() const
+		{
+			return workers.size();
+		}
+
+	private:
+		// Methods
+		/*! \brief Main loop of each worker thread
+		* \param own The index of this worker's own queue
+		*/
+		void workerLoop(const unsigned own)
+		{
+			std::unique_lock<std::mutex> lock(pool_mutex);
+			while(true)
+			{
+				// Take the next job from this worker's own queue, or
+				// failing that steal the oldest job from another worker
+				std::function<void()> job;
+				for(unsigned v = 0; v < queues.size(); ++v)
+				{
+					std::deque<std::function<void()>>& q = queues[(own + v) % queues.size()];
+					if(!q.empty())
+					{
+						job = std::move(q.front());
+						q.pop_front();
+						break;
+					}
+				}
+
+				if(job)
+				{
+					// Run the job without holding the lock, so that other
+					// workers may take and submit jobs meanwhile
+					lock.unlock();
+					job();
+					lock.lock();
+					continue;
+				}
+
+				// All the queues are drained; finish if asked to, otherwise
+				// sleep until a job is submitted
+				if(stop)
+					return;
+				pool_cv.wait(lock);
+			}
+		}
+
+		// Data
+		std::vector<std::deque<std::function<void()>>> queues; //!< One queue of pending jobs per worker thread, oldest job first
+		std::vector<std::thread> workers; //!< The worker threads
+		unsigned next_queue; //!< Round-robin counter for distributing submitted jobs
+		std::mutex pool_mutex; //!< Protects the queues, the round-robin counter and the stop flag
+		std::condition_variable pool_cv; //!< Signalled when a job is submitted or the pool stops
+		bool stop; //!< Set when the destructor asks the workers to finish
+};
+
+} // end of namespace
+
+#endif
+// PREDICTIONEXECUTOR_HPP
@@ -13,6 +13,11 @@
 #include <vector>
 #include <array>
 #include <random>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <atomic>
+#include <canopy/predictionExecutor/predictionExecutor.hpp>
 
 /*! \brief Namespace containing the canopy library for random forest models */
 namespace canopy
@@ -44,18 +49,114 @@ template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsi
 class randomForestBase
 {
 	public:
+		// Types
+		// -----
+
+		/*! \brief Workspace of reusable buffers for the prediction routines
+		*
+		* A workspace owns all the temporary storage (leaf pointer arrays and
+		* per-tree traversal buffers) needed by the groupwise prediction and
+		* probability evaluation routines. Passing the same workspace object
+		* into repeated calls allows the buffers to be reused, making
+		* steady-state prediction free of heap allocation. This is useful when
+		* predictions are made at a high rate, such as once per video frame.
+		*
+		* A workspace may be used with forests of different sizes and with
+		* different numbers of data points (the buffers grow as needed), but a
+		* single workspace must not be used by multiple threads simultaneously.
+		*/
+		struct predictionWorkspace
+		{
+			std::vector<std::vector<const TNodeDist*>> leaves; //!< Leaf distributions reached, indexed by tree then data point
+			std::vector<std::vector<std::vector<int>>> nodebag_rel; //!< Per-tree traversal bags of relative data point indices
+			std::vector<std::vector<float>> scores; //!< Per-tree buffers of feature scores
+		};
+
+		/*! \brief Counters and timings gathered by the optional
+		* instrumentation layer
+		*
+		* Collection only happens when the library is compiled with the
+		* \c CANOPY_PROFILE preprocessor symbol defined; otherwise this
+		* structure remains empty and the instrumentation has no run time
+		* cost. Retrieve with \c getProfileStats() and clear with
+		* \c resetProfileStats() .
+		*
+		* The leaf depth histogram shows how far the data points actually
+		* descend the trees, which indicates how much of the complete binary
+		* tree allocated during training is being used and therefore how to
+		* choose the number of levels.
+		*/
+		struct profileStats
+		{
+			std::uint64_t train_feature_calls = 0; //!< Number of feature functor invocations made during training
+			std::vector<double> train_sort_seconds; //!< Time spent sorting candidate feature scores, indexed by tree level
+			std::vector<double> train_best_split_seconds; //!< Time spent searching for the best split threshold, indexed by tree level
+			std::uint64_t predict_feature_calls = 0; //!< Number of feature functor invocations made during groupwise traversal
+			std::vector<double> traversal_seconds; //!< Time spent in groupwise traversal, indexed by tree
+			std::vector<std::uint64_t> leaf_depth_histogram; //!< Number of data points reaching a leaf at each depth during groupwise traversal
+		};
+
 		// Methods
 		// --------
 		randomForestBase();
 
 		randomForestBase(const int num_trees, const int num_levels); // constructor
 
+		// Copying and moving are both supported. Moves leave the moved-from
+		// forest in an unspecified but destructible state, and transfer the
+		// tree data without copying it, which is what a serving process
+		// should use when installing a freshly trained or loaded replacement
+		// model
+		randomForestBase(const randomForestBase&) = default;
+
+		randomForestBase(randomForestBase&&) = default;
+
+		randomForestBase& operator=(const randomForestBase&) = default;
+
+		randomForestBase& operator=(randomForestBase&&) = default;
+
+		~randomForestBase() = default;
+
+		void swapModel(randomForestBase& other) noexcept;
+
 		bool readFromFile(const std::string filename, const int trees_used = -1, const int max_depth_used = -1);
 
 		bool writeToFile(const std::string filename) const;
 
+		bool readFromBinaryFile(const std::string filename, const int trees_used = -1, const int max_depth_used = -1);
+
+		bool writeToBinaryFile(const std::string filename) const;
+
 		bool isValid() const;
 
+		void setRandomSeed(const unsigned seed);
+
+		void setOOBEstimation(const bool enable);
+
+		void setTrainingFeatureCache(const bool enable);
+
+		void setPresortedTraining(const bool enable);
+
+		void setLazyLoad(const bool enable);
+
+		void setLevelwiseTraversal(const bool enable);
+
+		template <class TWeightIterator>
+		void setSampleWeights(TWeightIterator first_weight, const TWeightIterator last_weight);
+
+		void clearSampleWeights();
+
+		template <class TDivergenceFunctor>
+		int prune(TDivergenceFunctor&& divergence_functor, const float threshold);
+
+		const profileStats& getProfileStats() const;
+
+		void resetProfileStats();
+
+		const std::vector<TOutputDist>& getOOBDistributions() const;
+
+		const std::vector<int>& getOOBCounts() const;
+
 		void setFeatureDefinitionString(const std::string& header_str, const std::string& feat_str);
 
 		void getFeatureDefinitionString(std::string &feat_str) const;
@@ -63,21 +164,63 @@ class randomForestBase
 		template <class TIdIterator, class TLabelIterator, class TFeatureFunctor, class TParameterFunctor>
 		void train(const TIdIterator first_id, const TIdIterator last_id, const TLabelIterator first_label, TFeatureFunctor&& feature_functor, TParameterFunctor&& parameter_functor, const unsigned num_param_combos_to_test, const bool bagging = true, const float bag_proportion = C_DEFAULT_BAGGING_PROPORTION, const bool fit_split_nodes = true, const unsigned min_training_data = C_DEFAULT_MIN_TRAINING_DATA);
 
+		template <class TIdIterator, class TLabelIterator, class TFeatureFunctor, class TParameterFunctor>
+		void trainDeeper(const int new_num_levels, const TIdIterator first_id, const TIdIterator last_id, const TLabelIterator first_label, TFeatureFunctor&& feature_functor, TParameterFunctor&& parameter_functor, const unsigned num_param_combos_to_test, const bool bagging = true, const float bag_proportion = C_DEFAULT_BAGGING_PROPORTION, const unsigned min_training_data = C_DEFAULT_MIN_TRAINING_DATA);
+
+		template <class TIdIterator, class TLabelIterator, class TFeatureFunctor, class TParameterFunctor>
+		void trainMoreTrees(const int num_new_trees, const TIdIterator first_id, const TIdIterator last_id, const TLabelIterator first_label, TFeatureFunctor&& feature_functor, TParameterFunctor&& parameter_functor, const unsigned num_param_combos_to_test, const bool bagging = true, const float bag_proportion = C_DEFAULT_BAGGING_PROPORTION, const unsigned min_training_data = C_DEFAULT_MIN_TRAINING_DATA);
+
 		template<class TIdIterator, class TOutputIterator, class TFeatureFunctor>
 		void predictDistGroupwise(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor) const;
 
+		template<class TIdIterator, class TOutputIterator, class TFeatureFunctor>
+		void predictDistGroupwise(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor, predictionWorkspace& workspace) const;
+
 		template<class TIdIterator, class TOutputIterator, class TFeatureFunctor>
 		void predictDistSingle(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor) const;
 
+		template<class TIdIterator, class TOutputIterator, class TFeatureFunctor>
+		void predictDistBatched(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor) const;
+
+		template<class TIdIterator, class TOutputIterator, class TTreesUsedIterator, class TFeatureFunctor, class TConfidencePredicate>
+		void predictDistGroupwiseEarlyExit(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TTreesUsedIterator trees_used_it, TFeatureFunctor&& feature_functor, TConfidencePredicate&& confidence_predicate, const int stage_size = C_DEFAULT_EARLY_EXIT_STAGE_SIZE) const;
+
+		template<class TIdIterator, class TOutputIterator, class TTreesUsedIterator, class TFeatureFunctor, class TConfidencePredicate>
+		void predictDistSingleEarlyExit(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TTreesUsedIterator trees_used_it, TFeatureFunctor&& feature_functor, TConfidencePredicate&& confidence_predicate, const int stage_size = C_DEFAULT_EARLY_EXIT_STAGE_SIZE) const;
+
+		template<class TIdIterator, class TOutputIterator, class TFeatureFunctor>
+		void predictDistChunked(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor, const int chunk_size = C_DEFAULT_PREDICTION_CHUNK_SIZE) const;
+
+		template<class TIdIterator, class TOutputIterator, class TFeatureFunctor>
+		std::future<void> predictDistGroupwiseAsync(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor, predictionExecutor& executor, const int chunk_size = C_DEFAULT_PREDICTION_CHUNK_SIZE) const;
+
+		template<class TOutputIterator>
+		void predictDistMatrix(const float* const features, const int num_rows, const int stride, TOutputIterator out_it) const;
+
+		template<class TOutputIterator>
+		void predictDistMatrix(const float* const features, const int num_rows, const int stride, TOutputIterator out_it, predictionWorkspace& workspace) const;
+
 		template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TFeatureFunctor>
 		void probabilityGroupwise(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TFeatureFunctor&& feature_functor) const;
 
+		template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TFeatureFunctor>
+		void probabilityGroupwise(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TFeatureFunctor&& feature_functor, predictionWorkspace& workspace) const;
+
+		template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TFeatureFunctor>
+		void probabilityGroupwiseChunked(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TFeatureFunctor&& feature_functor, const int chunk_size = C_DEFAULT_PREDICTION_CHUNK_SIZE) const;
+
 		template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TFeatureFunctor>
 		void probabilitySingle(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TFeatureFunctor&& feature_functor) const;
 
 		template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TBinaryFunction, class TFeatureFunctor, class TPDFFunctor>
 		void probabilityGroupwiseBase(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TBinaryFunction&& binary_function, TFeatureFunctor&& feature_functor, TPDFFunctor&& pdf_functor) const;
 
+		template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TBinaryFunction, class TFeatureFunctor, class TPDFFunctor>
+		void probabilityGroupwiseBase(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TBinaryFunction&& binary_function, TFeatureFunctor&& feature_functor, TPDFFunctor&& pdf_functor, predictionWorkspace& workspace) const;
+
+		template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TBinaryFunction, class TFeatureFunctor, class TPDFFunctor>
+		void probabilityGroupwiseChunkedBase(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TBinaryFunction&& binary_function, TFeatureFunctor&& feature_functor, TPDFFunctor&& pdf_functor, const int chunk_size = C_DEFAULT_PREDICTION_CHUNK_SIZE) const;
+
 		template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TBinaryFunction, class TFeatureFunctor, class TPDFFunctor>
 		void probabilitySingleBase(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TBinaryFunction&& binary_function, TFeatureFunctor&& feature_functor, TPDFFunctor&& pdf_functor) const;
 
@@ -91,33 +234,50 @@ class randomForestBase
 		template <class TIdIterator, class TLabelIterator>
 		void fitLeaf(const int t, const int n, const std::vector<int>& nodebag, const TIdIterator first_id, const TLabelIterator first_label);
 
+		template <class TIdIterator, class TLabelIterator, class TFeatureFunctor, class TParameterFunctor>
+		void growTrees(const int first_tree, const int last_tree, const bool continue_existing, const TIdIterator first_id, const TIdIterator last_id, const TLabelIterator first_label, TFeatureFunctor&& feature_functor, TParameterFunctor&& parameter_functor, const unsigned num_param_combos_to_test, const bool bagging, const float bag_proportion, const unsigned min_training_data);
+
 	protected:
 
 		// Types
 		// -----
 
-		/*! \brief Node structure - represents one node in a tree
-		*/
-		struct node
-		{
-			std::array<int,TNumParams> params; //!< Parameters for the split function
-			bool is_leaf; //!< Indicates whether the node is a leaf (1 -> leaf)
-			float thresh; //!< The decision threshold for an internal node
-			std::vector<TNodeDist> post; //!< The posterior distribution over labels for a leaf node, shuld only ever have 1 or 0 elements
-			node(): is_leaf(false), thresh(0.0) {} //!< Basic constructor
-		};
-
 		/*! \brief Tree structure - represents a single tree
 		*
-		* Nodes are arranged within the tree starting from the root node and
-		* moving across levels followed by down levels such that index 0 is the
-		* root, indices 1 and 2 are in the second layer, indices 3,4,5, and 6
-		* are in the third layer and so on.
-		* This means that the children of node n are 2*n+1 and 2*n+2.
+		* The per-node data are stored in structure-of-arrays form, with one
+		* contiguous array per field indexed by the node number. This keeps the
+		* data touched during traversal (thresholds, parameters and leaf flags)
+		* densely packed in hot cachelines, away from cold data. The node
+		* distributions are held in a separate dense pool, with each node
+		* holding an index into the pool (or -1 for none), rather than each
+		* node heap-allocating its own distribution storage.
+		*
+		* A finished tree is stored in compact form: only the live (reachable)
+		* nodes are stored, in breadth-first order, and each split node holds
+		* the explicit index of its left child in left_child (the right child
+		* is always stored immediately after the left, at left_child + 1).
+		* Leaf nodes have a left_child of -1. Because the order is
+		* breadth-first, a parent always precedes its children.
+		*
+		* While a tree is being grown during training (or parsed from a file),
+		* it is transiently held in complete-binary-tree layout, in which nodes
+		* are arranged starting from the root node and moving across levels
+		* followed by down levels, so that the children of node n are 2*n+1 and
+		* 2*n+2 and left_child is empty. \c compactTree() converts this layout
+		* into the compact form, dropping the (typically vast majority of)
+		* orphan nodes.
 		*/
 		struct tree
 		{
-			std::vector<node> nodes; //!< Vector of the nodes
+			std::vector<std::array<int,TNumParams>> params; //!< Parameters for the split function of each node
+			std::vector<float> thresh; //!< The decision threshold for each internal node
+			std::vector<unsigned char> is_leaf; //!< Indicates whether each node is a leaf (1 -> leaf)
+			std::vector<int> left_child; //!< Index of each split node's left child (right child is at left_child + 1), or -1 for a leaf. Empty while in complete-binary-tree layout
+			std::vector<int> dist_index; //!< Index of each node's distribution within dist_pool, or -1 if the node has none
+			std::vector<TNodeDist> dist_pool; //!< Dense pool of the fitted node distributions
+
+			/*! \brief The number of stored nodes in the tree */
+			int numNodes() const { return is_leaf.size(); }
 		};
 
 		/*! \brief Structure for holding information about a data sample and its feature score
@@ -148,18 +308,59 @@ class randomForestBase
 		// Methods
 		// -------
 
+		void allocateTreeMemory(tree& thistree) const;
+
+		void compactTree(tree& thistree) const;
+
+		void expandTreeForGrowth(tree& thistree, std::vector<unsigned char>& retained_split, std::vector<unsigned char>& former_leaf) const;
+
+		bool parseTreeBlock(std::istream& stream, const int t, const int n_nodes_in_file, const int last_split_node, const int last_leaf_node, const int max_depth_used);
+
+		void ensureTreeLoaded(const int treenum) const;
+
+		TNodeDist& nodeDist(const int t, const int n);
+
+		const TNodeDist& nodeDist(const int t, const int n) const;
+
+		bool hasNodeDist(const int t, const int n) const;
+
+		bool hasSplitNodeDists() const;
+
+		TNodeDist& createNodeDist(const int t, const int n);
+
+		std::default_random_engine& treeRandomEngine(const int t);
+
+		void initialiseOutputDist(TOutputDist& dist) const;
+
 		template<class TIdIterator, class TFeatureFunctor>
 		void findLeavesGroupwise(TIdIterator first_id, const TIdIterator last_id, const int treenum, std::vector<const TNodeDist*>& leaves, TFeatureFunctor&& feature_functor) const;
 
+		template<class TIdIterator, class TFeatureFunctor>
+		void findLeavesGroupwise(TIdIterator first_id, const TIdIterator last_id, const int treenum, std::vector<const TNodeDist*>& leaves, std::vector<std::vector<int>>& nodebag_rel, std::vector<float>& scores, TFeatureFunctor&& feature_functor) const;
+
 		template<class TId, class TFeatureFunctor>
 		const TNodeDist* findLeafSingle(const TId id, const int treenum, TFeatureFunctor&& feature_functor) const;
 
+		template<class TIdIterator, class TFeatureFunctor>
+		void findLeavesBatched(TIdIterator first_id, const TIdIterator last_id, const int treenum, std::vector<const TNodeDist*>& leaves, TFeatureFunctor&& feature_functor) const;
+
+		void findLeavesMatrix(const float* const features, const int num_rows, const int stride, const int treenum, std::vector<const TNodeDist*>& leaves) const;
+
+		template<class TIdIterator, class TFeatureFunctor>
+		void findLeavesLevelwise(TIdIterator first_id, const TIdIterator last_id, const int treenum, std::vector<const TNodeDist*>& leaves, std::vector<std::vector<int>>& nodebag_rel, std::vector<float>& scores, TFeatureFunctor&& feature_functor) const;
+
 		template <class TLabelIterator>
 		static double fastDiscreteEntropy(const std::vector<int>& internal_index, const int n_labels, const TLabelIterator first_label, const std::vector<double>& xlogx_precalc);
 
 		template <class TLabelIterator>
 		static int fastDiscreteEntropySplit(const std::vector<scoreInternalIndexStruct>& data_structs, const int n_labels, const TLabelIterator first_label, const std::vector<double>& xlogx_precalc, double& best_split_impurity, float& thresh);
 
+		template <class TLabelIterator>
+		static double fastWeightedDiscreteEntropy(const std::vector<int>& internal_index, const int n_labels, const TLabelIterator first_label, const std::vector<double>& weights);
+
+		template <class TLabelIterator>
+		static int fastWeightedDiscreteEntropySplit(const std::vector<scoreInternalIndexStruct>& data_structs, const int n_labels, const TLabelIterator first_label, const std::vector<double>& weights, double& best_split_impurity, float& thresh, double& total_weight);
+
 		static std::vector<double> preCalculateXlogX(const int N);
 
 		// Data
@@ -174,11 +375,31 @@ class randomForestBase
 		std::string feature_string; //!< Arbitrary string describing the feature extraction process
 		std::default_random_engine rand_engine; //!< Random engine for generating random numbers during training, may also be used by derived classes
 		std::uniform_int_distribution<int> uni_dist; //!< For generating random integers during traning, may also be used derived classes
+		unsigned master_seed; //!< Seed from which the per-tree random engines are derived
+		std::vector<std::default_random_engine> tree_engines; //!< One random engine per tree, so that the tree-parallel training loop neither races nor contends on a shared engine
+		bool estimate_oob; //!< Whether out-of-bag predictions are accumulated during training
+		bool use_feature_cache; //!< Whether feature score columns are cached across nodes during training
+		bool use_presort; //!< Whether cached feature columns are presorted and partitioned down the tree during training
+		bool lazy_load; //!< Whether tree blocks read from a text model file are parsed on first use rather than at load time
+		bool use_levelwise; //!< Whether groupwise traversal descends the trees level-synchronously rather than in node index order
+		mutable std::vector<std::string> pending_tree_blocks; //!< Unparsed text blocks of trees awaiting lazy materialisation
+		mutable std::vector<int> tree_parsed; //!< Per-tree flags marking trees that have been materialised in lazy loading mode
+		int lazy_n_nodes_in_file; //!< Number of nodes per tree in the file, stored for lazy materialisation
+		int lazy_last_split_node; //!< Index of the last split node to parse, stored for lazy materialisation
+		int lazy_last_leaf_node; //!< Index of the last leaf node to parse, stored for lazy materialisation
+		int lazy_max_depth_used; //!< Maximum tree depth requested at load time, stored for lazy materialisation
+		std::vector<TOutputDist> oob_dists; //!< Accumulated out-of-bag output distribution for each training data point
+		std::vector<int> oob_counts; //!< Number of trees for which each training data point was out-of-bag
+		std::vector<double> sample_weights; //!< Optional per-data-point training weights, indexed by position in the training set (empty when training is unweighted)
+		mutable profileStats profile_stats; //!< Instrumentation counters, only populated when compiled with CANOPY_PROFILE
 
 		// Constants
 		// ---------
 		static constexpr int C_DEFAULT_MIN_TRAINING_DATA = 50; //!< Default value for the minimum number of traning data points in a node before a leaf is declared
 		static constexpr float C_DEFAULT_BAGGING_PROPORTION = 0.5; //!< Default value for the proportion of the traning set used to train each tree
+		static constexpr std::uint32_t C_BINARY_FORMAT_VERSION = 1; //!< Version number of the binary (.trb) file format written by this implementation
+		static constexpr int C_DEFAULT_EARLY_EXIT_STAGE_SIZE = 8; //!< Default number of trees evaluated between confidence checks in the early-exit prediction methods
+		static constexpr int C_DEFAULT_PREDICTION_CHUNK_SIZE = 4096; //!< Default number of data points per chunk in the chunked prediction methods
 
 };
 
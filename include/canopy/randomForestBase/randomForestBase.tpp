@@ -10,9 +10,30 @@
 #include <algorithm>	  /* min_element, max_element, shuffle */
 #include <numeric>		/* iota */
 #include <limits>		 /* numeric limits */
+#include <map>			/* feature score cache during training */
+#include <cstring>		/* memcpy, memcmp */
+#include <sstream>		/* stringstream for headers in the binary format */
 #include <assert.h>	   /* assert macro */
+#include <omp.h>		  /* omp_get_max_threads */
 #include <boost/iterator/permutation_iterator.hpp>
 
+// Software prefetch hint used during level-synchronous traversal, a no-op on
+// compilers without the builtin
+#if defined(__GNUC__) || defined(__clang__)
+#define CANOPY_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define CANOPY_PREFETCH(addr) ((void)0)
+#endif
+
+// Memory mapping of binary model files (POSIX only, other platforms fall back
+// to a buffered read)
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 namespace canopy
 {
 
@@ -56,10 +77,18 @@ template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsi
 void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::initialise()
 {
 	valid = false;
+	estimate_oob = false;
+	use_feature_cache = false;
+	use_presort = false;
+	lazy_load = false;
+	use_levelwise = false;
+	pending_tree_blocks.clear();
+	tree_parsed.clear();
 
 	// Seed the random number generator
 	std::random_device rd{};
-	rand_engine.seed(rd());
+	master_seed = rd();
+	rand_engine.seed(master_seed);
 
 	feature_header = "";
 	feature_string = "";
@@ -68,24 +97,703 @@ void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::initial
 	forest.clear();
 }
 
+/*! \brief Exchange the entire model state with another forest object.
+*
+* Swaps every member of the two objects, including the tree data, validity
+* flags and feature definition strings. No tree data are copied, so the
+* operation completes in constant time regardless of the forest size.
+*
+* This supports a double-buffered update scheme in a long-running process:
+* construct and load (or train) a replacement forest in a spare object, then
+* swap it into the serving object. Note that the swap itself is not
+* synchronised with concurrent readers of either object -- a caller that
+* serves predictions from multiple threads must either hold its own lock
+* around the swap, or use \c canopy::hotSwapModel , which provides
+* lock-free versioned snapshots and lets in-flight predictions complete on
+* the old model.
+*
+* \param other The forest object to exchange state with
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::swapModel(randomForestBase& other) noexcept
+{
+	std::swap(n_trees,other.n_trees);
+	std::swap(n_levels,other.n_levels);
+	std::swap(n_nodes,other.n_nodes);
+	std::swap(valid,other.valid);
+	std::swap(fit_split_nodes,other.fit_split_nodes);
+	std::swap(forest,other.forest);
+	std::swap(feature_header,other.feature_header);
+	std::swap(feature_string,other.feature_string);
+	std::swap(rand_engine,other.rand_engine);
+	std::swap(uni_dist,other.uni_dist);
+	std::swap(master_seed,other.master_seed);
+	std::swap(tree_engines,other.tree_engines);
+	std::swap(estimate_oob,other.estimate_oob);
+	std::swap(use_feature_cache,other.use_feature_cache);
+	std::swap(use_presort,other.use_presort);
+	std::swap(lazy_load,other.lazy_load);
+	std::swap(use_levelwise,other.use_levelwise);
+	std::swap(pending_tree_blocks,other.pending_tree_blocks);
+	std::swap(tree_parsed,other.tree_parsed);
+	std::swap(lazy_n_nodes_in_file,other.lazy_n_nodes_in_file);
+	std::swap(lazy_last_split_node,other.lazy_last_split_node);
+	std::swap(lazy_last_leaf_node,other.lazy_last_leaf_node);
+	std::swap(lazy_max_depth_used,other.lazy_max_depth_used);
+	std::swap(oob_dists,other.oob_dists);
+	std::swap(oob_counts,other.oob_counts);
+	std::swap(sample_weights,other.sample_weights);
+	std::swap(profile_stats,other.profile_stats);
+}
+
+/*! \brief Set the seed used for random number generation during training.
+*
+* Training derives one random engine per tree from this seed, so two forests
+* of the same shape trained with the same seed on the same data make identical
+* bagging choices, regardless of how many threads are used. For fully
+* reproducible training the parameter functor passed to \c train() must also
+* be deterministic.
+*
+* If this method is not called, the seed is drawn from \c std::random_device
+* on construction.
+*
+* \param seed The seed value to use
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::setRandomSeed(const unsigned seed)
+{
+	master_seed = seed;
+	rand_engine.seed(master_seed);
+}
+
+/*! \brief Access the random engine belonging to a given tree.
+*
+* Each tree has its own engine, deterministically derived from the master
+* seed at the start of training. Derived classes and callbacks that need
+* random numbers from within the tree-parallel training loop should use the
+* engine of the tree they are working on, rather than the shared
+* \c rand_engine , to avoid data races and cacheline contention between
+* threads.
+*
+* \param t Index of the tree
+* \return Reference to the tree's random engine
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+std::default_random_engine& randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::treeRandomEngine(const int t)
+{
+	return tree_engines[t];
+}
+
+/*! \brief Enable or disable out-of-bag error estimation during training.
+*
+* When enabled, each call to \c train() with bagging active additionally
+* records, for every training data point, the combined prediction of the
+* trees in whose bag the point did not appear. This reuses the features
+* already being evaluated during training, so no second pass over the data is
+* needed to estimate the generalisation error. The accumulated predictions
+* may be retrieved with \c getOOBDistributions() and \c getOOBCounts() , or
+* summarised via model-specific methods in the derived classes.
+*
+* \param enable If true, out-of-bag predictions are accumulated during
+* subsequent calls to \c train()
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::setOOBEstimation(const bool enable)
+{
+	estimate_oob = enable;
+}
+
+/*! \brief Enable or disable caching of feature scores during training.
+*
+* When enabled, each tree keeps a cache of feature score columns, keyed on
+* the parameter set. The first time a parameter set is drawn anywhere in the
+* tree, its scores are computed once for the whole training set; any later
+* node that draws the same parameter set gathers the cached column through
+* its bag indices instead of invoking the feature functor again. This is
+* worthwhile when the feature functor is expensive and the space of distinct
+* parameter sets is small enough that the same sets are drawn repeatedly at
+* different nodes.
+*
+* Note that each cached column stores one float per training data point, so
+* the memory used grows with the number of distinct parameter sets drawn in
+* a tree. The cache requires the feature functor to be deterministic: the
+* same parameter set must always produce the same scores.
+*
+* \param enable If true, feature scores are cached during subsequent calls
+* to \c train()
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::setTrainingFeatureCache(const bool enable)
+{
+	use_feature_cache = enable;
+}
+
+/*! \brief Enable or disable presorted split finding during training.
+*
+* When enabled, the score column of each cached feature is sorted once over
+* the tree's root bag, and the sorted order is maintained as the data are
+* partitioned down the tree: whenever a node splits, the slice of each
+* cached feature belonging to that node is stably partitioned between its
+* children. Finding the best split for a candidate at a node then reads a
+* presorted slice directly, turning the per-candidate O(N log N) sort into a
+* linear scan.
+*
+* This option implies the training feature cache (see
+* \c setTrainingFeatureCache() ), and additionally stores one int per data
+* point in the root bag for every distinct parameter set drawn in a tree.
+* Candidates whose feature scores contain ties may be split at a marginally
+* different threshold than in the unsorted code path, because the order of
+* tied elements is not specified in either case; the statistical behaviour
+* is unchanged.
+*
+* \param enable If true, presorted split finding is used during subsequent
+* calls to \c train()
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::setPresortedTraining(const bool enable)
+{
+	use_presort = enable;
+}
+
+/*! \brief Enable or disable lazy parsing of text model files.
+*
+* When enabled, subsequent calls to \c readFromFile() only read the header
+* and locate the block of text belonging to each tree; the blocks themselves
+* are parsed on first use, when a prediction (or write) routine first touches
+* the tree. Combined with the early-exit prediction methods, this allows a
+* newly-started worker to serve its first request after parsing only the
+* trees that the confidence check actually required, rather than waiting for
+* the whole model.
+*
+* Note that a malformed tree block can then only be detected when the tree is
+* first touched. In that case the affected tree is left empty and
+* \c isValid() returns false from that point on, so long-running processes
+* using lazy loading should check \c isValid() after prediction calls if they
+* need to detect truncated model files. When this option is disabled (the
+* default), \c readFromFile() parses all the tree blocks before returning,
+* in parallel.
+*
+* \param enable If true, tree blocks are parsed on first use during
+* subsequent calls to \c readFromFile()
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::setLazyLoad(const bool enable)
+{
+	lazy_load = enable;
+}
+
+/*! \brief Enable or disable level-synchronous groupwise traversal.
+*
+* When enabled, the groupwise prediction methods descend each tree one level
+* at a time, keeping a single current-node index per data point, instead of
+* visiting nodes in index order with a bag of data point indices held at
+* every node. This avoids allocating and growing a vector per tree node and
+* allows the node data of the next level to be prefetched while the current
+* level is scored, which helps on deep trees where the per-node bag
+* bookkeeping otherwise dominates the threshold comparisons. The feature
+* functor is still called once per (node, set of data points) pair, exactly
+* as in the default mode, so no change to the functor is needed.
+*
+* The results are identical to the default mode in all cases; only the order
+* of feature functor calls differs. The default mode remains preferable for
+* shallow trees, where the flat reordering passes cost more than they save.
+*
+* \param enable If true, groupwise prediction methods use level-synchronous
+* traversal
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::setLevelwiseTraversal(const bool enable)
+{
+	use_levelwise = enable;
+}
+
+/*! \brief Set per-data-point weights to be used by subsequent training calls.
+*
+* When weights are set, the impurity calculations and the node distribution
+* fits of subsequent calls to \c train() , \c trainDeeper() and
+* \c trainMoreTrees() count each data point with its weight instead of
+* counting it once. This provides weighted training natively, without
+* physically replicating the ids of heavily-weighted data points in the
+* training arrays (which inflates every sort and shuffle by the total
+* replication factor).
+*
+* The weights are indexed by position in the training set: the i'th weight
+* applies to the i'th data point in the range later passed to the training
+* call, exactly as the labels are indexed. The weight range must therefore
+* cover the whole training set, otherwise the training call returns without
+* doing anything. The weights must be strictly positive; there are no checks
+* to ensure this. The weights remain in effect until \c clearSampleWeights()
+* is called.
+*
+* Note that bagging still draws each tree's bag uniformly, and the
+* min_training_data threshold still counts data points rather than weight,
+* so the tree shapes depend on the weights only through the chosen splits.
+* For the classifier, weighted training always uses the exact split search,
+* even when histogram splits are enabled.
+*
+* \tparam TWeightIterator The type of the iterator used to access the weights.
+* Must be a forward iterator that dereferences to an arithmetic type.
+* \param first_weight Iterator to the weight of the first training data point
+* \param last_weight Iterator to the weight of the last training data point
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TWeightIterator>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::setSampleWeights(TWeightIterator first_weight, const TWeightIterator last_weight)
+{
+	sample_weights.assign(first_weight,last_weight);
+}
+
+/*! \brief Remove any per-data-point weights, returning to unweighted training.
+*
+* Subsequent training calls count each data point once, as if
+* \c setSampleWeights() had never been called.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::clearSampleWeights()
+{
+	sample_weights.clear();
+}
+
+/*! \brief Access the instrumentation counters and timings gathered so far
+*
+* The counters are only populated when the library is compiled with the
+* \c CANOPY_PROFILE preprocessor symbol defined; otherwise the returned
+* structure is empty. Collection accumulates across calls until
+* \c resetProfileStats() is called.
+*
+* \return The accumulated counters and timings
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+const typename randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::profileStats& randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::getProfileStats() const
+{
+	return profile_stats;
+}
+
+/*! \brief Clear the instrumentation counters and timings
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::resetProfileStats()
+{
+	profile_stats = profileStats();
+}
+
+/*! \brief Access the out-of-bag output distributions accumulated by the most
+* recent training run.
+*
+* Only valid after a call to \c train() with out-of-bag estimation enabled
+* via \c setOOBEstimation() and bagging active.
+*
+* \return Vector with one normalised output distribution per training data
+* point, aggregated over the trees for which that point was out-of-bag. The
+* distribution for a point that was in every tree's bag is left in its
+* initialised state; check \c getOOBCounts() before using it.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+const std::vector<TOutputDist>& randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::getOOBDistributions() const
+{
+	return oob_dists;
+}
+
+/*! \brief Access the number of trees for which each training data point was
+* out-of-bag during the most recent training run.
+*
+* Only valid after a call to \c train() with out-of-bag estimation enabled
+* via \c setOOBEstimation() and bagging active.
+*
+* \return Vector with one count per training data point
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+const std::vector<int>& randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::getOOBCounts() const
+{
+	return oob_counts;
+}
+
+/*! \brief Prepare an output distribution for use as an out-of-bag accumulator.
+*
+* This default implementation does nothing, which is sufficient for output
+* distributions that are ready for \c combineWith() after default
+* construction. Derived classes whose output distribution requires explicit
+* initialisation (such as the classifier, whose discreteDistribution must know
+* the number of classes) hide this method with their own version.
+*
+* \param - The distribution to initialise
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::initialiseOutputDist(TOutputDist& /*dist*/) const
+{
+
+}
+
 /*! \brief Allocates memory for the forest with the required number of trees and
 * levels/depth.
+*
+* Each tree is allocated in complete-binary-tree layout, ready to be grown by
+* training. Any existing tree data are discarded.
 */
 template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
 void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::allocateForestMemory()
 {
 	// Allocate memory for the forest
+	forest.clear();
 	forest.resize(n_trees);
 
-	// Find number of nodes
+	// Any tree blocks awaiting lazy materialisation belong to a previous model
+	pending_tree_blocks.clear();
+	tree_parsed.clear();
+
+	// Find number of nodes in the complete-binary-tree layout
 	n_nodes = std::pow(2,n_levels+1) - 1;
 
 	// Allocate memory for each tree
+	for(int t = 0; t < n_trees; ++t)
+		allocateTreeMemory(forest[t]);
+
+}
+
+/*! \brief Allocates memory for a single tree in complete-binary-tree layout.
+*
+* The tree is sized to hold the full complete binary tree of n_nodes nodes, as
+* required while a tree is being grown during training or parsed from a file.
+* Any existing data in the tree are discarded.
+* \param thistree The tree whose storage should be allocated.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::allocateTreeMemory(tree& thistree) const
+{
+	thistree.params.assign(n_nodes,std::array<int,TNumParams>());
+	thistree.thresh.assign(n_nodes,0.0);
+	thistree.is_leaf.assign(n_nodes,0);
+	thistree.left_child.clear();
+	thistree.dist_index.assign(n_nodes,-1);
+	thistree.dist_pool.clear();
+}
+
+/*! \brief Convert a tree from complete-binary-tree layout into the compact form.
+*
+* Only the live (reachable) nodes are retained, in breadth-first order, with
+* explicit child indices in left_child. In a deep tree the vast majority of
+* nodes in the complete layout are unreachable orphans, so this reduces the
+* memory held by the tree by orders of magnitude. Has no effect on a tree
+* that is already compact.
+* \param thistree The tree to compact.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::compactTree(tree& thistree) const
+{
+	// A tree with a non-empty left_child array is already compact
+	if(!thistree.left_child.empty())
+		return;
+
+	const int n_alloc = thistree.numNodes();
+
+	// First pass to assign compact indices to the live nodes in breadth-first
+	// order. A node is live if it is the root or the child of a live split
+	// node. Note that because both children of a split node are live, the two
+	// children always receive adjacent compact indices
+	std::vector<int> compact_index(n_alloc,-1);
+	int n_live = 0;
+	for(int n = 0; n < n_alloc; ++n)
+	{
+		if( (n == 0) || ( (compact_index[(n-1)/2] >= 0) && !thistree.is_leaf[(n-1)/2] ) )  // integer division deliberate
+			compact_index[n] = n_live++;
+	}
+
+	// Second pass to gather the live nodes into the compact arrays and link
+	// the children explicitly. The distribution pool is already dense and
+	// carries over unchanged
+	tree compacted;
+	compacted.params.resize(n_live);
+	compacted.thresh.resize(n_live);
+	compacted.is_leaf.resize(n_live);
+	compacted.left_child.assign(n_live,-1);
+	compacted.dist_index.resize(n_live);
+	compacted.dist_pool = std::move(thistree.dist_pool);
+	for(int n = 0; n < n_alloc; ++n)
+	{
+		const int c = compact_index[n];
+		if(c < 0)
+			continue;
+		compacted.params[c] = thistree.params[n];
+		compacted.thresh[c] = thistree.thresh[n];
+		compacted.is_leaf[c] = thistree.is_leaf[n];
+		compacted.dist_index[c] = thistree.dist_index[n];
+		if(!thistree.is_leaf[n])
+			compacted.left_child[c] = compact_index[2*n+1];
+	}
+
+	thistree = std::move(compacted);
+}
+
+/*! \brief Expand a compact tree back into complete-binary-tree layout so
+* that it can be grown further.
+*
+* This is the inverse of \c compactTree() , used when continuing the training
+* of an existing tree (see \c trainDeeper() ). The current value of n_nodes
+* determines the size of the expanded layout, so deepening the layout is a
+* matter of raising n_levels and n_nodes before calling this function. The
+* fitted node distributions are carried over into the expanded tree's pool.
+*
+* Former leaf nodes are deliberately not marked as leaves in the expanded
+* tree, so that the growing procedure is free to split them further; they
+* keep their fitted distributions until the growing procedure decides their
+* fate.
+*
+* \param thistree The tree to expand. Must be in compact form.
+* \param retained_split Filled with one flag per node of the expanded layout,
+* set for the nodes that are split nodes of the existing tree.
+* \param former_leaf Filled with one flag per node of the expanded layout,
+* set for the nodes that are leaves of the existing tree.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::expandTreeForGrowth(tree& thistree, std::vector<unsigned char>& retained_split, std::vector<unsigned char>& former_leaf) const
+{
+	tree expanded;
+	allocateTreeMemory(expanded);
+	retained_split.assign(n_nodes,0);
+	former_leaf.assign(n_nodes,0);
+
+	// Walk the compact tree, placing each stored node at its
+	// complete-binary-tree position. A parent always precedes its children
+	// in the compact order, so a single forward pass suffices
+	const int n_stored = thistree.numNodes();
+	std::vector<int> complete_of_compact(n_stored);
+	complete_of_compact[0] = 0;
+	for(int c = 0; c < n_stored; ++c)
+	{
+		const int q = complete_of_compact[c];
+		expanded.params[q] = thistree.params[c];
+		expanded.thresh[q] = thistree.thresh[c];
+		if(thistree.is_leaf[c])
+			former_leaf[q] = 1;
+		else
+		{
+			retained_split[q] = 1;
+			complete_of_compact[thistree.left_child[c]] = 2*q + 1;
+			complete_of_compact[thistree.left_child[c]+1] = 2*q + 2;
+		}
+		if(thistree.dist_index[c] >= 0)
+		{
+			expanded.dist_index[q] = expanded.dist_pool.size();
+			expanded.dist_pool.emplace_back(std::move(thistree.dist_pool[thistree.dist_index[c]]));
+		}
+	}
+
+	thistree = std::move(expanded);
+}
+
+/*! \brief Collapse subtrees that barely change the fitted distribution into
+* leaf nodes.
+*
+* After training with the fit_split_nodes option, every split node carries a
+* distribution fitted to all the training data that passed through it. When
+* the distributions of both children of a split node diverge from the node's
+* own distribution by no more than a given threshold, descending into the
+* subtree cannot meaningfully change the prediction, so the split node is
+* made a leaf using its already-fitted distribution. The collapse is applied
+* bottom-up, so a subtree of near-identical distributions collapses all the
+* way to its root, and the trees' compact storage is then rebuilt without the
+* removed nodes. This shrinks both the memory held by the model and the
+* average traversal depth, at (near) identical accuracy.
+*
+* The model must still hold its split-node distributions: the file readers
+* discard them, so a model read from a file cannot be pruned and the method
+* returns zero without changes. Prune after training and before
+* \c writeToFile() .
+*
+* \tparam TDivergenceFunctor Type of the divergence functor. Must define
+* operator() taking two const TNodeDist& arguments and returning a float
+* measure of how much the second distribution diverges from the first. Must
+* be safe to call from multiple threads simultaneously.
+* \param divergence_functor The divergence functor. It need not be symmetric;
+* it is always called with the parent's distribution as the first argument.
+* \param threshold A split node is collapsed when the divergence of both of
+* its children's distributions from its own is at most this value.
+* \return The total number of nodes removed from the forest.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TDivergenceFunctor>
+int randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::prune(TDivergenceFunctor&& divergence_functor, const float threshold)
+{
+	if(!valid || !hasSplitNodeDists())
+		return 0;
+
+	int total_removed = 0;
+
+	#pragma omp parallel for schedule(dynamic)
 	for(int t = 0; t < n_trees; ++t)
 	{
-		(forest[t]).nodes.resize(n_nodes);
+		ensureTreeLoaded(t);
+		tree& thistree = forest[t];
+		const int n_stored = thistree.numNodes();
+
+		// Bottom-up collapse pass. Children are stored after their parent in
+		// the compact order, so a reverse pass visits every split node after
+		// its children have had their chance to collapse
+		bool changed = false;
+		for(int n = n_stored - 1; n >= 0; --n)
+		{
+			if(thistree.is_leaf[n])
+				continue;
+
+			// Only a split node whose children are both (possibly collapsed)
+			// leaves with fitted distributions can collapse
+			const int l = thistree.left_child[n];
+			if(!thistree.is_leaf[l] || !thistree.is_leaf[l+1])
+				continue;
+			if( (thistree.dist_index[n] < 0) || (thistree.dist_index[l] < 0) || (thistree.dist_index[l+1] < 0) )
+				continue;
+
+			const TNodeDist& parent_dist = thistree.dist_pool[thistree.dist_index[n]];
+			if( (std::forward<TDivergenceFunctor>(divergence_functor)(parent_dist,thistree.dist_pool[thistree.dist_index[l]]) <= threshold)
+				&& (std::forward<TDivergenceFunctor>(divergence_functor)(parent_dist,thistree.dist_pool[thistree.dist_index[l+1]]) <= threshold) )
+			{
+				// Make the node a leaf, with the same conventions as fitLeaf()
+				thistree.is_leaf[n] = 1;
+				thistree.left_child[n] = -1;
+				std::fill(thistree.params[n].begin(),thistree.params[n].end(),-1);
+				thistree.thresh[n] = 0.0;
+				changed = true;
+			}
+		}
+
+		if(!changed)
+			continue;
+
+		// Find the nodes still reachable from the root. A parent precedes its
+		// children in the compact order, so a single forward pass suffices
+		std::vector<unsigned char> live(n_stored,0);
+		live[0] = 1;
+		for(int n = 0; n < n_stored; ++n)
+		{
+			if(live[n] && !thistree.is_leaf[n])
+			{
+				live[thistree.left_child[n]] = 1;
+				live[thistree.left_child[n]+1] = 1;
+			}
+		}
+
+		// Assign new compact indices to the live nodes, preserving their
+		// order (children of a live split node remain adjacent)
+		std::vector<int> new_index(n_stored,-1);
+		int n_live = 0;
+		for(int n = 0; n < n_stored; ++n)
+			if(live[n])
+				new_index[n] = n_live++;
+
+		// Gather the live nodes and their distributions into fresh arrays
+		tree pruned;
+		pruned.params.resize(n_live);
+		pruned.thresh.resize(n_live);
+		pruned.is_leaf.resize(n_live);
+		pruned.left_child.assign(n_live,-1);
+		pruned.dist_index.assign(n_live,-1);
+		for(int n = 0; n < n_stored; ++n)
+		{
+			const int c = new_index[n];
+			if(c < 0)
+				continue;
+			pruned.params[c] = thistree.params[n];
+			pruned.thresh[c] = thistree.thresh[n];
+			pruned.is_leaf[c] = thistree.is_leaf[n];
+			if(!thistree.is_leaf[n])
+				pruned.left_child[c] = new_index[thistree.left_child[n]];
+			if(thistree.dist_index[n] >= 0)
+			{
+				pruned.dist_index[c] = pruned.dist_pool.size();
+				pruned.dist_pool.emplace_back(std::move(thistree.dist_pool[thistree.dist_index[n]]));
+			}
+		}
+		thistree = std::move(pruned);
+
+		#pragma omp atomic
+		total_removed += n_stored - n_live;
 	}
 
+	return total_removed;
+}
+
+/*! \brief Access the node distribution fitted to a given node.
+*
+* The distribution must exist (this may be checked with \c hasNodeDist() ).
+* \param t Index of the tree containing the node.
+* \param n Index of the node within its tree.
+* \return Reference to the node's distribution within the tree's distribution
+* pool.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+TNodeDist& randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::nodeDist(const int t, const int n)
+{
+	return forest[t].dist_pool[forest[t].dist_index[n]];
+}
+
+/*! \brief Access the node distribution fitted to a given node (const overload).
+*
+* The distribution must exist (this may be checked with \c hasNodeDist() ).
+* \param t Index of the tree containing the node.
+* \param n Index of the node within its tree.
+* \return Reference to the node's distribution within the tree's distribution
+* pool.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+const TNodeDist& randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::nodeDist(const int t, const int n) const
+{
+	return forest[t].dist_pool[forest[t].dist_index[n]];
+}
+
+/*! \brief Check whether a node has a fitted distribution.
+*
+* Split nodes only carry a distribution if the model was trained with the
+* fit_split_nodes option, and orphan nodes never do.
+* \param t Index of the tree containing the node.
+* \param n Index of the node within its tree.
+* \return True if the node has a distribution in the tree's pool.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+bool randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::hasNodeDist(const int t, const int n) const
+{
+	return forest[t].dist_index[n] >= 0;
+}
+
+/*! \brief Check whether the split nodes of the model actually have fitted
+* distributions.
+*
+* This can be false even when \c fit_split_nodes is true, because the model
+* readers discard the split-node distributions: a model that was trained with
+* \c fit_split_nodes and then written and read back retains only its leaf
+* distributions. The write routines use this check so that they never claim
+* to store split distributions that are not there.
+*
+* \return True if the first split node encountered has a fitted distribution,
+* false if it does not or if the forest contains no split nodes.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+bool randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::hasSplitNodeDists() const
+{
+	// All split nodes are fitted together during training, so checking the
+	// first one found is enough
+	for(int t = 0; t < n_trees; ++t)
+		for(int n = 0; n < forest[t].numNodes(); ++n)
+			if(!forest[t].is_leaf[n])
+				return hasNodeDist(t,n);
+	return false;
+}
+
+/*! \brief Create a new (default-constructed) distribution for a given node in
+* the tree's distribution pool.
+*
+* Any previously-created distribution for the node is abandoned in the pool.
+* Note that the returned reference (and any other reference into the pool) is
+* invalidated by a subsequent \c createNodeDist() call on the same tree.
+* \param t Index of the tree containing the node.
+* \param n Index of the node within its tree.
+* \return Reference to the new distribution.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+TNodeDist& randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::createNodeDist(const int t, const int n)
+{
+	forest[t].dist_index[n] = forest[t].dist_pool.size();
+	forest[t].dist_pool.emplace_back();
+	return forest[t].dist_pool.back();
 }
 
 
@@ -158,102 +866,245 @@ bool randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::readFro
 	static_cast<derivedProxy*>(this)->readHeader(infile);
 	if(infile.fail()) return false;
 
-	// Allocate memory to hold this tree structure
-	allocateForestMemory();
-
-	// Loop through the trees
-	for(int t = 0; t < n_trees; ++t)
+	// Prepare the forest. Each tree is allocated in complete-binary-tree
+	// layout just before it is parsed, and compacted immediately afterwards,
+	// so that only one tree at a time (per thread) pays the complete layout's
+	// memory cost
+	forest.clear();
+	forest.resize(n_trees);
+	n_nodes = std::pow(2,n_levels+1) - 1;
+	pending_tree_blocks.clear();
+	tree_parsed.clear();
+
+	// Gather the remainder of the file and cut it into one block of text per
+	// tree. The writer separates trees with a blank line and no line within a
+	// tree block is blank, so the block boundaries can be found without
+	// parsing the blocks, and each tree can then be parsed independently
+	getline(infile,dummy_string); // move past the end of the header data line
+	std::vector<std::string> tree_blocks;
+	tree_blocks.reserve(n_trees);
+	std::string block, line;
+	while(getline(infile,line))
 	{
-		// Flag that is true if the parent node is a leaf or orphan node
-		std::vector<bool> orphan_flag(n_nodes_in_file,false);
-
-		// Loop through nodes
-		for(int n = 0; n < n_nodes_in_file; ++n)
+		if(line.empty())
 		{
-			// Skip if this is an orphan, and set children to orphans
-			if(orphan_flag[n])
+			if(!block.empty())
 			{
-				if(2*n + 2 < n_nodes_in_file)
-				{
-					orphan_flag[2*n+1] = true;
-					orphan_flag[2*n+2] = true;
-				}
-				continue;
+				tree_blocks.emplace_back(std::move(block));
+				block.clear();
 			}
+		}
+		else
+		{
+			block += line;
+			block += '\n';
+		}
+	}
+	if(!block.empty())
+		tree_blocks.emplace_back(std::move(block));
+	infile.close();
+
+	// The file may contain more trees than requested via trees_used, but not
+	// fewer
+	if(static_cast<int>(tree_blocks.size()) < n_trees)
+		return false;
 
-			// Check that this node isn't beyond the max depth to read in
-			if((max_depth_used > -1) && (n > last_leaf_node))
+	if(lazy_load)
+	{
+		// Stash the unparsed blocks along with the parameters needed to parse
+		// them later. Each tree is materialised by ensureTreeLoaded() the
+		// first time a prediction or write routine touches it
+		tree_blocks.resize(n_trees);
+		pending_tree_blocks = std::move(tree_blocks);
+		tree_parsed.assign(n_trees,0);
+		lazy_n_nodes_in_file = n_nodes_in_file;
+		lazy_last_split_node = last_split_node;
+		lazy_last_leaf_node = last_leaf_node;
+		lazy_max_depth_used = max_depth_used;
+	}
+	else
+	{
+		// Parse the trees in parallel, each from its own block
+		bool success = true;
+		#pragma omp parallel for schedule(dynamic)
+		for(int t = 0; t < n_trees; ++t)
+		{
+			std::istringstream tree_stream(tree_blocks[t]);
+			if(!parseTreeBlock(tree_stream,t,n_nodes_in_file,last_split_node,last_leaf_node,max_depth_used))
 			{
-				// If this was a leaf in the original tree, the children will be
-				// orphans
-				bool isleaf;
-				infile >> isleaf;
-				if(isleaf && (2*n + 2 < n_nodes_in_file) )
-				{
-					orphan_flag[2*n+1] = true;
-					orphan_flag[2*n+2] = true;
-				}
-				// Skip the rest of the information on this line, then move on
-				getline(infile,dummy_string);
-				continue;
+				#pragma omp atomic write
+				success = false;
 			}
+		}
+		if(!success) return false;
+	}
 
-			infile >> forest[t].nodes[n].is_leaf;
-			if(infile.fail()) return false;
+	valid = true;
+	return true;
+
+}
+
+/*! \brief Parse the text representation of a single tree from a stream.
+*
+* The stream must be positioned at the start of one tree's block of a .tr
+* file, as written by \c writeToFile() , and the forest must already be sized
+* so that tree \c t exists. Different trees may be parsed concurrently from
+* their own streams, since each call only touches its own tree.
+*
+* \param stream Stream holding the tree's block of node lines.
+* \param t Index of the tree to parse into.
+* \param n_nodes_in_file Number of complete-binary-tree node positions per
+* tree in the file, as determined by the file's header.
+* \param last_split_node Index of the last node to treat as a split node, or
+* -1 if the depth is not being limited (see \c readFromFile() ).
+* \param last_leaf_node Index of the last node to read in, or -1 if the depth
+* is not being limited.
+* \param max_depth_used The maximum tree depth being read, or -1 if the depth
+* is not being limited.
+* \return True if the tree was successfully parsed, false otherwise.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+bool randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::parseTreeBlock(std::istream& stream, const int t, const int n_nodes_in_file, const int last_split_node, const int last_leaf_node, const int max_depth_used)
+{
+	std::string dummy_string;
+
+	allocateTreeMemory(forest[t]);
+
+	// Flag that is true if the parent node is a leaf or orphan node
+	std::vector<bool> orphan_flag(n_nodes_in_file,false);
 
-			// This node is a leaf if it is marked as one, or if it lies at
-			// the maximum level to read in the trees
-			if(forest[t].nodes[n].is_leaf || ( (max_depth_used > -1) && (n > last_split_node) ) )
+	// Loop through nodes
+	for(int n = 0; n < n_nodes_in_file; ++n)
+	{
+		// Skip if this is an orphan, and set children to orphans
+		if(orphan_flag[n])
+		{
+			if(2*n + 2 < n_nodes_in_file)
 			{
-				if(forest[t].nodes[n].is_leaf)
-				{
-					if(2*n + 2 < n_nodes_in_file)
-					{
-						orphan_flag[2*n+1] = true;
-						orphan_flag[2*n+2] = true;
-					}
-				}
-				else
-				{
-					// Skip over the paramters and the threshold as they are irrelevant
-					// if this is to be a leaf node
-					float tempfloat;
-					int tempint;
-					for(unsigned p = 0; p < TNumParams; ++p)
-						infile >> tempint;
-					infile >> tempfloat;
-					if(infile.fail()) return false;
-					forest[t].nodes[n].is_leaf = true;
-				}
+				orphan_flag[2*n+1] = true;
+				orphan_flag[2*n+2] = true;
+			}
+			continue;
+		}
 
-				// Prepare and read in the posterior distribution
-				forest[t].nodes[n].post.resize(1);
-				static_cast<derivedProxy*>(this)->initialiseNodeDist(t,n);
-				infile >> forest[t].nodes[n].post[0];
-				if(infile.fail()) return false;
+		// Check that this node isn't beyond the max depth to read in
+		if((max_depth_used > -1) && (n > last_leaf_node))
+		{
+			// If this was a leaf in the original tree, the children will be
+			// orphans
+			bool isleaf;
+			stream >> isleaf;
+			if(isleaf && (2*n + 2 < n_nodes_in_file) )
+			{
+				orphan_flag[2*n+1] = true;
+				orphan_flag[2*n+2] = true;
+			}
+			// Skip the rest of the information on this line, then move on
+			getline(stream,dummy_string);
+			continue;
+		}
 
+		bool is_leaf_in;
+		stream >> is_leaf_in;
+		if(stream.fail()) return false;
+		forest[t].is_leaf[n] = is_leaf_in;
+
+		// This node is a leaf if it is marked as one, or if it lies at
+		// the maximum level to read in the trees
+		if(is_leaf_in || ( (max_depth_used > -1) && (n > last_split_node) ) )
+		{
+			if(is_leaf_in)
+			{
+				if(2*n + 2 < n_nodes_in_file)
+				{
+					orphan_flag[2*n+1] = true;
+					orphan_flag[2*n+2] = true;
+				}
 			}
 			else
 			{
+				// Skip over the paramters and the threshold as they are irrelevant
+				// if this is to be a leaf node
+				float tempfloat;
+				int tempint;
 				for(unsigned p = 0; p < TNumParams; ++p)
-				{
-					infile >> forest[t].nodes[n].params[p];
-					if(infile.fail()) return false;
-				}
-				infile >> forest[t].nodes[n].thresh;
-				if(infile.fail()) return false;
-				forest[t].nodes[n].post.clear();
-				if(fit_split_nodes)
-					getline(infile,dummy_string); // skip unneeded posterior
+					stream >> tempint;
+				stream >> tempfloat;
+				if(stream.fail()) return false;
+				forest[t].is_leaf[n] = 1;
 			}
-		} // node loop
-	}
 
-	infile.close();
+			// Prepare and read in the posterior distribution
+			TNodeDist& dist = createNodeDist(t,n);
+			static_cast<derivedProxy*>(this)->initialiseNodeDist(t,n);
+			stream >> dist;
+			if(stream.fail()) return false;
+
+		}
+		else
+		{
+			for(unsigned p = 0; p < TNumParams; ++p)
+			{
+				stream >> forest[t].params[n][p];
+				if(stream.fail()) return false;
+			}
+			stream >> forest[t].thresh[n];
+			if(stream.fail()) return false;
+			if(fit_split_nodes)
+				getline(stream,dummy_string); // skip unneeded posterior
+		}
+	} // node loop
+
+	compactTree(forest[t]);
 
-	valid = true;
 	return true;
+}
+
+/*! \brief Materialise a lazily-loaded tree if it has not yet been parsed.
+*
+* Does nothing unless the model was loaded by \c readFromFile() with lazy
+* loading enabled (see \c setLazyLoad() ) and the requested tree's block has
+* not been parsed yet. Safe to call concurrently from multiple threads;
+* blocks are parsed one at a time under a named critical section, with a
+* flag check on either side so that already-materialised trees are not
+* serialised against each other.
+*
+* If parsing fails the tree is left empty and the model is marked invalid.
+*
+* \param treenum Index of the tree that is about to be used
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::ensureTreeLoaded(const int treenum) const
+{
+	// Fast path for models that were loaded eagerly or trained in memory
+	if(pending_tree_blocks.empty())
+		return;
+
+	// The acquire read pairs with the release write below, so a thread that
+	// sees the flag set also sees the parsed contents of the tree
+	int parsed;
+	#pragma omp atomic read acquire
+	parsed = tree_parsed[treenum];
+	if(parsed)
+		return;
 
+	#pragma omp critical(canopy_lazy_load)
+	{
+		if(!tree_parsed[treenum])
+		{
+			// Materialising a tree that was already read from disk does not
+			// change the logical state of the model, so the const interface
+			// is respected despite the cast
+			randomForestBase* const mutable_this = const_cast<randomForestBase*>(this);
+			std::istringstream tree_stream(pending_tree_blocks[treenum]);
+			if(!mutable_this->parseTreeBlock(tree_stream,treenum,lazy_n_nodes_in_file,lazy_last_split_node,lazy_last_leaf_node,lazy_max_depth_used))
+				mutable_this->valid = false;
+			pending_tree_blocks[treenum].clear();
+			pending_tree_blocks[treenum].shrink_to_fit();
+			#pragma omp atomic write release
+			tree_parsed[treenum] = 1;
+		}
+	}
 }
 
 
@@ -273,6 +1124,10 @@ bool randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::writeTo
 {
 	using namespace std;
 
+	// Any lazily-loaded trees must be materialised before they can be written
+	for(int t = 0; t < n_trees; ++t)
+		ensureTreeLoaded(t);
+
 	// Open the text file and check it opened ok
 	ofstream outfile(filename.c_str());
 	if (!outfile.is_open()) return false;
@@ -280,9 +1135,14 @@ bool randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::writeTo
 	// Output the feature definition lines
 	outfile << "# " << feature_header << endl << feature_string << endl << endl;
 
+	// Split-node distributions can only be written if the model actually has
+	// them, which it does not after being read back from a file (the readers
+	// retain only the leaf distributions)
+	const bool write_split_dists = fit_split_nodes && hasSplitNodeDists();
+
 	// Write the number of levels and trees
 	outfile << "# Trees Levels Split_Dists\n";
-	outfile << n_trees << " " << n_levels << " " << fit_split_nodes << '\n';
+	outfile << n_trees << " " << n_levels << " " << write_split_dists << '\n';
 
 	// Write the implementation-specific information
 	outfile << "# ";
@@ -291,81 +1151,665 @@ bool randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::writeTo
 	static_cast<const derivedProxy*>(this)->printHeaderData(outfile);
 	outfile << "\n\n";
 
-	// Loop through the trees
-	for(int t = 0; t < n_trees; ++t)
+	// Loop through the trees
+	for(int t = 0; t < n_trees; ++t)
+	{
+		const tree& thistree = forest[t];
+
+		// Find the compact index of the node stored at each complete-binary-tree
+		// position. Positions that are not reached are orphans and are not
+		// written, as before
+		std::vector<int> compact_of_complete(n_nodes,-1);
+		compact_of_complete[0] = 0;
+		for(int n = 0; n < n_nodes; ++n)
+		{
+			const int c = compact_of_complete[n];
+			if( (c < 0) || thistree.is_leaf[c] )
+				continue;
+			if(2*n + 2 < n_nodes)
+			{
+				compact_of_complete[2*n+1] = thistree.left_child[c];
+				compact_of_complete[2*n+2] = thistree.left_child[c] + 1;
+			}
+		}
+
+		// Loop through nodes in complete-binary-tree order
+		for(int n = 0; n < n_nodes; ++n)
+		{
+			const int c = compact_of_complete[n];
+			if(c < 0)
+				continue;
+
+			outfile << (thistree.is_leaf[c] ? 1 : 0) << " " ;
+
+			if(thistree.is_leaf[c])
+			{
+				outfile << thistree.dist_pool[thistree.dist_index[c]] << '\n';
+			}
+			else
+			{
+				for(unsigned p = 0 ; p < TNumParams; ++p)
+					outfile << thistree.params[c][p] << " ";
+				outfile << thistree.thresh[c];
+				if(write_split_dists)
+				{
+					outfile << " " ;
+					outfile << thistree.dist_pool[thistree.dist_index[c]] << '\n';
+				}
+				else
+					outfile << '\n';
+			}
+		} // node loop
+
+		outfile << '\n';
+	} // tree loop
+
+	outfile.close();
+
+	return true;
+
+}
+
+/*! \brief Read a pre-trained model in from a binary (.trb) file.
+*
+* Read in the parameters for a forest from a pre-trained model stored in the
+* binary format written by \c writeToBinaryFile() . After this function, the
+* object will be ready to use for testing with the pre-trained model.
+*
+* The binary format stores the nodes of each tree in a fixed-stride record
+* table, and this method parses that table directly from a read-only memory
+* mapping of the file (on POSIX platforms; other platforms fall back to a
+* buffered read). This makes loading a large model orders of magnitude faster
+* than parsing the text (.tr) format, and the file's pages are shared through
+* the page cache between processes loading the same model. Note that the node
+* distributions themselves are deserialised into ordinary objects via their
+* \c readBinary() method.
+*
+* \param filename The full name and path of the .trb file to read.
+* \param trees_used The number of trees to read in from the file. If this is
+* unspecified or set to a negative value, all the trees in the file will be
+* used. If the number specified is greater than the number trained in the file,
+* the function will fail and return false.
+* \param max_depth_used The maximum tree depth to read from the the file. If this
+* is unspecified or set to a negative value, all the levels in the file will
+* be used. If the number specified is greater than the number trained in the file,
+* the function will fail and return false. The model must have been trained with
+* the fit_split_nodes option set to true for this option to be successful.
+* \return True if the model was successfully read from the file, false otherwise.
+* If false, the model should not be used.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+bool randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::readFromBinaryFile(const std::string filename, const int trees_used, const int max_depth_used)
+{
+	// Map (or read) the whole file into memory
+	const char* file_data = nullptr;
+	std::uint64_t file_size = 0;
+#ifndef _WIN32
+	const int fd = ::open(filename.c_str(),O_RDONLY);
+	if(fd < 0) return false;
+	struct stat file_stat;
+	if( (::fstat(fd,&file_stat) != 0) || (file_stat.st_size <= 0) )
+	{
+		::close(fd);
+		return false;
+	}
+	file_size = file_stat.st_size;
+	void* const mapping = ::mmap(nullptr,file_size,PROT_READ,MAP_SHARED,fd,0);
+	::close(fd);
+	if(mapping == MAP_FAILED) return false;
+	file_data = static_cast<const char*>(mapping);
+#else
+	std::ifstream infile(filename.c_str(),std::ios::binary|std::ios::ate);
+	if(!infile.is_open()) return false;
+	file_size = infile.tellg();
+	std::vector<char> file_buffer(file_size);
+	infile.seekg(0);
+	infile.read(file_buffer.data(),file_size);
+	if(infile.fail()) return false;
+	file_data = file_buffer.data();
+#endif
+
+	// The actual parsing is wrapped in a lambda so that the mapping is
+	// cleaned up on every return path
+	const bool success = [&] () -> bool
+	{
+		const char* p = file_data;
+		const char* const p_end = file_data + file_size;
+
+		// Helpers to read fixed-size values and length-prefixed strings with
+		// bounds checking
+		const auto read_pod = [&p,p_end] (auto& val) -> bool
+		{
+			if(p_end - p < static_cast<std::ptrdiff_t>(sizeof(val)))
+				return false;
+			std::memcpy(&val,p,sizeof(val));
+			p += sizeof(val);
+			return true;
+		};
+		const auto read_string = [&] (std::string& str) -> bool
+		{
+			std::uint64_t len;
+			if(!read_pod(len)) return false;
+			if(static_cast<std::uint64_t>(p_end - p) < len) return false;
+			str.assign(p,len);
+			p += len;
+			return true;
+		};
+
+		// Check the magic number and format version
+		const char magic[8] = {'c','a','n','o','p','y','r','b'};
+		if(p_end - p < static_cast<std::ptrdiff_t>(sizeof(magic)))
+			return false;
+		if(std::memcmp(p,magic,sizeof(magic)) != 0)
+			return false;
+		p += sizeof(magic);
+		std::uint32_t version;
+		if(!read_pod(version)) return false;
+		if(version != C_BINARY_FORMAT_VERSION) return false;
+
+		// Read in the forest-level parameters
+		std::uint32_t n_trees_file, n_levels_file, dist_size;
+		std::uint8_t fit_split_nodes_file;
+		if(!read_pod(n_trees_file)) return false;
+		if(!read_pod(n_levels_file)) return false;
+		if(!read_pod(fit_split_nodes_file)) return false;
+		if(!read_pod(dist_size)) return false;
+
+		n_trees = n_trees_file;
+		if(trees_used > n_trees)
+			return false;
+		else if(trees_used > 0)
+			n_trees = trees_used;
+
+		n_levels = n_levels_file;
+		if(max_depth_used > n_levels) return false;
+
+		fit_split_nodes = (fit_split_nodes_file != 0);
+
+		int last_split_node = -1, last_leaf_node = -1;
+		const int n_nodes_in_file = std::pow(2,n_levels+1) - 1;
+		if(max_depth_used > -1)
+		{
+			if(!fit_split_nodes)
+				return false;
+			last_split_node = std::pow(2,max_depth_used) - 2;
+			last_leaf_node = std::pow(2,max_depth_used+1) - 2;
+			n_levels = max_depth_used;
+		}
+
+		// Read in the feature definition strings and the implementation-specific
+		// header
+		if(!read_string(feature_header)) return false;
+		if(!read_string(feature_string)) return false;
+		std::string derived_header;
+		if(!read_string(derived_header)) return false;
+		std::istringstream header_stream(derived_header);
+		static_cast<derivedProxy*>(this)->readHeader(header_stream);
+		if(header_stream.fail()) return false;
+
+		// Read the table of per-tree file offsets
+		std::vector<std::uint64_t> tree_offsets(n_trees_file);
+		for(std::uint32_t t = 0; t < n_trees_file; ++t)
+			if(!read_pod(tree_offsets[t])) return false;
+
+		// Prepare the forest. Each tree is allocated in complete-binary-tree
+		// layout just before it is parsed, and compacted immediately
+		// afterwards, so that only one tree at a time pays the complete
+		// layout's memory cost
+		forest.clear();
+		forest.resize(n_trees);
+		n_nodes = std::pow(2,n_levels+1) - 1;
+		pending_tree_blocks.clear();
+		tree_parsed.clear();
+
+		// Stride of one node record in the file
+		const std::uint64_t record_size = sizeof(std::int32_t) + 2*sizeof(std::uint8_t) + TNumParams*sizeof(std::int32_t) + sizeof(float) + dist_size;
+
+		// Loop through the trees
+		for(int t = 0; t < n_trees; ++t)
+		{
+			allocateTreeMemory(forest[t]);
+
+			// Subtract rather than add so that a corrupt offset near the top
+			// of the 64-bit range cannot wrap the comparison
+			if(tree_offsets[t] > file_size - sizeof(std::uint32_t)) return false;
+			p = file_data + tree_offsets[t];
+			std::uint32_t n_stored_nodes;
+			if(!read_pod(n_stored_nodes)) return false;
+			if(static_cast<std::uint64_t>(p_end - p) < record_size*n_stored_nodes) return false;
+
+			// Loop through the node records
+			for(std::uint32_t r = 0; r < n_stored_nodes; ++r)
+			{
+				std::int32_t n;
+				std::uint8_t is_leaf, has_dist;
+				if(!read_pod(n)) return false;
+				if(!read_pod(is_leaf)) return false;
+				if(!read_pod(has_dist)) return false;
+				if( (n < 0) || (n >= n_nodes_in_file) ) return false;
+
+				// Nodes beyond the maximum depth to read are skipped entirely
+				if((max_depth_used > -1) && (n > last_leaf_node))
+				{
+					p += TNumParams*sizeof(std::int32_t) + sizeof(float) + dist_size;
+					continue;
+				}
+
+				for(unsigned q = 0; q < TNumParams; ++q)
+				{
+					std::int32_t param;
+					if(!read_pod(param)) return false;
+					forest[t].params[n][q] = param;
+				}
+				if(!read_pod(forest[t].thresh[n])) return false;
+
+				// This node is a leaf if it is marked as one, or if it lies at
+				// the maximum level to read in the trees
+				if(is_leaf || ( (max_depth_used > -1) && (n > last_split_node) ) )
+				{
+					if(!has_dist) return false;
+					forest[t].is_leaf[n] = 1;
+					TNodeDist& dist = createNodeDist(t,n);
+					static_cast<derivedProxy*>(this)->initialiseNodeDist(t,n);
+					dist.readBinary(p);
+				}
+				else
+				{
+					forest[t].is_leaf[n] = 0;
+				}
+				p += dist_size;
+			}
+
+			compactTree(forest[t]);
+		}
+
+		return true;
+	}();
+
+#ifndef _WIN32
+	::munmap(mapping,file_size);
+#endif
+
+	if(!success) return false;
+	valid = true;
+	return true;
+}
+
+/*! \brief Write a trained model to a binary (.trb) file to be stored and re-used.
+*
+* This is the binary counterpart of \c writeToFile() . The resulting file
+* contains the same information as the text (.tr) format, but stores the nodes
+* of each tree as a table of fixed-stride binary records that can be parsed
+* directly from a memory mapping by \c readFromBinaryFile() , making loading
+* very much faster for large models. As with the text format, orphan nodes are
+* not stored.
+*
+* Ensure that \c setFeatureDefinitionString() is called before this function,
+* otherwise a blank feature definition string will be stored.
+*
+* \param filename The full name and path of the file into which the model should
+* be written.
+* \return True if the model was successfully written to the specified file, false
+* otherwise.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+bool randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::writeToBinaryFile(const std::string filename) const
+{
+	// Any lazily-loaded trees must be materialised before they can be written
+	for(int t = 0; t < n_trees; ++t)
+		ensureTreeLoaded(t);
+
+	// Open the binary file and check it opened ok
+	std::ofstream outfile(filename.c_str(),std::ios::binary|std::ios::trunc);
+	if (!outfile.is_open()) return false;
+
+	// Helpers to write fixed-size values and length-prefixed strings
+	const auto write_pod = [&outfile] (const auto& val)
+	{
+		outfile.write(reinterpret_cast<const char*>(&val),sizeof(val));
+	};
+	const auto write_string = [&outfile] (const std::string& str)
+	{
+		const std::uint64_t len = str.size();
+		outfile.write(reinterpret_cast<const char*>(&len),sizeof(len));
+		outfile.write(str.data(),len);
+	};
+
+	// Find the size of the serialised node distributions from the first node
+	// that has one fitted (all distributions within one model serialise to the
+	// same length)
+	std::uint32_t dist_size = 0;
+	bool found_dist = false;
+	for(int t = 0; t < n_trees && !found_dist; ++t)
+		if(!forest[t].dist_pool.empty())
+		{
+			dist_size = forest[t].dist_pool[0].binaryLength();
+			found_dist = true;
+		}
+	if(!found_dist) return false;
+
+	// Magic number and version identify the file type
+	const char magic[8] = {'c','a','n','o','p','y','r','b'};
+	outfile.write(magic,sizeof(magic));
+	write_pod(static_cast<std::uint32_t>(C_BINARY_FORMAT_VERSION));
+
+	// Forest-level parameters. As in the text format, the split-distributions
+	// flag is only set if the model actually has them (see writeToFile() )
+	write_pod(static_cast<std::uint32_t>(n_trees));
+	write_pod(static_cast<std::uint32_t>(n_levels));
+	write_pod(static_cast<std::uint8_t>((fit_split_nodes && hasSplitNodeDists()) ? 1 : 0));
+	write_pod(dist_size);
+
+	// Feature definition strings and the implementation-specific header
+	write_string(feature_header);
+	write_string(feature_string);
+	std::ostringstream header_stream;
+	static_cast<const derivedProxy*>(this)->printHeaderData(header_stream);
+	write_string(header_stream.str());
+
+	// Reserve space for the table of per-tree file offsets, which is filled
+	// in at the end once the offsets are known
+	const std::streampos offset_table_pos = outfile.tellp();
+	std::vector<std::uint64_t> tree_offsets(n_trees,0);
+	outfile.write(reinterpret_cast<const char*>(tree_offsets.data()),n_trees*sizeof(std::uint64_t));
+
+	// Loop through the trees
+	std::vector<char> dist_buffer(dist_size);
+	for(int t = 0; t < n_trees; ++t)
+	{
+		tree_offsets[t] = outfile.tellp();
+		const tree& thistree = forest[t];
+		const int n_stored_nodes = thistree.numNodes();
+
+		// Find the complete-binary-tree position of each stored node. Since
+		// a parent always precedes its children in the compact storage order,
+		// a single forward pass suffices
+		std::vector<std::int32_t> complete_of_compact(n_stored_nodes);
+		complete_of_compact[0] = 0;
+		for(int c = 0; c < n_stored_nodes; ++c)
+		{
+			if(!thistree.is_leaf[c])
+			{
+				complete_of_compact[thistree.left_child[c]] = 2*complete_of_compact[c] + 1;
+				complete_of_compact[thistree.left_child[c]+1] = 2*complete_of_compact[c] + 2;
+			}
+		}
+
+		write_pod(static_cast<std::uint32_t>(n_stored_nodes));
+
+		// Write a fixed-stride record for each stored node
+		for(int c = 0; c < n_stored_nodes; ++c)
+		{
+			write_pod(complete_of_compact[c]);
+			write_pod(static_cast<std::uint8_t>(thistree.is_leaf[c] ? 1 : 0));
+			write_pod(static_cast<std::uint8_t>(thistree.dist_index[c] >= 0 ? 1 : 0));
+			for(unsigned p = 0; p < TNumParams; ++p)
+				write_pod(static_cast<std::int32_t>(thistree.params[c][p]));
+			write_pod(thistree.thresh[c]);
+
+			// The distribution field is zero-filled when there is no fitted
+			// distribution in order to keep the record stride fixed
+			std::fill(dist_buffer.begin(),dist_buffer.end(),0);
+			if(thistree.dist_index[c] >= 0)
+				thistree.dist_pool[thistree.dist_index[c]].writeBinary(dist_buffer.data());
+			outfile.write(dist_buffer.data(),dist_size);
+		}
+	}
+
+	// Go back and fill in the offset table
+	outfile.seekp(offset_table_pos);
+	outfile.write(reinterpret_cast<const char*>(tree_offsets.data()),n_trees*sizeof(std::uint64_t));
+
+	outfile.close();
+	return !outfile.fail();
+}
+
+/*! \brief Predict the output distribution for a number of IDs
+*
+* This function uses the forest model to predict the full output distribution for
+* each of a number of data points, where each data point is identified by an ID
+* variable.
+*
+* These ID variables are passed in as a pair of iterators pointing to the first
+* and last IDs to be processed. The output distribution for each of these IDs
+* is placed in a second container accessed by iterators.
+*
+* In this version of the function, the features needed by a single node are
+* requested from the feature functor for all the IDs with a single function call.
+* This involves some overhead, but may permit efficiencies resulting from
+* calculating multiple features at once.
+*
+* Uses OpenMP to query the multiple tree models in parallel, and then to
+* combine the resulting leaf distributions in parallel over the data points.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TOutputIterator Type of the iterator to the output distributions. Must be
+* a random access iterator that dereferences to TOutputDist.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref groupwise "groupwise feature functor" object, meaning
+* it must define operator() with a certain form.
+* \param first_id Iterator to the first ID whose output is to be predicted.
+* \param last_id Iterator to the last ID whose output is to be predicted.
+* \param out_it Iterator to the output distribution corresponding to the first ID.
+* The container of output distributions must already exist, and contain enough
+* elements for all of the IDs between first_id and last_id. At the end of this
+* function, the output distributions in this container relate to the
+* corresponding elements of the id container.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TOutputIterator, class TFeatureFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predictDistGroupwise(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor) const
+{
+	// Create a function-local workspace and delegate
+	predictionWorkspace workspace;
+	predictDistGroupwise(first_id,last_id,out_it,std::forward<TFeatureFunctor>(feature_functor),workspace);
+}
+
+/*! \brief Predict the output distribution for a number of IDs, using a
+* caller-provided workspace.
+*
+* This overload behaves identically to the version without a workspace
+* parameter, but stores all its temporary working data in the provided
+* \c predictionWorkspace . When the same workspace object is passed into
+* repeated calls, the buffers within it are reused, making steady-state
+* prediction free of heap allocation. This is useful when predictions are made
+* at a high rate, such as once per video frame.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TOutputIterator Type of the iterator to the output distributions. Must be
+* a random access iterator that dereferences to TOutputDist.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref groupwise "groupwise feature functor" object, meaning
+* it must define operator() with a certain form.
+* \param first_id Iterator to the first ID whose output is to be predicted.
+* \param last_id Iterator to the last ID whose output is to be predicted.
+* \param out_it Iterator to the output distribution corresponding to the first ID.
+* The container of output distributions must already exist, and contain enough
+* elements for all of the IDs between first_id and last_id. At the end of this
+* function, the output distributions in this container relate to the
+* corresponding elements of the id container.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+* \param workspace Workspace object providing the temporary storage for the
+* prediction. Must not be in use by any other thread.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TOutputIterator, class TFeatureFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predictDistGroupwise(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor, predictionWorkspace& workspace) const
+{
+	// Prepare the workspace arrays that hold the leaf nodes and per-tree
+	// traversal buffers, retaining any existing capacity
+	const int num_id = std::distance(first_id,last_id);
+	workspace.leaves.resize(n_trees);
+	workspace.nodebag_rel.resize(n_trees);
+	workspace.scores.resize(n_trees);
+	for(int t = 0; t < n_trees; ++t)
+		workspace.leaves[t].resize(num_id);
+
+	// Loop through all the trees in the forest and find the leaf distributions
+	// that each id reaches
+	#pragma omp parallel for
+	for(int t = 0; t < n_trees; ++t)
+		findLeavesGroupwise(first_id,last_id,t,workspace.leaves[t],workspace.nodebag_rel[t],workspace.scores[t],std::forward<TFeatureFunctor>(feature_functor));
+
+	// For each datapoint, go through the trees and combine the leaf
+	// distributions, processing the datapoints in parallel threads
+	#pragma omp parallel for
+	for(int d = 0; d < num_id; ++d)
+	{
+		// Reset any previous calculations
+		out_it[d].reset();
+
+		// Combine results
+		for(int t = 0; t < n_trees; ++t)
+			out_it[d].combineWith(*workspace.leaves[t][d],first_id[d]);
+
+		// Normalise
+		out_it[d].normalise();
+	}
+}
+
+/*! \brief Predict the output distribution for a number of IDs, processing the
+* IDs in cache-sized chunks with a software pipeline.
+*
+* This function produces exactly the same results as predictDistGroupwise(),
+* but splits the ID range into chunks of \c chunk_size data points and runs a
+* two-stage pipeline over them: while some threads combine the leaf
+* distributions of one chunk into the output distributions, the remaining
+* threads traverse the trees (and therefore call the feature functor) for the
+* next chunk. Leaf pointer storage is double-buffered between the two chunks
+* in flight, so the working set is proportional to the chunk size rather than
+* to the full ID range. This is the preferred method for very large ID ranges
+* (e.g. every pixel of a large image), where the monolithic traversal of
+* predictDistGroupwise() would overflow the last-level cache.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TOutputIterator Type of the iterator to the output distributions. Must be
+* a random access iterator that dereferences to TOutputDist.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref groupwise "groupwise feature functor" object, meaning
+* it must define operator() with a certain form.
+* \param first_id Iterator to the first ID whose output is to be predicted.
+* \param last_id Iterator to the last ID whose output is to be predicted.
+* \param out_it Iterator to the output distribution corresponding to the first ID.
+* The container of output distributions must already exist, and contain enough
+* elements for all of the IDs between first_id and last_id.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+* \param chunk_size The number of data points processed per pipeline stage.
+* Choose so that the leaf pointers and traversal buffers of two chunks fit
+* comfortably within the last-level cache.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TOutputIterator, class TFeatureFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predictDistChunked(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor, const int chunk_size) const
+{
+	const int num_id = std::distance(first_id,last_id);
+	const int n_chunks = (num_id + chunk_size - 1)/chunk_size;
+
+	// A single chunk degenerates to the monolithic version
+	if(n_chunks <= 1)
+	{
+		predictDistGroupwise(first_id,last_id,out_it,std::forward<TFeatureFunctor>(feature_functor));
+		return;
+	}
+
+	// Double-buffered leaf pointer and traversal storage, so that the
+	// traversal of one chunk may overlap with the combination of the previous
+	predictionWorkspace workspace[2];
+	for(int b = 0; b < 2; ++b)
 	{
-		std::vector<bool> orphan_flag(n_nodes,false);
+		workspace[b].leaves.resize(n_trees);
+		workspace[b].nodebag_rel.resize(n_trees);
+		workspace[b].scores.resize(n_trees);
+		for(int t = 0; t < n_trees; ++t)
+			workspace[b].leaves[t].resize(chunk_size);
+	}
 
-		// Loop through nodes in this level
-		for(int n = 0; n < n_nodes; ++n)
+	#pragma omp parallel
+	{
+		// Prologue: traverse the trees for the first chunk
+		#pragma omp for
+		for(int t = 0; t < n_trees; ++t)
+			findLeavesGroupwise(first_id,first_id + std::min(chunk_size,num_id),t,workspace[0].leaves[t],workspace[0].nodebag_rel[t],workspace[0].scores[t],std::forward<TFeatureFunctor>(feature_functor));
+
+		for(int c = 0; c < n_chunks; ++c)
 		{
-			// Skip if this is an orphan, and set children to orphans
-			if(orphan_flag[n])
+			const predictionWorkspace& chunk_ws = workspace[c%2];
+			const int chunk_begin = c*chunk_size;
+			const int chunk_end = std::min(chunk_begin + chunk_size, num_id);
+
+			// Combine the leaf distributions of this chunk. The nowait
+			// allows threads that finish their share to move straight on to
+			// traversing the next chunk, overlapping the two stages
+			#pragma omp for nowait
+			for(int d = chunk_begin; d < chunk_end; ++d)
 			{
-				if(2*n + 2 < n_nodes)
-				{
-					orphan_flag[2*n+1] = true;
-					orphan_flag[2*n+2] = true;
-				}
-				continue;
-			}
+				// Reset any previous calculations
+				out_it[d].reset();
+
+				// Combine results
+				for(int t = 0; t < n_trees; ++t)
+					out_it[d].combineWith(*chunk_ws.leaves[t][d-chunk_begin],first_id[d]);
 
-			outfile << forest[t].nodes[n].is_leaf << " " ;
+				// Normalise
+				out_it[d].normalise();
+			}
 
-			if(forest[t].nodes[n].is_leaf)
+			if(c + 1 < n_chunks)
 			{
-				outfile << forest[t].nodes[n].post[0] << '\n';
-				if(2*n + 2 < n_nodes)
-				{
-					orphan_flag[2*n+1] = true;
-					orphan_flag[2*n+2] = true;
-				}
+				// Traverse the trees for the next chunk into the other
+				// buffer. The implicit barrier at the end of this loop
+				// ensures that the combination of this chunk has completed
+				// before its buffer is overwritten two chunks later
+				predictionWorkspace& next_ws = workspace[(c+1)%2];
+				const int next_begin = chunk_begin + chunk_size;
+				const int next_end = std::min(next_begin + chunk_size, num_id);
+				#pragma omp for
+				for(int t = 0; t < n_trees; ++t)
+					findLeavesGroupwise(first_id + next_begin,first_id + next_end,t,next_ws.leaves[t],next_ws.nodebag_rel[t],next_ws.scores[t],std::forward<TFeatureFunctor>(feature_functor));
 			}
 			else
 			{
-				for(unsigned p = 0 ; p < TNumParams; ++p)
-					outfile << forest[t].nodes[n].params[p] << " ";
-				outfile << forest[t].nodes[n].thresh;
-				if(fit_split_nodes)
-				{
-					outfile << " " ;
-					outfile << forest[t].nodes[n].post[0] << '\n';
-				}
-				else
-					outfile << '\n';
+				// Wait for the final chunk's combination to complete
+				#pragma omp barrier
 			}
-		} // node loop
-
-		outfile << '\n';
-	} // tree loop
-
-	outfile.close();
-
-	return true;
-
+		}
+	}
 }
 
-/*! \brief Predict the output distribution for a number of IDs
-*
-* This function uses the forest model to predict the full output distribution for
-* each of a number of data points, where each data point is identified by an ID
-* variable.
-*
-* These ID variables are passed in as a pair of iterators pointing to the first
-* and last IDs to be processed. The output distribution for each of these IDs
-* is placed in a second container accessed by iterators.
+/*! \brief Predict the output distribution for a number of IDs asynchronously
+* on a predictionExecutor.
 *
-* In this version of the function, the features needed by a single node are
-* requested from the feature functor for all the IDs with a single function call.
-* This involves some overhead, but may permit efficiencies resulting from
-* calculating multiple features at once.
+* This function produces exactly the same results as predictDistGroupwise(),
+* but instead of blocking the calling thread and using the OpenMP team, it
+* splits the ID range into chunks, submits each chunk as an independent job
+* to the given executor, and returns a future immediately. Each job
+* traverses all the trees for its chunk serially; parallelism comes from the
+* executor's workers running different chunks, and from the chunks of
+* different prediction calls interleaving on a shared executor, so a large
+* batch does not block small latency-sensitive calls submitted after it.
 *
-* Uses OpenMP to query the multiple tree models in parallel.
+* The future becomes ready when the last chunk has been written to the
+* output range. Until then the ID range, the output range and anything
+* referred to by the feature functor must remain valid, and the output
+* distributions must not be read. The feature functor itself is copied and
+* kept alive by the jobs. Any lazily-loaded trees are materialised on the
+* calling thread before the jobs are submitted, as the executor's workers
+* fall outside the OpenMP synchronisation that guards materialisation.
 *
 * \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
 * iterator and dereference to the TId type expected by the feature functor.
 * \tparam TOutputIterator Type of the iterator to the output distributions. Must be
-* a forward output iterator that dereferences to TOutputDist.
+* a random access iterator that dereferences to TOutputDist.
 * \tparam TFeatureFunctor The type of the feature functor object. Must meet the
 * specifications for a \ref groupwise "groupwise feature functor" object, meaning
 * it must define operator() with a certain form.
@@ -373,44 +1817,173 @@ bool randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::writeTo
 * \param last_id Iterator to the last ID whose output is to be predicted.
 * \param out_it Iterator to the output distribution corresponding to the first ID.
 * The container of output distributions must already exist, and contain enough
-* elements for all of the IDs between first_id and last_id. At the end of this
-* function, the output distributions in this container relate to the
-* corresponding elements of the id container.
+* elements for all of the IDs between first_id and last_id.
 * \param feature_functor The feature functor object to be used as a callback to
 * calculate the features. Must be safe to call from multiple threads
 * simultaneously.
+* \param executor The executor on which the prediction jobs run. Must outlive
+* the returned future becoming ready.
+* \param chunk_size The number of data points per submitted job. Smaller
+* chunks interleave more finely with other jobs at the cost of more
+* per-job overhead.
+* \return A future that becomes ready once all the output distributions have
+* been written.
 */
 template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
 template <class TIdIterator, class TOutputIterator, class TFeatureFunctor>
-void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predictDistGroupwise(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor) const
+std::future<void> randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predictDistGroupwiseAsync(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor, predictionExecutor& executor, const int chunk_size) const
 {
-	// Arrays to use to hold leaf nodes
 	const int num_id = std::distance(first_id,last_id);
-	std::vector<std::vector<const TNodeDist*>> leaves(n_trees,std::vector<const TNodeDist*>(num_id));
+	const int n_chunks = std::max((num_id + chunk_size - 1)/chunk_size, 1);
+
+	// The executor's workers are plain threads outside this thread's OpenMP
+	// contention group, where the mutual exclusion inside ensureTreeLoaded()
+	// is not guaranteed by the OpenMP specification, so materialise any
+	// lazily-loaded trees here before the jobs are queued
+	for(int t = 0; t < n_trees; ++t)
+		ensureTreeLoaded(t);
+
+	// State shared between the chunk jobs: a copy of the feature functor,
+	// and the promise that the last job to finish fulfils
+	struct sharedJobState
+	{
+		typename std::decay<TFeatureFunctor>::type feature_functor;
+		std::promise<void> promise;
+		std::atomic<int> chunks_remaining;
+
+		sharedJobState(TFeatureFunctor&& functor, const int n_chunks)
+			: feature_functor(std::forward<TFeatureFunctor>(functor)), chunks_remaining(n_chunks)
+		{
+		}
+	};
+	auto state = std::make_shared<sharedJobState>(std::forward<TFeatureFunctor>(feature_functor),n_chunks);
+	std::future<void> future = state->promise.get_future();
+
+	for(int c = 0; c < n_chunks; ++c)
+	{
+		const TIdIterator chunk_first = first_id + c*chunk_size;
+		const TIdIterator chunk_last = first_id + std::min((c+1)*chunk_size,num_id);
+		const TOutputIterator chunk_out = out_it + c*chunk_size;
+
+		executor.submit( [this,state,chunk_first,chunk_last,chunk_out] ()
+		{
+			const int chunk_len = std::distance(chunk_first,chunk_last);
+
+			// Traverse all the trees for this chunk on this thread alone --
+			// the parallelism comes from the chunks being independent jobs
+			predictionWorkspace workspace;
+			workspace.leaves.resize(n_trees);
+			workspace.nodebag_rel.resize(n_trees);
+			workspace.scores.resize(n_trees);
+			for(int t = 0; t < n_trees; ++t)
+			{
+				workspace.leaves[t].resize(chunk_len);
+				findLeavesGroupwise(chunk_first,chunk_last,t,workspace.leaves[t],workspace.nodebag_rel[t],workspace.scores[t],state->feature_functor);
+			}
+
+			for(int d = 0; d < chunk_len; ++d)
+			{
+				// Reset any previous calculations
+				chunk_out[d].reset();
+
+				// Combine results
+				for(int t = 0; t < n_trees; ++t)
+					chunk_out[d].combineWith(*workspace.leaves[t][d],chunk_first[d]);
+
+				// Normalise
+				chunk_out[d].normalise();
+			}
+
+			// The job that completes the final chunk fulfils the promise
+			if(state->chunks_remaining.fetch_sub(1) == 1)
+				state->promise.set_value();
+		});
+	}
+
+	return future;
+}
+
+/*! \brief Predict the output distribution for every row of a dense feature
+* matrix.
+*
+* This is a specialised alternative to predictDistGroupwise() for the common
+* case where the features already exist as a contiguous row-major matrix of
+* floats, with one row per data point and one column per feature. The first
+* split parameter of each node ( \c params[0] ) is taken to index a column of
+* the matrix directly, so the traversal reads each feature straight from the
+* row with no feature functor call and no gather through an ID indirection.
+* For purely tabular features this removes the functor machinery entirely,
+* which can account for a large fraction of the prediction time.
+*
+* The model must have been trained with a feature functor implementing the
+* same convention, i.e. one that returns element \c params[0] of the data
+* point's feature vector (any further parameters must not affect the
+* returned score). The row index plays the role of the ID, and is the value
+* passed to the output distributions' \c combineWith() method.
+*
+* \tparam TOutputIterator Type of the iterator to the output distributions. Must be
+* a random access iterator that dereferences to TOutputDist.
+* \param features Pointer to the first element of the feature matrix. The
+* feature of column p for row r is read from \c features[r*stride+p] .
+* \param num_rows The number of rows (data points) in the matrix.
+* \param stride The number of elements between the starts of consecutive
+* rows. For a fully packed matrix this is the number of columns.
+* \param out_it Iterator to the output distribution corresponding to the
+* first row. The container of output distributions must already exist, and
+* contain at least num_rows elements.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TOutputIterator>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predictDistMatrix(const float* const features, const int num_rows, const int stride, TOutputIterator out_it) const
+{
+	// Create a function-local workspace and delegate
+	predictionWorkspace workspace;
+	predictDistMatrix(features,num_rows,stride,out_it,workspace);
+}
+
+/*! \brief Predict the output distribution for every row of a dense feature
+* matrix, using a caller-provided workspace.
+*
+* This overload behaves identically to the version without a workspace
+* parameter, but stores all its temporary working data in the provided
+* \c predictionWorkspace , making steady-state prediction free of heap
+* allocation when the same workspace is passed into repeated calls.
+*
+* See predictDistMatrix() for a description of the other parameters.
+*
+* \param workspace Workspace object providing the temporary storage for the
+* prediction. Must not be in use by any other thread.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TOutputIterator>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predictDistMatrix(const float* const features, const int num_rows, const int stride, TOutputIterator out_it, predictionWorkspace& workspace) const
+{
+	// Prepare the workspace arrays that hold the leaf nodes, retaining any
+	// existing capacity
+	workspace.leaves.resize(n_trees);
+	for(int t = 0; t < n_trees; ++t)
+		workspace.leaves[t].resize(num_rows);
 
 	// Loop through all the trees in the forest and find the leaf distributions
-	// that each id reaches
+	// that each row reaches
 	#pragma omp parallel for
 	for(int t = 0; t < n_trees; ++t)
-		findLeavesGroupwise(first_id,last_id,t,leaves[t], std::forward<TFeatureFunctor>(feature_functor));
+		findLeavesMatrix(features,num_rows,stride,t,workspace.leaves[t]);
 
-	// For each datapoint, go through the trees and combine the leaf distributions
-	// Ideally would try to parallelise this...
-	int d = 0;
-	while(first_id != last_id)
+	// For each row, go through the trees and combine the leaf
+	// distributions, processing the rows in parallel threads
+	#pragma omp parallel for
+	for(int d = 0; d < num_rows; ++d)
 	{
 		// Reset any previous calculations
-		out_it->reset();
+		out_it[d].reset();
 
 		// Combine results
 		for(int t = 0; t < n_trees; ++t)
-			out_it->combineWith(*leaves[t][d],*first_id);
+			out_it[d].combineWith(*workspace.leaves[t][d],d);
 
 		// Normalise
-		out_it->normalise();
-		++out_it;
-		++first_id;
-		++d;
+		out_it[d].normalise();
 	}
 }
 
@@ -481,6 +2054,283 @@ void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predict
 
 }
 
+/*! \brief Predict the output distribution for a number of IDs, stopping early
+* for IDs whose running distribution is already confident.
+*
+* This function behaves like predictDistGroupwise(), but evaluates the trees
+* in stages of \c stage_size trees. After each stage, a normalised snapshot of
+* the running output distribution of each remaining ID is passed to a
+* caller-supplied confidence predicate, and IDs for which the predicate
+* returns true take no part in the remaining stages. This can cut the typical
+* prediction cost several-fold when most data points are easy to classify,
+* while leaving the worst-case behaviour (and the result for any ID that never
+* satisfies the predicate) identical to predictDistGroupwise().
+*
+* Uses OpenMP to query the trees within each stage in parallel, and then to
+* combine the resulting leaf distributions in parallel over the data points.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TOutputIterator Type of the iterator to the output distributions. Must be
+* a random access iterator that dereferences to TOutputDist.
+* \tparam TTreesUsedIterator Type of the iterator used to output the number of
+* trees evaluated for each ID. Must be a random access iterator that
+* dereferences to an integral type.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref groupwise "groupwise feature functor" object, meaning
+* it must define operator() with a certain form.
+* \tparam TConfidencePredicate The type of the confidence predicate. Must
+* define operator() taking a <tt>const TOutputDist&</tt> (a normalised
+* snapshot of the running distribution) and returning a bool, with true
+* meaning that no further trees are needed. Must be safe to call from multiple
+* threads simultaneously.
+* \param first_id Iterator to the first ID whose output is to be predicted.
+* \param last_id Iterator to the last ID whose output is to be predicted.
+* \param out_it Iterator to the output distribution corresponding to the first ID.
+* The container of output distributions must already exist, and contain enough
+* elements for all of the IDs between first_id and last_id.
+* \param trees_used_it Iterator to the output container into which the number
+* of trees evaluated for each ID is written. The container must already exist,
+* and contain enough elements for all of the IDs between first_id and last_id.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+* \param confidence_predicate The confidence predicate object, called on the
+* running distributions between stages.
+* \param stage_size The number of trees evaluated between confidence checks.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TOutputIterator, class TTreesUsedIterator, class TFeatureFunctor, class TConfidencePredicate>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predictDistGroupwiseEarlyExit(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TTreesUsedIterator trees_used_it, TFeatureFunctor&& feature_functor, TConfidencePredicate&& confidence_predicate, const int stage_size) const
+{
+	const int num_id = std::distance(first_id,last_id);
+
+	// Indices (relative to first_id) of the data points that have not yet
+	// satisfied the confidence predicate
+	std::vector<int> active(num_id);
+	std::iota(active.begin(),active.end(),0);
+
+	// Reset any previous calculations
+	#pragma omp parallel for
+	for(int d = 0; d < num_id; ++d)
+		out_it[d].reset();
+
+	std::vector<std::vector<const TNodeDist*>> stage_leaves;
+	std::vector<unsigned char> satisfied;
+
+	for(int stage_first = 0; stage_first < n_trees && !active.empty(); stage_first += stage_size)
+	{
+		const int stage_last = std::min(stage_first + stage_size, n_trees);
+		const int n_stage_trees = stage_last - stage_first;
+
+		// Find the leaf distributions that each active id reaches in each
+		// of this stage's trees
+		stage_leaves.resize(n_stage_trees);
+		#pragma omp parallel for
+		for(int s = 0; s < n_stage_trees; ++s)
+		{
+			stage_leaves[s].resize(active.size());
+			findLeavesGroupwise(boost::make_permutation_iterator(first_id,active.cbegin()),
+								boost::make_permutation_iterator(first_id,active.cend()),
+								stage_first + s,stage_leaves[s],std::forward<TFeatureFunctor>(feature_functor));
+		}
+
+		// Accumulate this stage's leaves and test each active id against the
+		// confidence predicate using a normalised snapshot of its running
+		// distribution
+		satisfied.assign(active.size(),0);
+		#pragma omp parallel for
+		for(unsigned i = 0; i < active.size(); ++i)
+		{
+			const int d = active[i];
+			for(int s = 0; s < n_stage_trees; ++s)
+				out_it[d].combineWith(*stage_leaves[s][i],first_id[d]);
+
+			if(stage_last < n_trees)
+			{
+				TOutputDist snapshot = out_it[d];
+				snapshot.normalise();
+				if(std::forward<TConfidencePredicate>(confidence_predicate)(static_cast<const TOutputDist&>(snapshot)))
+					satisfied[i] = 1;
+			}
+			else
+				satisfied[i] = 1;
+		}
+
+		// Finalise the satisfied ids and remove them from the active list
+		unsigned num_remaining = 0;
+		for(unsigned i = 0; i < active.size(); ++i)
+		{
+			if(satisfied[i])
+			{
+				out_it[active[i]].normalise();
+				trees_used_it[active[i]] = stage_last;
+			}
+			else
+				active[num_remaining++] = active[i];
+		}
+		active.resize(num_remaining);
+	}
+}
+
+/*! \brief Predict the output distribution for a number of IDs, stopping early
+* for IDs whose running distribution is already confident.
+*
+* This function behaves like predictDistSingle(), but for each ID it evaluates
+* the trees in stages of \c stage_size trees. After each stage, a normalised
+* snapshot of the running output distribution is passed to a caller-supplied
+* confidence predicate, and if the predicate returns true no further trees are
+* evaluated for that ID. This can cut the typical prediction cost several-fold
+* when most data points are easy to classify, while leaving the worst-case
+* behaviour (and the result for any ID that never satisfies the predicate)
+* identical to predictDistSingle().
+*
+* Uses OpenMP to process the data points in parallel.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TOutputIterator Type of the iterator to the output distributions. Must be
+* a random access iterator that dereferences to TOutputDist.
+* \tparam TTreesUsedIterator Type of the iterator used to output the number of
+* trees evaluated for each ID. Must be a random access iterator that
+* dereferences to an integral type.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref single "single feature functor" object, meaning it
+* must define operator() with a certain form.
+* \tparam TConfidencePredicate The type of the confidence predicate. Must
+* define operator() taking a <tt>const TOutputDist&</tt> (a normalised
+* snapshot of the running distribution) and returning a bool, with true
+* meaning that no further trees are needed. Must be safe to call from multiple
+* threads simultaneously.
+* \param first_id Iterator to the first ID whose output is to be predicted.
+* \param last_id Iterator to the last ID whose output is to be predicted.
+* \param out_it Iterator to the output distribution corresponding to the first ID.
+* The container of output distributions must already exist, and contain enough
+* elements for all of the IDs between first_id and last_id.
+* \param trees_used_it Iterator to the output container into which the number
+* of trees evaluated for each ID is written. The container must already exist,
+* and contain enough elements for all of the IDs between first_id and last_id.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+* \param confidence_predicate The confidence predicate object, called on the
+* running distribution between stages.
+* \param stage_size The number of trees evaluated between confidence checks.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TOutputIterator, class TTreesUsedIterator, class TFeatureFunctor, class TConfidencePredicate>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predictDistSingleEarlyExit(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TTreesUsedIterator trees_used_it, TFeatureFunctor&& feature_functor, TConfidencePredicate&& confidence_predicate, const int stage_size) const
+{
+	const int num_id = std::distance(first_id,last_id);
+
+	// Loop over data
+	#pragma omp parallel for
+	for(int d = 0; d < num_id; ++d)
+	{
+		// Reset any previous calculations
+		out_it[d].reset();
+
+		int trees_used = 0;
+		while(trees_used < n_trees)
+		{
+			const int stage_last = std::min(trees_used + stage_size, n_trees);
+
+			// Accumulate the leaf distributions from this stage's trees
+			for(int t = trees_used; t < stage_last; ++t)
+				out_it[d].combineWith(*findLeafSingle(first_id[d],t,std::forward<TFeatureFunctor>(feature_functor)),first_id[d]);
+			trees_used = stage_last;
+
+			// Test a normalised snapshot of the running distribution
+			// against the confidence predicate
+			if(trees_used < n_trees)
+			{
+				TOutputDist snapshot = out_it[d];
+				snapshot.normalise();
+				if(std::forward<TConfidencePredicate>(confidence_predicate)(static_cast<const TOutputDist&>(snapshot)))
+					break;
+			}
+		}
+
+		// Normalise
+		out_it[d].normalise();
+		trees_used_it[d] = trees_used;
+	}
+
+}
+
+/*! \brief Predict the output distribution for a number of IDs using batched,
+* level-synchronous tree traversal.
+*
+* This function uses the forest model to predict the full output distribution for
+* each of a number of data points, where each data point is identified by an ID
+* variable.
+*
+* In this version of the function, all of the data points descend each tree
+* together, one level at a time. At each level, the feature functor is asked to
+* fill a block of scores (one per data point, each for that data point's
+* current node), and then all the data points are advanced with a single
+* branch-free loop of compares that the compiler can vectorise. This is the
+* fastest option for workloads in which the features are cheap to evaluate
+* (e.g. lookups into a precomputed image) and traversal itself is the
+* bottleneck.
+*
+* Uses OpenMP to query the multiple tree models in parallel, and then to
+* combine the resulting leaf distributions in parallel over the data points.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TOutputIterator Type of the iterator to the output distributions. Must be
+* a random access iterator that dereferences to TOutputDist.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref batched "batched feature functor" object, meaning
+* it must define an operator() of the form
+* \code
+* void operator()(TIdIterator first_id, TIdIterator last_id, const std::array<int,TNumParams>* params_block, std::vector<float>::iterator out_it)
+* \endcode
+* which writes, for each ID in the range, the score of that ID under the
+* corresponding parameter set in params_block to the output iterator.
+* \param first_id Iterator to the first ID whose output is to be predicted.
+* \param last_id Iterator to the last ID whose output is to be predicted.
+* \param out_it Iterator to the output distribution corresponding to the first ID.
+* The container of output distributions must already exist, and contain enough
+* elements for all of the IDs between first_id and last_id. At the end of this
+* function, the output distributions in this container relate to the
+* corresponding elements of the id container.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TOutputIterator, class TFeatureFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predictDistBatched(TIdIterator first_id, const TIdIterator last_id, TOutputIterator out_it, TFeatureFunctor&& feature_functor) const
+{
+	// Arrays to use to hold leaf nodes
+	const int num_id = std::distance(first_id,last_id);
+	std::vector<std::vector<const TNodeDist*>> leaves(n_trees,std::vector<const TNodeDist*>(num_id));
+
+	// Loop through all the trees in the forest and find the leaf distributions
+	// that each id reaches
+	#pragma omp parallel for
+	for(int t = 0; t < n_trees; ++t)
+		findLeavesBatched(first_id,last_id,t,leaves[t],std::forward<TFeatureFunctor>(feature_functor));
+
+	// For each datapoint, go through the trees and combine the leaf
+	// distributions, processing the datapoints in parallel threads
+	#pragma omp parallel for
+	for(int d = 0; d < num_id; ++d)
+	{
+		// Reset any previous calculations
+		out_it[d].reset();
+
+		// Combine results
+		for(int t = 0; t < n_trees; ++t)
+			out_it[d].combineWith(*leaves[t][d],first_id[d]);
+
+		// Normalise
+		out_it[d].normalise();
+	}
+}
+
 /*! \brief Evaluate the probability of a certain value of the label for a set of
 * data points.
 *
@@ -533,14 +2383,41 @@ void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::predict
 */
 template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
 template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TFeatureFunctor>
-void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::probabilityGroupwise(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TFeatureFunctor&& feature_functor) const
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::probabilityGroupwise(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TFeatureFunctor&& feature_functor) const
+{
+	const auto simple_pdf_functor = [] (const TNodeDist* node_ptr, const TLabel& label, const auto id)
+	{
+		return node_ptr->pdf(label,id);
+	};
+	const auto output_assignment_functor = [] (const auto /*unused*/, const float score) {return score;};
+	probabilityGroupwiseBase(first_id,last_id,label_it,out_it,single_label,output_assignment_functor,std::forward<TFeatureFunctor>(feature_functor),simple_pdf_functor);
+}
+
+/*! \brief Evaluate the probability of a certain value of the label for a set of
+* data points, using a caller-provided workspace.
+*
+* This overload behaves identically to the version without a workspace
+* parameter, but stores all its temporary working data in the provided
+* \c predictionWorkspace . When the same workspace object is passed into
+* repeated calls, the buffers within it are reused, making steady-state
+* evaluation free of heap allocation.
+*
+* See the version without a workspace parameter for a description of the
+* other parameters.
+*
+* \param workspace Workspace object providing the temporary storage for the
+* evaluation. Must not be in use by any other thread.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TFeatureFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::probabilityGroupwise(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TFeatureFunctor&& feature_functor, predictionWorkspace& workspace) const
 {
 	const auto simple_pdf_functor = [] (const TNodeDist* node_ptr, const TLabel& label, const auto id)
 	{
 		return node_ptr->pdf(label,id);
 	};
 	const auto output_assignment_functor = [] (const auto /*unused*/, const float score) {return score;};
-	probabilityGroupwiseBase(first_id,last_id,label_it,out_it,single_label,output_assignment_functor,std::forward<TFeatureFunctor>(feature_functor),simple_pdf_functor);
+	probabilityGroupwiseBase(first_id,last_id,label_it,out_it,single_label,output_assignment_functor,std::forward<TFeatureFunctor>(feature_functor),simple_pdf_functor,workspace);
 }
 
 /*! \brief A generalised version of the \c probabilityGroupwise() function that
@@ -609,14 +2486,43 @@ template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsi
 template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TBinaryFunction, class TFeatureFunctor, class TPDFFunctor>
 void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::probabilityGroupwiseBase(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TBinaryFunction&& binary_function, TFeatureFunctor&& feature_functor, TPDFFunctor&& pdf_functor) const
 {
-	// Arrays to use to hold leaf nodes
+	// Create a function-local workspace and delegate
+	predictionWorkspace workspace;
+	probabilityGroupwiseBase(first_id,last_id,label_it,out_it,single_label,std::forward<TBinaryFunction>(binary_function),std::forward<TFeatureFunctor>(feature_functor),std::forward<TPDFFunctor>(pdf_functor),workspace);
+}
+
+/*! \brief A generalised version of the \c probabilityGroupwise() function,
+* using a caller-provided workspace.
+*
+* This overload behaves identically to the version without a workspace
+* parameter, but stores all its temporary working data in the provided
+* \c predictionWorkspace . When the same workspace object is passed into
+* repeated calls, the buffers within it are reused, making steady-state
+* evaluation free of heap allocation.
+*
+* See the version without a workspace parameter for a description of the
+* other parameters.
+*
+* \param workspace Workspace object providing the temporary storage for the
+* evaluation. Must not be in use by any other thread.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TBinaryFunction, class TFeatureFunctor, class TPDFFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::probabilityGroupwiseBase(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TBinaryFunction&& binary_function, TFeatureFunctor&& feature_functor, TPDFFunctor&& pdf_functor, predictionWorkspace& workspace) const
+{
+	// Prepare the workspace arrays that hold the leaf nodes and per-tree
+	// traversal buffers, retaining any existing capacity
 	const int num_id = std::distance(first_id,last_id);
-	std::vector<std::vector<const TNodeDist*>> leaves(n_trees,std::vector<const TNodeDist*>(num_id));
+	workspace.leaves.resize(n_trees);
+	workspace.nodebag_rel.resize(n_trees);
+	workspace.scores.resize(n_trees);
+	for(int t = 0; t < n_trees; ++t)
+		workspace.leaves[t].resize(num_id);
 
 	// Loop through all the trees in the forest and accumulate scores
 	#pragma omp parallel for
 	for(int t = 0; t < n_trees; ++t)
-		findLeavesGroupwise(first_id,last_id,t,leaves[t],std::forward<TFeatureFunctor>(feature_functor));
+		findLeavesGroupwise(first_id,last_id,t,workspace.leaves[t],workspace.nodebag_rel[t],workspace.scores[t],std::forward<TFeatureFunctor>(feature_functor));
 
 	int d = 0;
 	for( ; first_id != last_id; ++first_id)
@@ -625,7 +2531,7 @@ void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::probabi
 
 		// Combine results
 		for(int t = 0; t < n_trees; ++t)
-			result += std::forward<TPDFFunctor>(pdf_functor)(leaves[t][d],*label_it,*first_id);
+			result += std::forward<TPDFFunctor>(pdf_functor)(workspace.leaves[t][d],*label_it,*first_id);
 
 		// Normalise by the number of trees and assign to output
 		*out_it = std::forward<TBinaryFunction>(binary_function)(*out_it, result/n_trees);
@@ -638,6 +2544,133 @@ void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::probabi
 	}
 }
 
+/*! \brief Evaluate the probability of a certain value of the label for a set
+* of data points, processing the IDs in cache-sized chunks with a software
+* pipeline.
+*
+* This function produces exactly the same results as probabilityGroupwise(),
+* but processes the ID range through the same two-stage chunked pipeline as
+* predictDistChunked(): while one thread accumulates the probability values of
+* one chunk, the remaining threads traverse the trees (and therefore call the
+* feature functor) for the next chunk. This is the preferred method for very
+* large ID ranges, where the monolithic traversal of probabilityGroupwise()
+* would overflow the last-level cache.
+*
+* Unlike probabilityGroupwise(), the label and output iterators must be random
+* access iterators.
+*
+* See probabilityGroupwise() for a description of the other parameters.
+*
+* \param chunk_size The number of data points processed per pipeline stage.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TFeatureFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::probabilityGroupwiseChunked(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TFeatureFunctor&& feature_functor, const int chunk_size) const
+{
+	const auto simple_pdf_functor = [] (const TNodeDist* node_ptr, const TLabel& label, const auto id)
+	{
+		return node_ptr->pdf(label,id);
+	};
+	const auto output_assignment_functor = [] (const auto /*unused*/, const float score) {return score;};
+	probabilityGroupwiseChunkedBase(first_id,last_id,label_it,out_it,single_label,output_assignment_functor,std::forward<TFeatureFunctor>(feature_functor),simple_pdf_functor,chunk_size);
+}
+
+/*! \brief A generalised version of the \c probabilityGroupwiseChunked()
+* function that enables the creation of more general functions.
+*
+* This function generalises \c probabilityGroupwiseChunked() in the same two
+* ways that \c probabilityGroupwiseBase() generalises
+* \c probabilityGroupwise() (a custom pdf functor and a custom binary output
+* function), while processing the IDs through the same chunked pipeline as
+* predictDistChunked().
+*
+* Unlike probabilityGroupwiseBase(), the label and output iterators must be
+* random access iterators.
+*
+* See probabilityGroupwiseBase() for a description of the other parameters.
+*
+* \param chunk_size The number of data points processed per pipeline stage.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TLabelIterator, class TOutputIterator, class TBinaryFunction, class TFeatureFunctor, class TPDFFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::probabilityGroupwiseChunkedBase(TIdIterator first_id, const TIdIterator last_id, TLabelIterator label_it, TOutputIterator out_it, const bool single_label, TBinaryFunction&& binary_function, TFeatureFunctor&& feature_functor, TPDFFunctor&& pdf_functor, const int chunk_size) const
+{
+	const int num_id = std::distance(first_id,last_id);
+	const int n_chunks = (num_id + chunk_size - 1)/chunk_size;
+
+	// A single chunk degenerates to the monolithic version
+	if(n_chunks <= 1)
+	{
+		probabilityGroupwiseBase(first_id,last_id,label_it,out_it,single_label,std::forward<TBinaryFunction>(binary_function),std::forward<TFeatureFunctor>(feature_functor),std::forward<TPDFFunctor>(pdf_functor));
+		return;
+	}
+
+	// Double-buffered leaf pointer and traversal storage, so that the
+	// traversal of one chunk may overlap with the accumulation of the previous
+	predictionWorkspace workspace[2];
+	for(int b = 0; b < 2; ++b)
+	{
+		workspace[b].leaves.resize(n_trees);
+		workspace[b].nodebag_rel.resize(n_trees);
+		workspace[b].scores.resize(n_trees);
+		for(int t = 0; t < n_trees; ++t)
+			workspace[b].leaves[t].resize(chunk_size);
+	}
+
+	#pragma omp parallel
+	{
+		// Prologue: traverse the trees for the first chunk
+		#pragma omp for
+		for(int t = 0; t < n_trees; ++t)
+			findLeavesGroupwise(first_id,first_id + std::min(chunk_size,num_id),t,workspace[0].leaves[t],workspace[0].nodebag_rel[t],workspace[0].scores[t],std::forward<TFeatureFunctor>(feature_functor));
+
+		for(int c = 0; c < n_chunks; ++c)
+		{
+			const predictionWorkspace& chunk_ws = workspace[c%2];
+			const int chunk_begin = c*chunk_size;
+			const int chunk_end = std::min(chunk_begin + chunk_size, num_id);
+
+			// Accumulate this chunk's probability values on one thread (the
+			// binary function is not required to be thread safe), while the
+			// nowait allows the other threads to move straight on to
+			// traversing the next chunk, overlapping the two stages
+			#pragma omp single nowait
+			{
+				for(int d = chunk_begin; d < chunk_end; ++d)
+				{
+					float result = 0.0;
+
+					// Combine results
+					for(int t = 0; t < n_trees; ++t)
+						result += std::forward<TPDFFunctor>(pdf_functor)(chunk_ws.leaves[t][d-chunk_begin],single_label ? *label_it : label_it[d],first_id[d]);
+
+					// Normalise by the number of trees and assign to output
+					out_it[d] = std::forward<TBinaryFunction>(binary_function)(out_it[d], result/n_trees);
+				}
+			}
+
+			if(c + 1 < n_chunks)
+			{
+				// Traverse the trees for the next chunk into the other
+				// buffer. The implicit barrier at the end of this loop
+				// ensures that the accumulation of this chunk has completed
+				// before its buffer is overwritten two chunks later
+				predictionWorkspace& next_ws = workspace[(c+1)%2];
+				const int next_begin = chunk_begin + chunk_size;
+				const int next_end = std::min(next_begin + chunk_size, num_id);
+				#pragma omp for
+				for(int t = 0; t < n_trees; ++t)
+					findLeavesGroupwise(first_id + next_begin,first_id + next_end,t,next_ws.leaves[t],next_ws.nodebag_rel[t],next_ws.scores[t],std::forward<TFeatureFunctor>(feature_functor));
+			}
+			else
+			{
+				// Wait for the final chunk's accumulation to complete
+				#pragma omp barrier
+			}
+		}
+	}
+}
+
 /*! \brief Evaluate the probability of a certain value of the label for a set of
 * data points.
 *
@@ -821,17 +2854,79 @@ template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsi
 template <class TIdIterator, class TFeatureFunctor>
 void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::findLeavesGroupwise(TIdIterator first_id, const TIdIterator last_id, const int treenum, std::vector<const TNodeDist*>& leaves, TFeatureFunctor&& feature_functor) const
 {
-	// Create an array of vectors to store the contents of each node,
-	// and initially place all the inputs into the first
+	// Create function-local traversal buffers and delegate
+	std::vector<std::vector<int>> nodebag_rel;
+	std::vector<float> scores;
+	findLeavesGroupwise(first_id,last_id,treenum,leaves,nodebag_rel,scores,std::forward<TFeatureFunctor>(feature_functor));
+}
+
+/*! \brief Function to query a single tree model with a set of data points and
+* store a pointer to the leaf distribution that each reaches, using
+* caller-provided traversal buffers.
+*
+* This overload behaves identically to the version without buffer parameters,
+* but stores all its temporary working data in the caller-provided buffers.
+* When the same buffers are passed into repeated calls, their capacity is
+* retained between calls, avoiding heap allocation in the steady state.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref groupwise "groupwise feature functor" object, meaning
+* it must define operator() with a certain form.
+* \param first_id Iterator to the ID of the first data point for which the
+* leaf distribution is to be found.
+* \param last_id Iterator to the ID of the last data point for which the
+* leaf distribution is to be found.
+* \param treenum Index of the tree to use.
+* \param leaves After the function, this array contains pointers to the leaf
+* distribution reached by the corresponding elements in the ID list. Expects to
+* be pre-allocated to the correct size.
+* \param nodebag_rel Buffer used to hold the bag of data point indices in each
+* node during traversal. Any previous contents are overwritten.
+* \param scores Buffer used to hold the feature scores of the data points in a
+* node. Any previous contents are overwritten.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TFeatureFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::findLeavesGroupwise(TIdIterator first_id, const TIdIterator last_id, const int treenum, std::vector<const TNodeDist*>& leaves, std::vector<std::vector<int>>& nodebag_rel, std::vector<float>& scores, TFeatureFunctor&& feature_functor) const
+{
+	if(use_levelwise)
+	{
+		findLeavesLevelwise(first_id,last_id,treenum,leaves,nodebag_rel,scores,std::forward<TFeatureFunctor>(feature_functor));
+		return;
+	}
+
+	ensureTreeLoaded(treenum);
+
+	// Makes the code a bit more readable
+	const tree& thistree = forest[treenum];
+	const int tree_nodes = thistree.numNodes();
+
+#ifdef CANOPY_PROFILE
+	const double prof_start = omp_get_wtime();
+	std::uint64_t prof_feature_calls = 0;
+	std::vector<int> prof_node_depth(tree_nodes,0);
+	std::vector<std::uint64_t> prof_leaf_hist(n_levels,0);
+#endif
+
+	// Prepare the array of vectors that store the contents of each node,
+	// retaining any existing capacity, and initially place all the inputs
+	// into the first
 	const int num_id = std::distance(first_id,last_id);
-	std::vector<std::vector<int>> nodebag_rel(n_nodes);
+	nodebag_rel.resize(tree_nodes);
+	for(auto& bag : nodebag_rel)
+		bag.clear();
 	nodebag_rel[0].resize(num_id);
 	std::iota(nodebag_rel[0].begin(),nodebag_rel[0].end(),0);
-	std::vector<float> scores;
 	scores.reserve(num_id);
 
-	// Loop through the nodes, sending datapoints left and right
-	for(int n = 0; n < n_nodes; ++n)
+	// Loop through the nodes, sending datapoints left and right. Children
+	// are always stored after their parent, so a single forward pass works
+	for(int n = 0; n < tree_nodes; ++n)
 	{
 		// Number of datapoint in this node
 		const int num_data_thisnode = nodebag_rel[n].size();
@@ -840,14 +2935,16 @@ void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::findLea
 		if(num_data_thisnode == 0)
 			continue;
 
-		// Makes the code a bit more readable
-		const node& thisnode = forest[treenum].nodes[n];
-
-		if(thisnode.is_leaf)
+		if(thistree.is_leaf[n])
 		{
 			// Update the scores for datapoints in this node
+			const TNodeDist* const leaf_dist = &thistree.dist_pool[thistree.dist_index[n]];
 			for(int d = 0; d < int(nodebag_rel[n].size()); ++d)
-				leaves[nodebag_rel[n][d]] = thisnode.post.data();
+				leaves[nodebag_rel[n][d]] = leaf_dist;
+
+#ifdef CANOPY_PROFILE
+			prof_leaf_hist[prof_node_depth[n]] += num_data_thisnode;
+#endif
 		}
 		else
 			// Not a leaf - send the contents left or right
@@ -859,26 +2956,221 @@ void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::findLea
 			scores.resize(num_data_thisnode);
 			const auto start_it = boost::make_permutation_iterator(first_id,nodebag_rel[n].cbegin());
 			const auto end_it = boost::make_permutation_iterator(first_id,nodebag_rel[n].cend());
-			std::forward<TFeatureFunctor>(feature_functor)(start_it,end_it,thisnode.params,scores.begin());
+			std::forward<TFeatureFunctor>(feature_functor)(start_it,end_it,thistree.params[n],scores.begin());
 
 			// Reserve space in the bags of the children nodes
 			// (this should make performing multiple push_backs less
 			// expensive)
-			nodebag_rel[2*n+1].reserve(num_data_thisnode);
-			nodebag_rel[2*n+2].reserve(num_data_thisnode);
+			const int left = thistree.left_child[n];
+			nodebag_rel[left].reserve(num_data_thisnode);
+			nodebag_rel[left+1].reserve(num_data_thisnode);
 
 			// Send the datapoints left or right
 			for(int d = 0; d < int(num_data_thisnode); ++d)
 			{
-				const int nextnode = (scores[d] < thisnode.thresh ) ? 2*n+1 : 2*n+2;
+				const int nextnode = (scores[d] < thistree.thresh[n] ) ? left : left+1;
 				nodebag_rel[nextnode].emplace_back(nodebag_rel[n][d]);
 			}
 
-			// Clear up
+			// Clear up, deliberately keeping the capacity so that it can
+			// be reused on a subsequent call with the same buffers
 			nodebag_rel[n].clear();
-			nodebag_rel[n].shrink_to_fit();
+
+#ifdef CANOPY_PROFILE
+			++prof_feature_calls;
+			prof_node_depth[left] = prof_node_depth[n] + 1;
+			prof_node_depth[left+1] = prof_node_depth[n] + 1;
+#endif
+		}
+	}
+
+#ifdef CANOPY_PROFILE
+	// Merge this call's counters into the shared statistics (traversals may
+	// be running in parallel threads over the trees)
+	const double prof_elapsed = omp_get_wtime() - prof_start;
+	#pragma omp critical(canopy_profile)
+	{
+		if(int(profile_stats.traversal_seconds.size()) < n_trees)
+			profile_stats.traversal_seconds.resize(n_trees,0.0);
+		if(profile_stats.leaf_depth_histogram.size() < prof_leaf_hist.size())
+			profile_stats.leaf_depth_histogram.resize(prof_leaf_hist.size(),0);
+		profile_stats.traversal_seconds[treenum] += prof_elapsed;
+		profile_stats.predict_feature_calls += prof_feature_calls;
+		for(unsigned l = 0; l < prof_leaf_hist.size(); ++l)
+			profile_stats.leaf_depth_histogram[l] += prof_leaf_hist[l];
+	}
+#endif
+}
+
+/*! \brief Function to query a single tree model with a set of data points
+* using level-synchronous traversal, and store a pointer to the leaf
+* distribution that each reaches.
+*
+* This is the implementation behind the traversal mode selected with
+* \c setLevelwiseTraversal() . All the data points descend the tree together,
+* one level per pass. A single current-node index is kept per data point, and
+* two flat orderings of the data point indices, grouped by current node, are
+* ping-ponged between passes; no per-node index vectors are ever built. The
+* feature functor is called once per contiguous run of data points sharing a
+* node, with the same groupwise signature as the default traversal, and the
+* node data of each run's children are prefetched while the run's scores are
+* consumed.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref groupwise "groupwise feature functor" object, meaning
+* it must define operator() with a certain form.
+* \param first_id Iterator to the ID of the first data point for which the
+* leaf distribution is to be found.
+* \param last_id Iterator to the ID of the last data point for which the
+* leaf distribution is to be found.
+* \param treenum Index of the tree to use.
+* \param leaves After the function, this array contains pointers to the leaf
+* distribution reached by the corresponding elements in the ID list. Expects to
+* be pre-allocated to the correct size.
+* \param nodebag_rel Buffer structure used to hold the lane orderings and
+* current node indices during traversal. Any previous contents are overwritten.
+* \param scores Buffer used to hold the feature scores of the data points in a
+* run. Any previous contents are overwritten.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TFeatureFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::findLeavesLevelwise(TIdIterator first_id, const TIdIterator last_id, const int treenum, std::vector<const TNodeDist*>& leaves, std::vector<std::vector<int>>& nodebag_rel, std::vector<float>& scores, TFeatureFunctor&& feature_functor) const
+{
+	ensureTreeLoaded(treenum);
+
+	// Makes the code a bit more readable
+	const tree& thistree = forest[treenum];
+	const int num_id = std::distance(first_id,last_id);
+
+#ifdef CANOPY_PROFILE
+	const double prof_start = omp_get_wtime();
+	std::uint64_t prof_feature_calls = 0;
+	std::vector<std::uint64_t> prof_leaf_hist(n_levels,0);
+	int prof_level = 0;
+#endif
+
+	// The two flat orderings of the active lanes (data points) and the current
+	// node of each lane live in the caller's buffer structure, so that their
+	// capacity is retained between calls with the same buffers
+	nodebag_rel.resize(3);
+	std::vector<int>& order = nodebag_rel[0];
+	std::vector<int>& next_order = nodebag_rel[1];
+	std::vector<int>& cur_node = nodebag_rel[2];
+	cur_node.assign(num_id,0);
+	order.resize(num_id);
+	std::iota(order.begin(),order.end(),0);
+	next_order.resize(num_id);
+	scores.reserve(num_id);
+
+	// A lane stays in the orderings until it steps onto a leaf. A tree that
+	// is a single leaf node is resolved directly, as no lane ever steps
+	int num_active = num_id;
+	if(thistree.is_leaf[0])
+	{
+		const TNodeDist* const root_dist = &thistree.dist_pool[thistree.dist_index[0]];
+		for(int d = 0; d < num_id; ++d)
+			leaves[d] = root_dist;
+		num_active = 0;
+#ifdef CANOPY_PROFILE
+		prof_leaf_hist[0] += num_id;
+#endif
+	}
+
+	// Advance all the active lanes together, one level per pass
+	while(num_active > 0)
+	{
+		int out = 0;
+		int i = 0;
+		while(i < num_active)
+		{
+			// Find the run of lanes whose current node is the same. The
+			// orderings keep the lanes sorted by node, so runs are contiguous
+			const int n = cur_node[order[i]];
+			int j = i + 1;
+			while( (j < num_active) && (cur_node[order[j]] == n) )
+				++j;
+			const int run_length = j - i;
+
+			// Score the whole run with a single functor call, accessing the
+			// ids through their place in the ordering
+			scores.resize(run_length);
+			const auto start_it = boost::make_permutation_iterator(first_id,order.cbegin() + i);
+			const auto end_it = boost::make_permutation_iterator(first_id,order.cbegin() + j);
+			std::forward<TFeatureFunctor>(feature_functor)(start_it,end_it,thistree.params[n],scores.begin());
+
+			const int left = thistree.left_child[n];
+			const float node_thresh = thistree.thresh[n];
+
+			// Pull the node data of the children towards the cache while the
+			// run's scores are consumed
+			CANOPY_PREFETCH(&thistree.is_leaf[left]);
+			CANOPY_PREFETCH(&thistree.thresh[left]);
+			CANOPY_PREFETCH(&thistree.params[left]);
+			CANOPY_PREFETCH(&thistree.left_child[left]);
+
+			// Append the left-going lanes and then the right-going lanes to
+			// the next ordering, so that it stays sorted by node (children
+			// appear in breadth-first order in the compact layout)
+			for(int side = 0; side < 2; ++side)
+			{
+				const int child = left + side;
+				const bool child_is_leaf = thistree.is_leaf[child];
+				const TNodeDist* const child_dist = child_is_leaf ? &thistree.dist_pool[thistree.dist_index[child]] : nullptr;
+				for(int d = 0; d < run_length; ++d)
+				{
+					const bool goes_left = scores[d] < node_thresh;
+					if(goes_left != (side == 0))
+						continue;
+					const int lane = order[i + d];
+					if(child_is_leaf)
+					{
+						leaves[lane] = child_dist;
+#ifdef CANOPY_PROFILE
+						prof_leaf_hist[prof_level + 1] += 1;
+#endif
+					}
+					else
+					{
+						cur_node[lane] = child;
+						next_order[out++] = lane;
+					}
+				}
+			}
+
+#ifdef CANOPY_PROFILE
+			++prof_feature_calls;
+#endif
+			i = j;
 		}
+
+		std::swap(order,next_order);
+		num_active = out;
+#ifdef CANOPY_PROFILE
+		++prof_level;
+#endif
+	}
+
+#ifdef CANOPY_PROFILE
+	// Merge this call's counters into the shared statistics (traversals may
+	// be running in parallel threads over the trees)
+	const double prof_elapsed = omp_get_wtime() - prof_start;
+	#pragma omp critical(canopy_profile)
+	{
+		if(int(profile_stats.traversal_seconds.size()) < n_trees)
+			profile_stats.traversal_seconds.resize(n_trees,0.0);
+		if(profile_stats.leaf_depth_histogram.size() < prof_leaf_hist.size())
+			profile_stats.leaf_depth_histogram.resize(prof_leaf_hist.size(),0);
+		profile_stats.traversal_seconds[treenum] += prof_elapsed;
+		profile_stats.predict_feature_calls += prof_feature_calls;
+		for(unsigned l = 0; l < prof_leaf_hist.size(); ++l)
+			profile_stats.leaf_depth_histogram[l] += prof_leaf_hist[l];
 	}
+#endif
 }
 
 /*! \brief Function to query a single tree model with a single data point and
@@ -903,14 +3195,180 @@ template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsi
 template<class TId, class TFeatureFunctor>
 const TNodeDist* randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::findLeafSingle(const TId id, const int treenum, TFeatureFunctor&& feature_functor) const
 {
+	ensureTreeLoaded(treenum);
+
+	const tree& thistree = forest[treenum];
 	int n = 0;
-	while(!forest[treenum].nodes[n].is_leaf)
+	while(!thistree.is_leaf[n])
+	{
+		const float score = std::forward<TFeatureFunctor>(feature_functor)(id, thistree.params[n]);
+		n = (score < thistree.thresh[n] ) ? thistree.left_child[n] : thistree.left_child[n]+1;
+	}
+	return &thistree.dist_pool[thistree.dist_index[n]];
+}
+
+/*! \brief Function to query a single tree model with every row of a dense
+* feature matrix and store a pointer to the leaf distribution that each row
+* reaches.
+*
+* This is a basic operation that is used by higher-level processes. Each row
+* descends the tree with its feature reads inlined directly from the matrix
+* ( \c params[0] of each node indexing a column), so there are no feature
+* functor calls and no ID gathers. See \c predictDistMatrix() for the matrix
+* convention.
+*
+* \param features Pointer to the first element of the feature matrix.
+* \param num_rows The number of rows (data points) in the matrix.
+* \param stride The number of elements between the starts of consecutive rows.
+* \param treenum Index of the tree to use.
+* \param leaves After the function, this array contains pointers to the leaf
+* distribution reached by the corresponding rows. Expects to be pre-allocated
+* to the correct size.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::findLeavesMatrix(const float* const features, const int num_rows, const int stride, const int treenum, std::vector<const TNodeDist*>& leaves) const
+{
+	ensureTreeLoaded(treenum);
+
+	const tree& thistree = forest[treenum];
+
+#ifdef CANOPY_PROFILE
+	const double prof_start = omp_get_wtime();
+	std::vector<std::uint64_t> prof_leaf_hist(n_levels,0);
+#endif
+
+	for(int r = 0; r < num_rows; ++r)
+	{
+		const float* const row = features + std::size_t(r)*stride;
+		int n = 0;
+#ifdef CANOPY_PROFILE
+		int level = 0;
+#endif
+		while(!thistree.is_leaf[n])
+		{
+			n = (row[thistree.params[n][0]] < thistree.thresh[n]) ? thistree.left_child[n] : thistree.left_child[n]+1;
+#ifdef CANOPY_PROFILE
+			++level;
+#endif
+		}
+		leaves[r] = &thistree.dist_pool[thistree.dist_index[n]];
+#ifdef CANOPY_PROFILE
+		prof_leaf_hist[level] += 1;
+#endif
+	}
+
+#ifdef CANOPY_PROFILE
+	// Merge this call's counters into the shared statistics (traversals may
+	// be running in parallel threads over the trees)
+	const double prof_elapsed = omp_get_wtime() - prof_start;
+	#pragma omp critical(canopy_profile)
+	{
+		if(int(profile_stats.traversal_seconds.size()) < n_trees)
+			profile_stats.traversal_seconds.resize(n_trees,0.0);
+		if(profile_stats.leaf_depth_histogram.size() < prof_leaf_hist.size())
+			profile_stats.leaf_depth_histogram.resize(prof_leaf_hist.size(),0);
+		profile_stats.traversal_seconds[treenum] += prof_elapsed;
+		for(unsigned l = 0; l < prof_leaf_hist.size(); ++l)
+			profile_stats.leaf_depth_histogram[l] += prof_leaf_hist[l];
+	}
+#endif
+}
+
+/*! \brief Function to query a single tree model with a set of data points
+* using batched, level-synchronous traversal, and store a pointer to the leaf
+* distribution that each reaches.
+*
+* This is a basic operation that is used by higher-level processes. All the
+* data points (lanes) descend the tree together, one level at a time. Before
+* each advance, the node data of each lane's current node are gathered into
+* contiguous blocks, the feature functor fills a block of scores for all the
+* lanes in a single call, and the lanes are then advanced with a branch-free
+* loop of compares that the compiler can vectorise.
+*
+* \tparam TIdIterator Type of the iterator to the IDs. Must be a random access
+* iterator and dereference to the TId type expected by the feature functor.
+* \tparam TFeatureFunctor The type of the feature functor object. Must meet the
+* specifications for a \ref batched "batched feature functor" object, see
+* \c predictDistBatched() .
+* \param first_id Iterator to the ID of the first data point for which the
+* leaf distribution is to be found.
+* \param last_id Iterator to the ID of the last data point for which the
+* leaf distribution is to be found.
+* \param treenum Index of the tree to use.
+* \param leaves After the function, this array contains pointers to the leaf
+* distribution reached by the corresponding elements in the ID list. Expects to
+* be pre-allocated to the correct size.
+* \param feature_functor The feature functor object to be used as a callback to
+* calculate the features. Must be safe to call from multiple threads
+* simultaneously.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TFeatureFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::findLeavesBatched(TIdIterator first_id, const TIdIterator last_id, const int treenum, std::vector<const TNodeDist*>& leaves, TFeatureFunctor&& feature_functor) const
+{
+	ensureTreeLoaded(treenum);
+
+	// Makes the code a bit more readable
+	const tree& thistree = forest[treenum];
+	const int num_id = std::distance(first_id,last_id);
+
+	// A tree that is a single leaf node is resolved directly: it holds no
+	// valid split parameters anywhere, so the feature functor must not be
+	// called at all
+	if(thistree.is_leaf[0])
+	{
+		const TNodeDist* const root_dist = &thistree.dist_pool[thistree.dist_index[0]];
+		for(int lane = 0; lane < num_id; ++lane)
+			leaves[lane] = root_dist;
+		return;
+	}
+
+	// The current node of each lane (data point), all starting at the root
+	std::vector<int> cur_node(num_id,0);
+
+	// Blocks of per-lane node data gathered before each batched advance
+	std::vector<std::array<int,TNumParams>> node_params(num_id);
+	std::vector<float> node_thresh(num_id);
+	std::vector<int> node_left(num_id);
+	std::vector<float> scores(num_id);
+
+	// Advance all lanes together, one level at a time. The loop terminates
+	// because every root-to-leaf path contains at most n_levels+1 nodes
+	int any_active = 1;
+	while(any_active)
 	{
-		const node& thisnode = forest[treenum].nodes[n];
-		const float score = std::forward<TFeatureFunctor>(feature_functor)(id, thisnode.params);
-		n = (score < thisnode.thresh ) ? 2*n+1 : 2*n+2;
+		// Gather phase: collect the node data of each lane's current node
+		// into contiguous blocks. Lanes that have already reached a leaf
+		// are given the root's parameters so that the feature functor is
+		// only ever called with valid parameters; their scores are ignored
+		for(int lane = 0; lane < num_id; ++lane)
+		{
+			const int n = cur_node[lane];
+			const int left = thistree.left_child[n];
+			node_left[lane] = left;
+			node_thresh[lane] = thistree.thresh[n];
+			node_params[lane] = (left < 0) ? thistree.params[0] : thistree.params[n];
+		}
+
+		// Score phase: the feature functor fills the score block for all
+		// the lanes with a single call
+		std::forward<TFeatureFunctor>(feature_functor)(first_id,last_id,node_params.data(),scores.begin());
+
+		// Advance phase: branch-free compare and select for every lane
+		any_active = 0;
+		#pragma omp simd reduction(|:any_active)
+		for(int lane = 0; lane < num_id; ++lane)
+		{
+			const int left = node_left[lane];
+			const int next = (scores[lane] < node_thresh[lane]) ? left : left+1;
+			cur_node[lane] = (left < 0) ? cur_node[lane] : next;
+			any_active |= (left >= 0);
+		}
 	}
-	return forest[treenum].nodes[n].post.data();
+
+	// Look up the leaf distribution that each lane settled on
+	for(int lane = 0; lane < num_id; ++lane)
+		leaves[lane] = &thistree.dist_pool[thistree.dist_index[cur_node[lane]]];
 }
 
 /*! \brief Train the random forest model on training data.
@@ -920,7 +3378,11 @@ const TNodeDist* randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumPara
 * to the IDs of the training data and the corresponding label variables, and functors
 * to generate parameters of the feature functor and evaluate the features.
 *
-* This function uses OpenMP to train the trees in parallel threads.
+* This function uses OpenMP to parallelise the training. When there are at
+* least as many trees as available threads, the trees are trained in parallel
+* threads. Otherwise, the candidate parameter combinations within each node
+* are evaluated in parallel threads, which makes better use of the cores when
+* training a small forest with a large number of parameter combinations.
 *
 * \tparam TIdIterator Type of the iterator used to access the training IDs.
 * Must be a random access iterator that dereferences to the ID type expected by
@@ -964,34 +3426,278 @@ const TNodeDist* randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumPara
 */
 template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
 template <class TIdIterator, class TLabelIterator, class TFeatureFunctor, class TParameterFunctor>
-void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::train(const TIdIterator first_id,
-																			   const TIdIterator last_id,
-																			   const TLabelIterator first_label,
-																			   TFeatureFunctor&& feature_functor,
-																			   TParameterFunctor&& parameter_functor,
-																			   const unsigned num_param_combos_to_test,
-																			   const bool bagging,
-																			   const float bag_proportion,
-																			   const bool train_split_nodes,
-																			   const unsigned min_training_data)
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::train(const TIdIterator first_id,
+																			   const TIdIterator last_id,
+																			   const TLabelIterator first_label,
+																			   TFeatureFunctor&& feature_functor,
+																			   TParameterFunctor&& parameter_functor,
+																			   const unsigned num_param_combos_to_test,
+																			   const bool bagging,
+																			   const float bag_proportion,
+																			   const bool train_split_nodes,
+																			   const unsigned min_training_data)
+{
+	this->fit_split_nodes = train_split_nodes;
+
+	if(bagging && (bag_proportion <= 0.0 || bag_proportion > 1.0))
+		return;
+
+	// Any sample weights set must cover the whole training set
+	if(!sample_weights.empty() && (sample_weights.size() < unsigned(std::distance(first_id,last_id))))
+		return;
+
+	// (Re-)allocate the trees in complete-binary-tree layout, ready for growing
+	allocateForestMemory();
+
+	// Give each tree its own random engine, deterministically derived from
+	// the master seed, so that the tree-parallel loop neither races nor
+	// contends on a shared engine and a given seed reproduces the same bags
+	tree_engines.resize(n_trees);
+	for(int t = 0; t < n_trees; ++t)
+	{
+		std::seed_seq seq{master_seed, static_cast<unsigned>(t)};
+		tree_engines[t].seed(seq);
+	}
+
+	growTrees(0,n_trees,false,first_id,last_id,first_label,std::forward<TFeatureFunctor>(feature_functor),std::forward<TParameterFunctor>(parameter_functor),num_param_combos_to_test,bagging,bag_proportion,min_training_data);
+}
+
+/*! \brief Grow the leaves of a trained forest deeper using new training data.
+*
+* The existing split nodes of every tree are kept exactly as they are
+* (including any fitted split-node distributions), and the new training data
+* are routed down through them. Each current leaf that receives enough data
+* is then grown further using the usual splitting procedure, up to the new
+* maximum depth, and its distribution is refitted from the new data. A leaf
+* that receives fewer than \c min_training_data points keeps its existing
+* distribution unchanged. This turns a full nightly retrain into a much
+* cheaper refresh when only the deepest levels of the model need to change.
+*
+* The parameters shared with \c train() have the same meaning as there; the
+* value of the fit_split_nodes option is carried over from the original
+* training run. Out-of-bag accumulators are replaced by ones gathered during
+* the deepening pass.
+*
+* \param new_num_levels The new maximum number of levels in each tree. Must
+* be strictly greater than the current number of levels, otherwise the
+* function returns immediately without changing the model.
+* \param first_id Iterator to the ID of the first element in the new training
+* list.
+* \param last_id Iterator to the ID of the last element in the new training
+* list.
+* \param first_label Iterator to the label of the first element in the new
+* training list.
+* \param feature_functor The function object used to evaluate the features.
+* \param parameter_functor The function object used to generate random split
+* parameters.
+* \param num_param_combos_to_test The number of parameter combinations to
+* test when training each new split node.
+* \param bagging If true, a random subset of the new training data are used
+* for each tree. Default: true.
+* \param bag_proportion Proportion of the new training data in each tree's
+* bag. Default: C_DEFAULT_BAGGING_PROPORTION .
+* \param min_training_data The threshold number of training data points in a
+* node below which a leaf node is declared. Default:
+* C_DEFAULT_MIN_TRAINING_DATA .
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TLabelIterator, class TFeatureFunctor, class TParameterFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::trainDeeper(const int new_num_levels,
+																					 const TIdIterator first_id,
+																					 const TIdIterator last_id,
+																					 const TLabelIterator first_label,
+																					 TFeatureFunctor&& feature_functor,
+																					 TParameterFunctor&& parameter_functor,
+																					 const unsigned num_param_combos_to_test,
+																					 const bool bagging,
+																					 const float bag_proportion,
+																					 const unsigned min_training_data)
 {
-	this->fit_split_nodes = train_split_nodes;
+	if(!valid || (new_num_levels <= n_levels))
+		return;
 
-	const int num_ids = std::distance(first_id,last_id);
+	if(bagging && (bag_proportion <= 0.0 || bag_proportion > 1.0))
+		return;
+
+	// Any sample weights set must cover the whole training set
+	if(!sample_weights.empty() && (sample_weights.size() < unsigned(std::distance(first_id,last_id))))
+		return;
+
+	// All trees must be materialised before they can be expanded
+	for(int t = 0; t < n_trees; ++t)
+		ensureTreeLoaded(t);
+	pending_tree_blocks.clear();
+	tree_parsed.clear();
+
+	// Deepen the layout. The trees themselves are expanded back into
+	// complete-binary-tree form inside the growing procedure
+	n_levels = new_num_levels;
+	n_nodes = std::pow(2,n_levels+1) - 1;
+
+	// Re-derive the per-tree random engines (see train() )
+	tree_engines.resize(n_trees);
+	for(int t = 0; t < n_trees; ++t)
+	{
+		std::seed_seq seq{master_seed, static_cast<unsigned>(t)};
+		tree_engines[t].seed(seq);
+	}
+
+	growTrees(0,n_trees,true,first_id,last_id,first_label,std::forward<TFeatureFunctor>(feature_functor),std::forward<TParameterFunctor>(parameter_functor),num_param_combos_to_test,bagging,bag_proportion,min_training_data);
+}
+
+/*! \brief Widen a trained forest by training additional trees, leaving the
+* existing trees untouched.
+*
+* The new trees are trained on the supplied data with the usual procedure
+* and appended to the forest, after which predictions combine the leaf
+* distributions of old and new trees alike. The parameters shared with
+* \c train() have the same meaning as there; the value of the
+* fit_split_nodes option is carried over from the original training run.
+* Note that out-of-bag accumulators are replaced by ones gathered over the
+* new trees only.
+*
+* \param num_new_trees The number of trees to append to the forest. Must be
+* positive, otherwise the function returns immediately without changing the
+* model.
+* \param first_id Iterator to the ID of the first element in the training
+* list.
+* \param last_id Iterator to the ID of the last element in the training list.
+* \param first_label Iterator to the label of the first element in the
+* training list.
+* \param feature_functor The function object used to evaluate the features.
+* \param parameter_functor The function object used to generate random split
+* parameters.
+* \param num_param_combos_to_test The number of parameter combinations to
+* test when training each split node.
+* \param bagging If true, a random subset of the training data are used for
+* each tree. Default: true.
+* \param bag_proportion Proportion of the training data in each tree's bag.
+* Default: C_DEFAULT_BAGGING_PROPORTION .
+* \param min_training_data The threshold number of training data points in a
+* node below which a leaf node is declared. Default:
+* C_DEFAULT_MIN_TRAINING_DATA .
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TLabelIterator, class TFeatureFunctor, class TParameterFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::trainMoreTrees(const int num_new_trees,
+																						const TIdIterator first_id,
+																						const TIdIterator last_id,
+																						const TLabelIterator first_label,
+																						TFeatureFunctor&& feature_functor,
+																						TParameterFunctor&& parameter_functor,
+																						const unsigned num_param_combos_to_test,
+																						const bool bagging,
+																						const float bag_proportion,
+																						const unsigned min_training_data)
+{
+	if(!valid || (num_new_trees <= 0))
+		return;
 
 	if(bagging && (bag_proportion <= 0.0 || bag_proportion > 1.0))
 		return;
 
+	// Any sample weights set must cover the whole training set
+	if(!sample_weights.empty() && (sample_weights.size() < unsigned(std::distance(first_id,last_id))))
+		return;
+
+	// The lazy loading bookkeeping is indexed by tree, so materialise any
+	// pending trees before the forest changes shape
+	for(int t = 0; t < n_trees; ++t)
+		ensureTreeLoaded(t);
+	pending_tree_blocks.clear();
+	tree_parsed.clear();
+
+	// Append the new trees in complete-binary-tree layout, ready for growing
+	const int first_new_tree = n_trees;
+	n_trees += num_new_trees;
+	forest.resize(n_trees);
+	for(int t = first_new_tree; t < n_trees; ++t)
+		allocateTreeMemory(forest[t]);
+
+	// Give each new tree its own random engine (see train() )
+	tree_engines.resize(n_trees);
+	for(int t = first_new_tree; t < n_trees; ++t)
+	{
+		std::seed_seq seq{master_seed, static_cast<unsigned>(t)};
+		tree_engines[t].seed(seq);
+	}
+
+	growTrees(first_new_tree,n_trees,false,first_id,last_id,first_label,std::forward<TFeatureFunctor>(feature_functor),std::forward<TParameterFunctor>(parameter_functor),num_param_combos_to_test,bagging,bag_proportion,min_training_data);
+}
+
+/*! \brief Grow a range of trees on the given training data.
+*
+* This is the worker behind \c train() , \c trainDeeper() and
+* \c trainMoreTrees() and should not be called otherwise. The trees in the
+* range [first_tree,last_tree) are grown on the supplied data; when
+* \c continue_existing is set each of those trees is first expanded from its
+* compact form, its existing split nodes are retained and only its current
+* leaves are grown further (see \c trainDeeper() ). The remaining parameters
+* have the same meaning as in \c train() .
+*
+* \param first_tree Index of the first tree to grow.
+* \param last_tree Index one past the last tree to grow.
+* \param continue_existing If true, the trees are grown from their existing
+* split structure rather than from scratch.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TIdIterator, class TLabelIterator, class TFeatureFunctor, class TParameterFunctor>
+void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::growTrees(const int first_tree,
+																				   const int last_tree,
+																				   const bool continue_existing,
+																				   const TIdIterator first_id,
+																				   const TIdIterator last_id,
+																				   const TLabelIterator first_label,
+																				   TFeatureFunctor&& feature_functor,
+																				   TParameterFunctor&& parameter_functor,
+																				   const unsigned num_param_combos_to_test,
+																				   const bool bagging,
+																				   const float bag_proportion,
+																				   const unsigned min_training_data)
+{
+	const int num_ids = std::distance(first_id,last_id);
+
 	// Calculate the size of each bag
 	const int bagsize = bagging ?  num_ids*bag_proportion : num_ids;
 
+	// Prepare the out-of-bag accumulators (out-of-bag samples only exist
+	// when bagging is used)
+	oob_dists.clear();
+	oob_counts.clear();
+	const bool accumulate_oob = estimate_oob && bagging;
+	if(accumulate_oob)
+	{
+		oob_dists.resize(num_ids);
+		for(TOutputDist& dist : oob_dists)
+			static_cast<derivedProxy*>(this)->initialiseOutputDist(dist);
+		oob_counts.assign(num_ids,0);
+	}
+
 	// Perform any precalculations necessary
 	static_cast<derivedProxy*>(this)->trainingPrecalculations(first_label, first_label + num_ids, first_id);
 
+	// Presorted split finding needs the cached feature columns
+	const bool cache_features = use_feature_cache || use_presort;
+
+	// Decide where to apply the parallelism. If there are at least as many
+	// trees as threads, parallelising over the trees alone saturates the
+	// machine. Otherwise the tree loop runs serially and the candidate
+	// parameter evaluations within each node are parallelised instead,
+	// which keeps all the cores busy when training small forests with many
+	// parameter combinations
+	const bool parallelise_over_trees = ((last_tree - first_tree) >= omp_get_max_threads());
+
 	// Loop through the trees in parallel, training each tree
-	#pragma omp parallel for
-	for(int t = 0; t < n_trees; ++t)
+	#pragma omp parallel for schedule(dynamic) if(parallelise_over_trees)
+	for(int t = first_tree; t < last_tree; ++t)
 	{
+		// When continuing an existing tree, expand it back into
+		// complete-binary-tree layout, remembering which nodes are retained
+		// split nodes and which are the former leaves to grow further
+		std::vector<unsigned char> retained_split, former_leaf;
+		if(continue_existing)
+			expandTreeForGrowth(forest[t],retained_split,former_leaf);
+
 		// Array of vectors of ids in each node and their number
 		std::vector<std::vector<int>> nodebag(n_nodes);
 
@@ -999,29 +3705,81 @@ void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::train(c
 		// node, or set it to the whole training set
 		nodebag[0].resize(num_ids);
 		std::iota(nodebag[0].begin(),nodebag[0].end(),0);
+		std::vector<int> oob_ids;
 		if(bagging)
 		{
-			std::shuffle(nodebag[0].begin(), nodebag[0].end(), rand_engine);
+			std::shuffle(nodebag[0].begin(), nodebag[0].end(), tree_engines[t]);
+
+			// The discarded remainder of the shuffle is this tree's
+			// out-of-bag sample
+			if(accumulate_oob)
+				oob_ids.assign(nodebag[0].cbegin()+bagsize,nodebag[0].cend());
+
 			nodebag[0].resize(bagsize);
 		}
 
 		// Memory to hold scores from feature computations
-		std::vector<float> score, best_score;
+		std::vector<float> score;
 		score.reserve(bagsize);
-		best_score.reserve(bagsize);
+
+		// Per-candidate results of the parameter evaluations
+		std::vector<float> combo_info_gain(num_param_combos_to_test);
+		std::vector<float> combo_thresh(num_param_combos_to_test);
+		std::vector<unsigned char> combo_failed(num_param_combos_to_test);
+		std::vector<std::array<int,TNumParams>> combo_params(num_param_combos_to_test);
+
+		// Per-tree cache of feature score columns over the whole training
+		// set, keyed on the parameter set (only used when enabled). Each
+		// entry pairs the column with the ids of the root bag sorted by
+		// their score in that column (only maintained when presorting)
+		std::map<std::array<int,TNumParams>,std::pair<std::vector<float>,std::vector<int>>> feature_cache;
+		std::vector<const std::vector<float>*> combo_columns(num_param_combos_to_test);
+		std::vector<const std::vector<int>*> combo_sorted(num_param_combos_to_test);
+
+		// The slice of each feature's sorted id array that belongs to each
+		// node, and the side of its parent's split that each id fell on
+		// (only used when presorting)
+		std::vector<int> slice_begin, slice_end;
+		std::vector<unsigned char> goes_left;
+		if(use_presort)
+		{
+			slice_begin.assign(n_nodes,0);
+			slice_end.assign(n_nodes,0);
+			slice_end[0] = nodebag[0].size();
+			goes_left.resize(num_ids);
+		}
 
 		// Loop through nodes
 		for(int n = 0; n < n_nodes; ++n)
 		{
+			// Retained split nodes of a continued tree keep their existing
+			// split function; they only partition the data between their
+			// children, with no candidate search
+			const bool retained = continue_existing && retained_split[n];
+
 			// If this is a leaf node, set the parameters and move on
-			if(
+			if(!retained && (
 				(n > std::pow(2,n_levels-1) - 2)
 				|| (nodebag[n].size() < min_training_data)
-				|| (forest[t].nodes[n].is_leaf)
-			  )
+				|| (forest[t].is_leaf[n])
+			  ))
 			{
-				// Fit leaf distribution to this node
-				fitLeaf(t,n,nodebag[n],first_id,first_label);
+				if(continue_existing && former_leaf[n] && (nodebag[n].size() < min_training_data))
+				{
+					// A former leaf that received too little new data keeps
+					// its existing distribution rather than being refitted
+					forest[t].is_leaf[n] = 1;
+					if(2*n + 2 < n_nodes)
+					{
+						forest[t].is_leaf[2*n+1] = 1;
+						forest[t].is_leaf[2*n+2] = 1;
+					}
+				}
+				else
+				{
+					// Fit leaf distribution to this node
+					fitLeaf(t,n,nodebag[n],first_id,first_label);
+				}
 
 				// Clear the list for this node
 				nodebag[n].clear();
@@ -1033,98 +3791,321 @@ void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::train(c
 
 			float best_info_gain = std::numeric_limits<float>::lowest();
 			float best_thresh = 0.0;
+			unsigned failed_counter = 0;
 			std::array<int,TNumParams> best_params;
 			std::fill(best_params.begin(),best_params.end(),-1); // mostly to avoid annoying compiler warnings about using best_params uninitialised
 
-			// Calculate the impurity of the node before splitting
-			const float initial_impurity = static_cast<derivedProxy*>(this)->singleNodeImpurity(first_label,nodebag[n],t,n);
-
-			// Counter for parameter combinations that fail to distinguish the data at all
-			unsigned failed_counter = 0;
-
-			// Loop through a number of randomly chosen parameter sets
-			for(unsigned p = 0; p < num_param_combos_to_test ; ++p)
+			if(retained)
+			{
+				best_params = forest[t].params[n];
+				best_thresh = forest[t].thresh[n];
+			}
+			else
 			{
-				std::vector<scoreInternalIndexStruct> data_structs;
-				std::array<int,TNumParams> test_params;
-
-				// Resize array to hold scores
-				score.resize(nodebag[n].size());
 
-				// Generate random parameter values
-				std::forward<TParameterFunctor>(parameter_functor)(test_params);
+				// Calculate the impurity of the node before splitting
+				const float initial_impurity = static_cast<derivedProxy*>(this)->singleNodeImpurity(first_label,nodebag[n],t,n);
 
-				// Find the value of each of the training data for this
-				// feature and store in vectors, by class.
-				std::forward<TFeatureFunctor>(feature_functor)( boost::make_permutation_iterator(first_id,nodebag[n].cbegin()),
-																boost::make_permutation_iterator(first_id,nodebag[n].cend()),
-																test_params,score.begin());
+				// Generate the random parameter sets serially, since the
+				// parameter functor is not required to be thread safe
+				for(unsigned p = 0; p < num_param_combos_to_test ; ++p)
+					std::forward<TParameterFunctor>(parameter_functor)(combo_params[p]);
 
-				// Put the labels and scores into a vector where they can be sorted together
-				data_structs.reserve(nodebag[n].size());
-				for(unsigned d = 0; d < nodebag[n].size(); ++d)
-					data_structs.emplace_back(scoreInternalIndexStruct(score[d],nodebag[n][d]));
+				// When the feature cache is enabled, look up the score column
+				// for each candidate, and compute the columns of parameter
+				// sets drawn for the first time in this tree
+				if(cache_features)
+				{
+					std::vector<typename std::map<std::array<int,TNumParams>,std::pair<std::vector<float>,std::vector<int>>>::iterator> to_compute;
+					for(unsigned p = 0; p < num_param_combos_to_test ; ++p)
+					{
+						const auto emplace_result = feature_cache.emplace(combo_params[p],std::make_pair(std::vector<float>(),std::vector<int>()));
+						combo_columns[p] = &(emplace_result.first->second.first);
+						combo_sorted[p] = &(emplace_result.first->second.second);
+						if(emplace_result.second)
+							to_compute.emplace_back(emplace_result.first);
+					}
 
-				// Sort this vector
-				sort(data_structs.begin(),data_structs.end(), [](const scoreInternalIndexStruct& l, const scoreInternalIndexStruct& r) {return l.score < r.score;});
+					// When presorting, a feature drawn for the first time must
+					// have its sorted id array populated with a slice for the
+					// current node and every node still awaiting processing
+					std::vector<int> pending_nodes;
+					if(use_presort && !to_compute.empty())
+					{
+						for(int m = n; m < n_nodes; ++m)
+							if(!nodebag[m].empty())
+								pending_nodes.emplace_back(m);
+					}
 
-				// Skip this parameter set if there is little or no variation between the feature values
-				if( (data_structs.back().score - data_structs.front().score) <= std::numeric_limits<float>::min()*nodebag[n].size())
-				{
-					failed_counter++;
-					data_structs.clear();
-					continue;
+					#pragma omp parallel for schedule(dynamic) if(!parallelise_over_trees)
+					for(int m = 0; m < int(to_compute.size()); ++m)
+					{
+						std::vector<float>& column = to_compute[m]->second.first;
+						column.resize(num_ids);
+						std::forward<TFeatureFunctor>(feature_functor)(first_id,last_id,to_compute[m]->first,column.begin());
+#ifdef CANOPY_PROFILE
+						#pragma omp atomic
+						profile_stats.train_feature_calls += 1;
+#endif
+
+						if(use_presort)
+						{
+							std::vector<int>& sorted_ids = to_compute[m]->second.second;
+							sorted_ids.resize(bagsize);
+							for(const int pending : pending_nodes)
+							{
+								std::copy(nodebag[pending].cbegin(),nodebag[pending].cend(),sorted_ids.begin()+slice_begin[pending]);
+								std::sort(sorted_ids.begin()+slice_begin[pending],sorted_ids.begin()+slice_end[pending],
+									[&column] (const int l, const int r) {return column[l] < column[r];});
+							}
+						}
+					}
 				}
 
-				// Call the function to find the best splitting threshold and the corresponding purity measure
-				float thresh, info_gain;
-				static_cast<derivedProxy*>(this)->bestSplit(data_structs, first_label, t, n, initial_impurity, info_gain, thresh);
+#ifdef CANOPY_PROFILE
+				double prof_node_sort_seconds = 0.0;
+				double prof_node_split_seconds = 0.0;
+#endif
 
-				// If this is the best parameter set so far, update the
-				// fields of the tree
-				if(info_gain > best_info_gain)
+				// Evaluate the candidate parameter sets, in parallel threads if
+				// the tree loop is not already using them
+				#pragma omp parallel for schedule(dynamic) if(!parallelise_over_trees)
+				for(unsigned p = 0; p < num_param_combos_to_test ; ++p)
 				{
-					best_params = test_params;
-					best_thresh = thresh;
-					best_info_gain = info_gain;
+					combo_failed[p] = 0;
 
-					// Change the best_score pointer to this new score array
-					best_score.resize(score.size());
-					best_score.swap(score);
+					std::vector<scoreInternalIndexStruct> data_structs;
+					data_structs.reserve(nodebag[n].size());
+
+					if(use_presort)
+					{
+						// Read the node's slice of the feature's sorted id
+						// array, which is already in score order
+						const std::vector<int>& sorted_ids = *combo_sorted[p];
+						const std::vector<float>& column = *combo_columns[p];
+						for(int i = slice_begin[n]; i < slice_end[n]; ++i)
+							data_structs.emplace_back(scoreInternalIndexStruct(column[sorted_ids[i]],sorted_ids[i]));
+					}
+					else
+					{
+						// Task-local buffer to hold the scores
+						std::vector<float> task_score(nodebag[n].size());
+
+						if(cache_features)
+						{
+							// Gather the cached column through the node's bag
+							const std::vector<float>& column = *combo_columns[p];
+							for(unsigned d = 0; d < nodebag[n].size(); ++d)
+								task_score[d] = column[nodebag[n][d]];
+						}
+						else
+						{
+							// Find the value of each of the training data for this
+							// feature and store in vectors, by class.
+							std::forward<TFeatureFunctor>(feature_functor)( boost::make_permutation_iterator(first_id,nodebag[n].cbegin()),
+																			boost::make_permutation_iterator(first_id,nodebag[n].cend()),
+																			combo_params[p],task_score.begin());
+#ifdef CANOPY_PROFILE
+							#pragma omp atomic
+							profile_stats.train_feature_calls += 1;
+#endif
+						}
+
+						// Put the labels and scores into a vector where they can be sorted together
+						for(unsigned d = 0; d < nodebag[n].size(); ++d)
+							data_structs.emplace_back(scoreInternalIndexStruct(task_score[d],nodebag[n][d]));
+
+						// Some split routines (e.g. the classifier's histogram
+						// mode) work on unsorted scores, in which case the
+						// sort can be skipped entirely
+						if(static_cast<derivedProxy*>(this)->splitNeedsSortedScores(int(nodebag[n].size())))
+						{
+#ifdef CANOPY_PROFILE
+							const double prof_sort_start = omp_get_wtime();
+#endif
+
+							// Sort this vector
+							sort(data_structs.begin(),data_structs.end(), [](const scoreInternalIndexStruct& l, const scoreInternalIndexStruct& r) {return l.score < r.score;});
+
+#ifdef CANOPY_PROFILE
+							#pragma omp atomic
+							prof_node_sort_seconds += omp_get_wtime() - prof_sort_start;
+#endif
+						}
+					}
+
+					// Mark this parameter set as failed if there is little or no variation between the feature values
+					float score_min, score_max;
+					if(use_presort || static_cast<derivedProxy*>(this)->splitNeedsSortedScores(int(nodebag[n].size())))
+					{
+						score_min = data_structs.front().score;
+						score_max = data_structs.back().score;
+					}
+					else
+					{
+						const auto minmax_its = std::minmax_element(data_structs.cbegin(),data_structs.cend(), [](const scoreInternalIndexStruct& l, const scoreInternalIndexStruct& r) {return l.score < r.score;});
+						score_min = minmax_its.first->score;
+						score_max = minmax_its.second->score;
+					}
+					if( (score_max - score_min) <= std::numeric_limits<float>::min()*nodebag[n].size())
+					{
+						combo_failed[p] = 1;
+						continue;
+					}
+
+#ifdef CANOPY_PROFILE
+					const double prof_split_start = omp_get_wtime();
+#endif
+
+					// Call the function to find the best splitting threshold and the corresponding purity measure
+					static_cast<derivedProxy*>(this)->bestSplit(data_structs, first_label, t, n, initial_impurity, combo_info_gain[p], combo_thresh[p]);
+
+#ifdef CANOPY_PROFILE
+					#pragma omp atomic
+					prof_node_split_seconds += omp_get_wtime() - prof_split_start;
+#endif
+
+				} // loop over parameter combinations
+
+#ifdef CANOPY_PROFILE
+				{
+					// Accumulate this node's timings against its tree level
+					int prof_level = 0;
+					while((1 << (prof_level + 1)) - 1 <= n)
+						++prof_level;
+					#pragma omp critical(canopy_profile)
+					{
+						if(int(profile_stats.train_sort_seconds.size()) < n_levels)
+						{
+							profile_stats.train_sort_seconds.resize(n_levels,0.0);
+							profile_stats.train_best_split_seconds.resize(n_levels,0.0);
+						}
+						profile_stats.train_sort_seconds[prof_level] += prof_node_sort_seconds;
+						profile_stats.train_best_split_seconds[prof_level] += prof_node_split_seconds;
+					}
 				}
+#endif
 
-				data_structs.clear();
+				// Serial reduction over the candidates, in order, so that the
+				// chosen split matches what the serial loop used to produce
+				for(unsigned p = 0; p < num_param_combos_to_test ; ++p)
+				{
+					if(combo_failed[p])
+					{
+						failed_counter++;
+						continue;
+					}
+					if(combo_info_gain[p] > best_info_gain)
+					{
+						best_params = combo_params[p];
+						best_thresh = combo_thresh[p];
+						best_info_gain = combo_info_gain[p];
+					}
+				}
 
-			} // loop over parameter combinations
+			} // candidate search (!retained)
 
 			// Check to see whether the best information gain was enough to justify a split
-			if(best_info_gain > (static_cast<derivedProxy*>(this)->minInfoGain(t,n)) && failed_counter < num_param_combos_to_test)
+			if(retained || ((best_info_gain > (static_cast<derivedProxy*>(this)->minInfoGain(t,n))) && (failed_counter < num_param_combos_to_test)))
 			{
 				// Go ahead and split the node
-				forest[t].nodes[n].params = best_params;
-				forest[t].nodes[n].is_leaf = false;
-				forest[t].nodes[n].thresh = best_thresh;
-				forest[t].nodes[n].post.clear();
+				forest[t].params[n] = best_params;
+				forest[t].is_leaf[n] = 0;
+				forest[t].thresh[n] = best_thresh;
+
+				// Re-evaluate the winning feature to partition the data
+				// between the children (cheaper than keeping the scores of
+				// every candidate alive until this point). A retained split's
+				// parameter set was never a candidate, so its column is not
+				// in the cache
+				score.resize(nodebag[n].size());
+				if(cache_features && !retained)
+				{
+					const std::vector<float>& column = feature_cache[best_params].first;
+					for(unsigned d = 0; d < nodebag[n].size(); ++d)
+						score[d] = column[nodebag[n][d]];
+				}
+				else
+				{
+					std::forward<TFeatureFunctor>(feature_functor)( boost::make_permutation_iterator(first_id,nodebag[n].cbegin()),
+																	boost::make_permutation_iterator(first_id,nodebag[n].cend()),
+																	best_params,score.begin());
+#ifdef CANOPY_PROFILE
+					#pragma omp atomic
+					profile_stats.train_feature_calls += 1;
+#endif
+				}
+
 				for(unsigned d = 0; d < nodebag[n].size() ; ++d)
 				{
-					if( best_score[d] < forest[t].nodes[n].thresh)
+					if( score[d] < forest[t].thresh[n])
 						nodebag[2*n+1].emplace_back(nodebag[n][d]);
 					else
 						nodebag[2*n+2].emplace_back(nodebag[n][d]);
+					if(use_presort)
+						goes_left[nodebag[n][d]] = ( score[d] < forest[t].thresh[n] );
 				}
 
-				// Check that neither child is empty
-				assert( (nodebag[2*n+1].size() != 0) && (nodebag[2*n+2].size() != 0) );
+				// Check that neither child is empty (a retained split may
+				// legitimately send all, or none, of the new data one way)
+				assert( retained || ((nodebag[2*n+1].size() != 0) && (nodebag[2*n+2].size() != 0)) );
+
+				if(use_presort)
+				{
+					// The children inherit the two halves of this node's
+					// slice of each sorted id array
+					const int n_left = nodebag[2*n+1].size();
+					slice_begin[2*n+1] = slice_begin[n];
+					slice_end[2*n+1] = slice_begin[n] + n_left;
+					slice_begin[2*n+2] = slice_end[2*n+1];
+					slice_end[2*n+2] = slice_end[n];
+
+					// Stably partition this node's slice of every feature's
+					// sorted id array, so that each child's slice remains
+					// sorted by that feature's score
+					std::vector<std::vector<int>*> all_sorted;
+					all_sorted.reserve(feature_cache.size());
+					for(auto& entry : feature_cache)
+						all_sorted.emplace_back(&entry.second.second);
+
+					#pragma omp parallel for schedule(dynamic) if(!parallelise_over_trees)
+					for(unsigned f = 0; f < all_sorted.size(); ++f)
+					{
+						std::vector<int>& sorted_ids = *all_sorted[f];
+						std::vector<int> left_part, right_part;
+						left_part.reserve(n_left);
+						right_part.reserve(nodebag[2*n+2].size());
+						for(int i = slice_begin[n]; i < slice_end[n]; ++i)
+						{
+							if(goes_left[sorted_ids[i]])
+								left_part.emplace_back(sorted_ids[i]);
+							else
+								right_part.emplace_back(sorted_ids[i]);
+						}
+						std::copy(left_part.cbegin(),left_part.cend(),sorted_ids.begin()+slice_begin[n]);
+						std::copy(right_part.cbegin(),right_part.cend(),sorted_ids.begin()+slice_begin[n]+n_left);
+					}
+				}
 
-				// Fit a node distribution to this split node if the flag is set
-				if(fit_split_nodes)
+				// Fit a node distribution to this split node if the flag is
+				// set (a retained split keeps its existing distribution)
+				if(fit_split_nodes && !retained)
 				{
-					forest[t].nodes[n].post.resize(1);
+					TNodeDist& dist = createNodeDist(t,n);
 					static_cast<derivedProxy*>(this)->initialiseNodeDist(t,n);
 					const auto start_it_label = boost::make_permutation_iterator(first_label,nodebag[n].cbegin());
 					const auto end_it_label = boost::make_permutation_iterator(first_label,nodebag[n].cend());
 					const auto start_it_id = boost::make_permutation_iterator(first_id,nodebag[n].cbegin());
-					forest[t].nodes[n].post[0].fit(start_it_label,end_it_label,start_it_id);
+					if(sample_weights.empty())
+						dist.fit(start_it_label,end_it_label,start_it_id);
+					else
+						dist.fit(start_it_label,end_it_label,start_it_id,boost::make_permutation_iterator(sample_weights.cbegin(),nodebag[n].cbegin()));
+				}
+				else if(!retained)
+				{
+					// A former leaf that has just been split no longer needs
+					// its old leaf distribution
+					forest[t].dist_index[n] = -1;
 				}
 
 			}
@@ -1140,8 +4121,41 @@ void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::train(c
 
 		} // node loop
 
+		// Discard the orphan nodes, leaving the tree in compact form
+		compactTree(forest[t]);
+
+		// Send this tree's out-of-bag samples down the finished tree and
+		// combine the leaf distributions they reach into the shared
+		// accumulators
+		if(!oob_ids.empty())
+		{
+			std::vector<const TNodeDist*> oob_leaves(oob_ids.size());
+			findLeavesGroupwise(boost::make_permutation_iterator(first_id,oob_ids.cbegin()),
+								boost::make_permutation_iterator(first_id,oob_ids.cend()),
+								t,oob_leaves,std::forward<TFeatureFunctor>(feature_functor));
+
+			// The trees may be being trained in parallel threads, so
+			// guard the shared accumulators
+			#pragma omp critical
+			{
+				for(unsigned i = 0; i < oob_ids.size(); ++i)
+				{
+					oob_dists[oob_ids[i]].combineWith(*oob_leaves[i],first_id[oob_ids[i]]);
+					++oob_counts[oob_ids[i]];
+				}
+			}
+		}
+
 	} // tree loop
 
+	// Normalise the accumulated out-of-bag predictions
+	if(accumulate_oob)
+	{
+		for(int d = 0; d < num_ids; ++d)
+			if(oob_counts[d] > 0)
+				oob_dists[d].normalise();
+	}
+
 	// Clean-up any pre-calculated data
 	static_cast<derivedProxy*>(this)->cleanupPrecalculations();
 	valid = true;
@@ -1172,28 +4186,31 @@ template <class TIdIterator, class TLabelIterator>
 void randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::fitLeaf(const int t, const int n, const std::vector<int>& nodebag, const TIdIterator first_id, const TLabelIterator first_label)
 {
 	// Basic parameters of the node
-	std::fill(forest[t].nodes[n].params.begin(),forest[t].nodes[n].params.end(),-1);
-	forest[t].nodes[n].thresh = 0.0;
-	forest[t].nodes[n].is_leaf = true;
+	std::fill(forest[t].params[n].begin(),forest[t].params[n].end(),-1);
+	forest[t].thresh[n] = 0.0;
+	forest[t].is_leaf[n] = 1;
 
 	// If the parent is a leaf, this node is an orphan -
 	// no need for a posterior
-	if((n == 0) || (!forest[t].nodes[(n-1)/2].is_leaf))  // integer division deliberate
+	if((n == 0) || (!forest[t].is_leaf[(n-1)/2]))  // integer division deliberate
 	{
-		forest[t].nodes[n].post.resize(1);
+		TNodeDist& dist = createNodeDist(t,n);
 		static_cast<derivedProxy*>(this)->initialiseNodeDist(t,n);
 		const auto start_it_label = boost::make_permutation_iterator(first_label,nodebag.cbegin());
 		const auto end_it_label = boost::make_permutation_iterator(first_label,nodebag.cend());
 		const auto start_it_id = boost::make_permutation_iterator(first_id,nodebag.cbegin());
-		forest[t].nodes[n].post[0].fit(start_it_label,end_it_label,start_it_id);
+		if(sample_weights.empty())
+			dist.fit(start_it_label,end_it_label,start_it_id);
+		else
+			dist.fit(start_it_label,end_it_label,start_it_id,boost::make_permutation_iterator(sample_weights.cbegin(),nodebag.cbegin()));
 	}
 
 	// If we're not already in the bottom layer, set the
 	// children to leaves too
 	if(2*n + 2 < n_nodes)
 	{
-		forest[t].nodes[2*n+1].is_leaf = true;
-		forest[t].nodes[2*n+2].is_leaf = true;
+		forest[t].is_leaf[2*n+1] = 1;
+		forest[t].is_leaf[2*n+2] = 1;
 	}
 }
 
@@ -1438,4 +4455,180 @@ int randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::fastDisc
 	return best_d;
 }
 
+/*! \brief Calculates the weighted entropy of the discrete labels of a set of
+* data points.
+*
+* This is the weighted counterpart of \c fastDiscreteEntropy() : each data
+* point contributes its weight to its class rather than a count of one. Since
+* the weighted class masses are not integers, the quantity x*log(x) is
+* evaluated directly rather than looked up in a precalculated table.
+*
+* This is utility method that is provided for use in subclasses if convenient.
+*
+* \tparam TLabelIterator Type of the iterator used to access the discrete labels.
+* Must be a random access iterator that dereferences to an integral data type.
+* \param internal_index Vector containing the internal training indices of the
+* data points. These are the indices through which both the labels and the
+* weights may be accessed
+* \param n_labels The number of discrete labels. The possible values of the label
+* are assumed to be the integers in the range 0 to n_labels-1
+* \param first_label Iterator to the labels for which the entropy is to be
+* calculated. The labels should be located at the offsets from this iterator given
+* by the elements of the internal_index vector.
+* \param weights The per-data-point weights, indexed by the elements of the
+* internal_index vector. The weights must be strictly positive.
+* \return The weighted entropy of the set of labels.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TLabelIterator>
+double randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::fastWeightedDiscreteEntropy(const std::vector<int>& internal_index, const int n_labels, const TLabelIterator first_label, const std::vector<double>& weights)
+{
+	// The quantity x*log(x), taking its limiting value of zero at x = 0
+	const auto wlogw = [] (const double x) { return (x > 0.0) ? x*std::log(x) : 0.0; };
+
+	// Weighted mass of each label
+	std::vector<double> masses(n_labels,0.0);
+	double total_weight = 0.0;
+	for(int i : internal_index)
+	{
+		masses[first_label[i]] += weights[i];
+		total_weight += weights[i];
+	}
+
+	// Same formulation as the unweighted routine: multiply the expression by
+	// the total weight W to give all terms in the form WlogW, then divide at
+	// the end
+	double ret = wlogw(total_weight);
+	for(int b = 0; b < n_labels; ++b)
+		ret -= wlogw(masses[b]);
+
+	return ret/total_weight;
+}
+
+/*! \brief Find the split in a set of weighted training data that results in
+* the best information gain for discrete labels.
+*
+* This is the weighted counterpart of \c fastDiscreteEntropySplit() : each
+* data point contributes its weight to its class mass rather than a count of
+* one, and the impurities of the candidate partitions are weighted entropies.
+* Since the weighted class masses are not integers, the quantity x*log(x) is
+* evaluated directly rather than looked up in a precalculated table.
+*
+* This is utility method that is provided for use in subclasses if convenient.
+*
+* \tparam TLabelIterator Type of the iterator used to access the discrete labels.
+* Must be a random access iterator that dereferences to an integral data type.
+* \param data_structs A vector in which each element is a structure containing
+* the internal id (.id) and score (.score) for the current feature of the
+* training data points. The vector is assumed to be sorted according to the score
+* field in ascending order.
+* \param n_labels The number of discrete labels. The possible values of the label
+* are assumed to be the integers in the range 0 to n_labels-1
+* \param first_label Iterator to the labels for which the entropy is to be
+* calculated. The labels should be located at the offsets from this iterator given
+* by the IDs of elements of the data_structs vector.
+* \param weights The per-data-point weights, indexed by the IDs of elements of
+* the data_structs vector. The weights must be strictly positive.
+* \param best_split_impurity Returns by reference the impurity of the best split
+* found, as a sum over both children of their weighted entropy multiplied by
+* their total weight. Divide by the returned total_weight for the per-weight
+* impurity comparable to \c fastWeightedDiscreteEntropy() .
+* \param thresh Returns by reference the threshold of the feature score that
+* gives the best split.
+* \param total_weight Returns by reference the total weight of the data points.
+* \return The position 'd' of the best split in the training data. The partition of
+* the data resulting in the best split has the first d+1 elements in one partiiton
+* and the remainder in the other partition.
+*/
+template <class TDerived, class TLabel, class TNodeDist, class TOutputDist, unsigned TNumParams>
+template <class TLabelIterator>
+int randomForestBase<TDerived,TLabel,TNodeDist,TOutputDist,TNumParams>::fastWeightedDiscreteEntropySplit(const std::vector<scoreInternalIndexStruct>& data_structs, const int n_labels, const TLabelIterator first_label, const std::vector<double>& weights, double& best_split_impurity, float& thresh, double& total_weight)
+{
+	// Number of data samples
+	const int n_data = data_structs.size();
+
+	// The quantity x*log(x), taking its limiting value of zero at x = 0
+	const auto wlogw = [] (const double x) { return (x > 0.0) ? x*std::log(x) : 0.0; };
+
+	// Create two arrays of weighted masses for the left and right partitions
+	std::vector<double> left_binned(n_labels,0.0);
+	std::vector<double> right_binned(n_labels,0.0);
+
+	// Initialise the left partition to contain just the first datapoint,
+	// and all others in the right partition
+	left_binned[first_label[data_structs[0].id]] = weights[data_structs[0].id];
+	double left_weight = weights[data_structs[0].id];
+	double right_weight = 0.0;
+	for(int d = 1; d < n_data; ++d)
+	{
+		right_binned[first_label[data_structs[d].id]] += weights[data_structs[d].id];
+		right_weight += weights[data_structs[d].id];
+	}
+	total_weight = left_weight + right_weight;
+
+	// Intermediate results: the sum over the classes of each side of the
+	// w*log(w) of the class mass
+	double left_running_total_partial = wlogw(left_weight);
+	double right_running_total_partial = 0.0;
+	for(int b = 0; b < n_labels; ++b)
+		right_running_total_partial += wlogw(right_binned[b]);
+
+	// Compute the impurity for this first partition
+	int best_d;
+	double best_children_impurity;
+	if(data_structs[0].score == data_structs[1].score)
+	{
+		best_children_impurity = std::numeric_limits<double>::max();
+		best_d = -1;
+	}
+	else
+	{
+		best_children_impurity = (wlogw(left_weight) - left_running_total_partial) + (wlogw(right_weight) - right_running_total_partial);
+		best_d = 0;
+	}
+
+	// Loop through other partitions, move the data into the new bins and compute entropy
+	// At iteration d, datapoints 0,...,d are in the "left" partition (below the threshold)
+	// and datapoints d+1,...,N-1 are in the "right" partition (above the threshold)
+	for(int d = 1; d < n_data-1; ++d)
+	{
+		// The bin and weight of the datapoint being moved
+		const int b = first_label[data_structs[d].id];
+		const double w = weights[data_structs[d].id];
+
+		// Move the weight out of the right bin and into the left bin,
+		// updating the partial running totals (new partial - old partial)
+		left_running_total_partial += wlogw(left_binned[b]+w) - wlogw(left_binned[b]);
+		right_running_total_partial += wlogw(right_binned[b]-w) - wlogw(right_binned[b]);
+		left_binned[b] += w;
+		right_binned[b] -= w;
+		left_weight += w;
+		right_weight -= w;
+
+		// If the score of this datapoint is the same as that of the next datapoint, we cannot actually split here
+		if(data_structs[d].score == data_structs[d+1].score)
+			continue;
+
+		// Calculate the resulting purity
+		const double left_side_impurity = wlogw(left_weight) - left_running_total_partial;
+		const double right_side_impurity = wlogw(right_weight) - right_running_total_partial;
+		const double this_children_impurity = left_side_impurity + right_side_impurity;
+
+		if(this_children_impurity < best_children_impurity)
+		{
+			best_children_impurity = this_children_impurity;
+			best_d = d;
+		}
+	}
+
+	// Check that at least one datapoint had a different score from the rest
+	assert((best_d >= 0) && (best_d < n_data-1));
+
+	// Values to return
+	best_split_impurity = best_children_impurity;
+	thresh = 0.5*(data_structs[best_d].score + data_structs[best_d+1].score);
+
+	return best_d;
+}
+
 } // end of namespace